@@ -25,6 +25,7 @@
 
 #include <linux/fs.h>
 #include <linux/bitops.h>
+#include <linux/sort.h>
 #include "nova.h"
 #include "inode.h"
 #include "entry.h"
@@ -46,6 +47,7 @@ int nova_alloc_block_free_lists(struct super_block *sb)
 		free_list = nova_get_free_list(sb, i);
 		free_list->block_free_tree = RB_ROOT;
 		spin_lock_init(&free_list->s_lock);
+		spin_lock_init(&free_list->mag_lock);
 		free_list->index = i;
 	}
 
@@ -378,7 +380,7 @@ int nova_find_free_slot(struct rb_root *tree, unsigned long range_low,
 }
 
 static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
-	int num, unsigned short btype, int log_page)
+	int num, unsigned short btype, enum alloc_type atype)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct rb_root *tree;
@@ -488,10 +490,10 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 block_found:
 	free_list->num_free_blocks += num_blocks;
 
-	if (log_page) {
+	if (atype == LOG) {
 		free_list->free_log_count++;
 		free_list->freed_log_pages += num_blocks;
-	} else {
+	} else if (atype == DATA) {
 		free_list->free_data_count++;
 		free_list->freed_data_pages += num_blocks;
 	}
@@ -505,20 +507,50 @@ out:
 	return ret;
 }
 
+/*
+ * Drop the dedup reference of every block in the range and free the
+ * blocks that are not referenced anymore, one nova_free_blocks call per
+ * contiguous run.
+ */
+static int nova_free_dedup_blocks(struct super_block *sb,
+	unsigned long blocknr, int num)
+{
+	unsigned long run_start = 0;
+	int run_len = 0;
+	int ret = 0, err;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (nova_dedup_free_block(sb, blocknr + i)) {
+			if (run_len == 0)
+				run_start = blocknr + i;
+			run_len++;
+			continue;
+		}
+		if (run_len) {
+			err = nova_free_blocks(sb, run_start, run_len,
+						NOVA_BLOCK_TYPE_4K, DATA);
+			if (err)
+				ret = err;
+			run_len = 0;
+		}
+	}
+
+	if (run_len) {
+		err = nova_free_blocks(sb, run_start, run_len,
+					NOVA_BLOCK_TYPE_4K, DATA);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
+
 int nova_free_data_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long blocknr, int num)
 {
 	int ret;
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_pmm_entry *pentry, *pentries;
-	u32 weak_idx;
-	u64 strong_idx;
-	int64_t to_be_free_idx = 0;
-	// struct nova_hentry *weak_hentry, *strong_hentry;
-	struct nova_hentry *weak_find_hentry, *strong_find_hentry;
-	bool is_free = false;
 	INIT_TIMING(free_time);
-    INIT_TIMING(hash_table_time);
 
 	nova_dbgv("Inode %lu: free %d data block from %lu to %lu\n",
 			sih->ino, num, blocknr, blocknr + num - 1);
@@ -527,58 +559,10 @@ int nova_free_data_blocks(struct super_block *sb,
 		return -EINVAL;
 	}
 	NOVA_START_TIMING(free_data_t, free_time);
-	if(sih->i_blk_type == NOVA_BLOCK_TYPE_4K) {
-		pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
-		// kmem = nova_get_block(sb, nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K));
-		to_be_free_idx = sbi->blocknr_to_entry[blocknr];
-		if (to_be_free_idx >= 0) {
-			/* an entry's refcount is never changed */
-			pentry = pentries + to_be_free_idx;
-			spin_lock(sbi->non_dedup_fp_locks + to_be_free_idx % NON_DEDUP_FP_LOCK_NUM);
-			/* NOTE: pentry->fp_weak could be changed by calc_no_fin thread  */
-			weak_idx = (pentry->fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
-			strong_idx = (pentry->fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
-
-			spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
-			NOVA_START_TIMING(hash_table_t, hash_table_time);
-			weak_find_hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], &pentry->fp_weak);
-			NOVA_END_TIMING(hash_table_t, hash_table_time);
-			
-			spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
-			NOVA_START_TIMING(hash_table_t, hash_table_time);
-			strong_find_hentry = nova_find_in_strong_hlist(sb, &sbi->strong_hash_table[strong_idx], &pentry->fp_strong);
-			NOVA_END_TIMING(hash_table_t, hash_table_time);
-
-			--pentry->refcount;
-			if (pentry->refcount == 0) {
-				is_free = true;
-				if (strong_find_hentry) {
-					if (strong_find_hentry->entrynr == to_be_free_idx) {
-						hlist_del(&strong_find_hentry->node);
-						kmem_cache_free(sbi->nova_hentry_cachep, strong_find_hentry);
-					}
-				}
-				if (weak_find_hentry) {
-					if (weak_find_hentry->entrynr == to_be_free_idx) {
-						hlist_del(&weak_find_hentry->node);
-						kmem_cache_free(sbi->nova_hentry_cachep, weak_find_hentry);
-					}
-				}
-				pentry->blocknr = 0;
-				/* NON_FIN_FLAG entry is freed by background */
-				if (pentry->flag != NON_FIN_FLAG) {
-					nova_free_entry(sb, to_be_free_idx);
-				}
-			}
-			spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
-			spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
-			spin_unlock(sbi->non_dedup_fp_locks + to_be_free_idx % NON_DEDUP_FP_LOCK_NUM);
-			if (!is_free) {
-				return 0;
-			} 
-		}
-	}
-	ret = nova_free_blocks(sb, blocknr, num, sih->i_blk_type, 0);
+	if (sih->i_blk_type == NOVA_BLOCK_TYPE_4K)
+		ret = nova_free_dedup_blocks(sb, blocknr, num);
+	else
+		ret = nova_free_blocks(sb, blocknr, num, sih->i_blk_type, DATA);
 	if (ret) {
 		nova_err(sb, "Inode %lu: free %d data block from %lu to %lu "
 			 "failed!\n",
@@ -589,6 +573,127 @@ int nova_free_data_blocks(struct super_block *sb,
 
 	return ret;
 }
+/* The buffer is allocated by the first nova_free_batch_add */
+void nova_init_free_batch(struct nova_free_batch *batch)
+{
+	batch->blocknr = NULL;
+	batch->num = 0;
+	batch->max = 0;
+}
+
+static int nova_cmp_blocknr(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Drop the dedup references of all blocks in the batch, in block order,
+ * then free the unreferenced ones with one nova_free_blocks call per
+ * contiguous range. Only for 4K data blocks.
+ */
+int nova_flush_free_batch(struct super_block *sb,
+	struct nova_free_batch *batch)
+{
+	unsigned long *blocknr = batch->blocknr;
+	unsigned int i, num_free = 0, run;
+	int ret = 0, err;
+	INIT_TIMING(free_time);
+
+	if (batch->num == 0)
+		return 0;
+
+	NOVA_START_TIMING(free_data_t, free_time);
+	sort(blocknr, batch->num, sizeof(unsigned long),
+		nova_cmp_blocknr, NULL);
+
+	/* Unreferenced blocks are compacted to the front, still sorted */
+	for (i = 0; i < batch->num; i++)
+		if (nova_dedup_free_block(sb, blocknr[i]))
+			blocknr[num_free++] = blocknr[i];
+
+	for (i = 0; i < num_free; i += run) {
+		for (run = 1; i + run < num_free; run++)
+			if (blocknr[i + run] != blocknr[i] + run)
+				break;
+		err = nova_free_blocks(sb, blocknr[i], run,
+					NOVA_BLOCK_TYPE_4K, DATA);
+		if (err) {
+			nova_err(sb, "free data block %lu to %lu failed!\n",
+				 blocknr[i], blocknr[i] + run - 1);
+			ret = err;
+		}
+	}
+
+	batch->num = 0;
+	NOVA_END_TIMING(free_data_t, free_time);
+	return ret;
+}
+
+/*
+ * Returns -ENOMEM, with nothing queued, if the batch buffer cannot be
+ * allocated; the caller then frees the blocks itself.
+ */
+int nova_free_batch_add(struct super_block *sb,
+	struct nova_free_batch *batch, unsigned long blocknr, int num)
+{
+	int i;
+
+	if (!batch->blocknr) {
+		batch->blocknr = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!batch->blocknr)
+			return -ENOMEM;
+		batch->max = PAGE_SIZE / sizeof(unsigned long);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (batch->num == batch->max)
+			nova_flush_free_batch(sb, batch);
+		batch->blocknr[batch->num++] = blocknr + i;
+	}
+	return 0;
+}
+
+void nova_destroy_free_batch(struct super_block *sb,
+	struct nova_free_batch *batch)
+{
+	nova_flush_free_batch(sb, batch);
+	kfree(batch->blocknr);
+	batch->blocknr = NULL;
+}
+
+/* Free a data block allocated by nova_new_data_block and never published */
+int nova_free_data_block(struct super_block *sb, unsigned long blocknr)
+{
+	int ret;
+	INIT_TIMING(free_time);
+
+	NOVA_START_TIMING(free_data_t, free_time);
+	ret = nova_free_blocks(sb, blocknr, 1, NOVA_BLOCK_TYPE_4K, DATA);
+	if (ret)
+		nova_err(sb, "free data block %lu failed!\n", blocknr);
+	NOVA_END_TIMING(free_data_t, free_time);
+
+	return ret;
+}
+
+/* Free a superpage allocated by nova_new_data_superpage */
+int nova_free_data_superpage(struct super_block *sb, unsigned long blocknr)
+{
+	int ret;
+	INIT_TIMING(free_time);
+
+	NOVA_START_TIMING(free_data_t, free_time);
+	ret = nova_free_blocks(sb, blocknr, 1, NOVA_BLOCK_TYPE_2M, DATA);
+	if (ret)
+		nova_err(sb, "free data superpage %lu failed!\n", blocknr);
+	NOVA_END_TIMING(free_data_t, free_time);
+
+	return ret;
+}
+
 int nova_free_log_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long blocknr, int num)
 {
@@ -602,7 +707,7 @@ int nova_free_log_blocks(struct super_block *sb,
 		return -EINVAL;
 	}
 	NOVA_START_TIMING(free_log_t, free_time);
-	ret = nova_free_blocks(sb, blocknr, num, sih->i_blk_type, 1);
+	ret = nova_free_blocks(sb, blocknr, num, sih->i_blk_type, LOG);
 	if (ret) {
 		nova_err(sb, "Inode %lu: free %d log block from %lu to %lu "
 			 "failed!\n",
@@ -929,6 +1034,7 @@ static int nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
 	unsigned long new_blocknr = 0;
 	long ret_blocks = 0;
 	int retried = 0;
+	int drained = 0;
 	INIT_TIMING(alloc_time);
 
 	num_blocks = num * nova_get_numblocks(btype);
@@ -975,6 +1081,16 @@ alloc:
 	}
 
 	spin_unlock(&free_list->s_lock);
+
+	/* Space pressure: take the blocks parked in magazines back and retry */
+	if ((ret_blocks <= 0 || new_blocknr == 0) && !drained) {
+		drained = 1;
+		if (nova_drain_block_magazines(sb) > 0) {
+			cpuid = nova_get_candidate_free_list(sb);
+			retried = 0;
+			goto retry;
+		}
+	}
 	NOVA_END_TIMING(new_blocks_t, alloc_time);
 
 	if (ret_blocks <= 0 || new_blocknr == 0) {
@@ -1026,15 +1142,107 @@ int nova_new_data_blocks(struct super_block *sb,
 	return allocated;
 }
 
+/*
+ * Take one block from the magazine of this CPU, refilling it with a run of
+ * up to NOVA_MAGAZINE_BLOCKS blocks when it is empty. The refill is done
+ * without mag_lock, since nova_new_blocks may drain the magazines; if the
+ * magazine got refilled meanwhile, the rest of our run is given back.
+ * Refills and give-backs are not counted in the data allocation stats,
+ * each block handed out is, in mag_alloc_blocks.
+ */
+static int nova_magazine_new_block(struct super_block *sb,
+	unsigned long *blocknr)
+{
+	struct free_list *free_list;
+	unsigned long run_start;
+	bool installed = false;
+	int cpuid;
+	int ret;
+
+	cpuid = nova_get_cpuid(sb);
+	free_list = nova_get_free_list(sb, cpuid);
+
+	spin_lock(&free_list->mag_lock);
+	if (free_list->mag_next < free_list->mag_end) {
+		*blocknr = free_list->mag_next++;
+		free_list->mag_alloc_blocks++;
+		spin_unlock(&free_list->mag_lock);
+		return 1;
+	}
+	spin_unlock(&free_list->mag_lock);
+
+	ret = nova_new_blocks(sb, &run_start, NOVA_MAGAZINE_BLOCKS,
+			NOVA_BLOCK_TYPE_4K, ALLOC_NO_INIT, MAGAZINE, cpuid,
+			ALLOC_FROM_HEAD);
+	if (ret <= 0)
+		return ret;
+
+	*blocknr = run_start;
+
+	spin_lock(&free_list->mag_lock);
+	free_list->mag_alloc_blocks++;
+	if (ret > 1 && free_list->mag_next == free_list->mag_end) {
+		free_list->mag_next = run_start + 1;
+		free_list->mag_end = run_start + ret;
+		installed = true;
+	}
+	spin_unlock(&free_list->mag_lock);
+
+	if (ret > 1 && !installed)
+		nova_free_blocks(sb, run_start + 1, ret - 1,
+				NOVA_BLOCK_TYPE_4K, MAGAZINE);
+	return 1;
+}
+
+/*
+ * Return the unused blocks of every magazine to the free lists. Called on
+ * space pressure and before the allocator state is saved at unmount.
+ * Returns the number of blocks returned.
+ */
+unsigned long nova_drain_block_magazines(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	unsigned long start, num, drained = 0;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i);
+		spin_lock(&free_list->mag_lock);
+		start = free_list->mag_next;
+		num = free_list->mag_end - free_list->mag_next;
+		free_list->mag_next = free_list->mag_end = 0;
+		spin_unlock(&free_list->mag_lock);
+
+		if (num == 0)
+			continue;
+		if (nova_free_blocks(sb, start, num, NOVA_BLOCK_TYPE_4K,
+				     MAGAZINE))
+			nova_err(sb, "%s: failed to return blocks %lu - %lu\n",
+				 __func__, start, start + num - 1);
+		else
+			drained += num;
+	}
+
+	return drained;
+}
+
 int nova_new_data_block(struct super_block *sb,unsigned long *blocknr,
 	enum nova_alloc_init zero)
 {
+	void *bp;
 	int allocated;
 	INIT_TIMING(alloc_time);
 
 	NOVA_START_TIMING(new_data_blocks_t, alloc_time);
-	allocated = nova_new_blocks(sb, blocknr, 1,
-			    NOVA_BLOCK_TYPE_4K, zero, DATA, ANY_CPU, ALLOC_FROM_HEAD);
+	allocated = nova_magazine_new_block(sb, blocknr);
+	if (allocated > 0 && zero) {
+		bp = nova_get_block(sb, nova_get_block_off(sb, *blocknr,
+						NOVA_BLOCK_TYPE_4K));
+		nova_memunlock_range(sb, bp, PAGE_SIZE);
+		memset_nt(bp, 0, PAGE_SIZE);
+		nova_memlock_range(sb, bp, PAGE_SIZE);
+	}
 	NOVA_END_TIMING(new_data_blocks_t, alloc_time);
 	if (allocated < 0) {
 		nova_dbgv("FAILED: alloc %d data blocks from %lu to %lu\n",
@@ -1048,6 +1256,28 @@ int nova_new_data_block(struct super_block *sb,unsigned long *blocknr,
 	return allocated;
 }
 
+/*
+ * Allocate 512 contiguous data blocks starting at a 2MB boundary, so that
+ * they can be mapped with a single PMD. Fails with -ENOSPC rather than
+ * returning an unaligned range.
+ */
+int nova_new_data_superpage(struct super_block *sb, unsigned long *blocknr)
+{
+	int allocated;
+	INIT_TIMING(alloc_time);
+
+	NOVA_START_TIMING(new_data_blocks_t, alloc_time);
+	allocated = nova_new_blocks(sb, blocknr, 1, NOVA_BLOCK_TYPE_2M,
+			ALLOC_NO_INIT, DATA, ANY_CPU, ALLOC_FROM_HEAD);
+	NOVA_END_TIMING(new_data_blocks_t, alloc_time);
+	if (allocated > 0 && (*blocknr & PAGES_PER_2MB_MASK)) {
+		nova_free_blocks(sb, *blocknr, 1, NOVA_BLOCK_TYPE_2M, DATA);
+		allocated = -ENOSPC;
+	}
+	nova_dbgv("alloc superpage %d @ %lu\n", allocated, *blocknr);
+	return allocated;
+}
+
 // Allocate log blocks.	 The offset for the allocated block comes back in
 // blocknr.  Return the number of blocks allocated.
 int nova_new_log_blocks(struct super_block *sb,
@@ -1084,6 +1314,10 @@ unsigned long nova_count_free_blocks(struct super_block *sb)
 	for (i = 0; i < sbi->cpus; i++) {
 		free_list = nova_get_free_list(sb, i);
 		num_free_blocks += free_list->num_free_blocks;
+		/* Blocks parked in the magazine are still free */
+		spin_lock(&free_list->mag_lock);
+		num_free_blocks += free_list->mag_end - free_list->mag_next;
+		spin_unlock(&free_list->mag_lock);
 	}
 
 	return num_free_blocks;
@@ -35,6 +35,16 @@ struct free_list {
 
 	u32		csum;		/* Protect integrity */
 
+	/* Magazine: a run of blocks reserved for single-block data
+	 * allocations, handed out from mag_next up to mag_end (exclusive).
+	 * Counted as free, protected by mag_lock.
+	 */
+	spinlock_t	mag_lock;
+	unsigned long	mag_next;
+	unsigned long	mag_end;
+	/* Blocks handed out by the magazine, one data allocation each */
+	unsigned long	mag_alloc_blocks;
+
 	/* Statistics */
 	unsigned long	alloc_log_count;
 	unsigned long	alloc_data_count;
@@ -56,6 +66,20 @@ struct free_list *nova_get_free_list(struct super_block *sb, int cpu)
 	return &sbi->free_lists[cpu];
 }
 
+/*
+ * Data blocks released while a file tree is reassigned. They are freed
+ * together, sorted, so dedup refcounts are dropped in block order and
+ * adjacent blocks reach the free list as one range.
+ */
+struct nova_free_batch {
+	unsigned long	*blocknr;
+	unsigned int	num;
+	unsigned int	max;
+};
+
+/* Blocks reserved per magazine refill */
+#define NOVA_MAGAZINE_BLOCKS	64
+
 enum nova_alloc_direction {ALLOC_FROM_HEAD = 0,
 			   ALLOC_FROM_TAIL = 1};
 
@@ -65,6 +89,7 @@ enum nova_alloc_init {ALLOC_NO_INIT = 0,
 enum alloc_type {
 	LOG = 1,
 	DATA,
+	MAGAZINE,	/* DATA moving in or out of a magazine, not counted */
 };
 
 
@@ -93,6 +118,16 @@ void nova_free_vma_item(struct super_block *sb,
 extern void nova_init_blockmap(struct super_block *sb, int recovery);
 extern int nova_free_data_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long blocknr, int num);
+extern int nova_free_data_block(struct super_block *sb, unsigned long blocknr);
+extern void nova_init_free_batch(struct nova_free_batch *batch);
+extern int nova_free_batch_add(struct super_block *sb,
+	struct nova_free_batch *batch, unsigned long blocknr, int num);
+extern int nova_flush_free_batch(struct super_block *sb,
+	struct nova_free_batch *batch);
+extern void nova_destroy_free_batch(struct super_block *sb,
+	struct nova_free_batch *batch);
+extern int nova_free_data_superpage(struct super_block *sb,
+	unsigned long blocknr);
 extern int nova_free_log_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long blocknr, int num);
 extern int nova_new_data_blocks(struct super_block *sb,
@@ -102,12 +137,15 @@ extern int nova_new_data_blocks(struct super_block *sb,
 	enum nova_alloc_direction from_tail);
 extern int nova_new_data_block(struct super_block *sb,unsigned long *blocknr,
 	enum nova_alloc_init zero);
+extern int nova_new_data_superpage(struct super_block *sb,
+	unsigned long *blocknr);
 extern int nova_new_log_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih,
 	unsigned long *blocknr, unsigned int num,
 	enum nova_alloc_init zero, int cpu,
 	enum nova_alloc_direction from_tail);
 extern unsigned long nova_count_free_blocks(struct super_block *sb);
+extern unsigned long nova_drain_block_magazines(struct super_block *sb);
 int nova_search_inodetree(struct nova_sb_info *sbi,
 	unsigned long ino, struct nova_range_node **ret_node);
 int nova_insert_blocktree(struct rb_root *tree,
@@ -33,6 +33,7 @@
 #include "super.h"
 #include "inode.h"
 #include "log.h"
+#include "entry.h"
 
 void nova_init_header(struct super_block *sb,
 	struct nova_inode_info_header *sih, u16 i_mode)
@@ -1432,6 +1433,32 @@ static int nova_failure_recovery_crawl(struct super_block *sb)
 	return ret;
 }
 
+/*
+ * Entry table chunks are data blocks that only the entry directory points
+ * at. Chunks are added in directory order, so the first empty slot ends
+ * the table.
+ */
+static void nova_set_entry_table_bm(struct super_block *sb,
+	struct scan_bitmap *bm)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long nr = sbi->num_entries >> NOVA_ENTRY_CHUNK_SHIFT(sbi);
+	unsigned long i, blocknr;
+	__le64 *dir;
+
+	if (nr == 0)
+		return;
+
+	dir = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start,
+						    NOVA_BLOCK_TYPE_4K));
+	for (i = 0; i < nr; i++) {
+		blocknr = le64_to_cpu(dir[i]);
+		if (blocknr == 0 || blocknr >= sbi->num_blocks)
+			break;
+		set_bm(blocknr, bm, BM_4K);
+	}
+}
+
 int nova_failure_recovery(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -1458,6 +1485,8 @@ int nova_failure_recovery(struct super_block *sb)
 		set_bm(pair->journal_head >> PAGE_SHIFT, global_bm[i], BM_4K);
 	}
 
+	nova_set_entry_table_bm(sb, global_bm[0]);
+
 	i = NOVA_SNAPSHOT_INO % sbi->cpus;
 	pi = nova_get_inode_by_ino(sb, NOVA_SNAPSHOT_INO);
 	/* Set snapshot info log pages */
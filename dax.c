@@ -250,9 +250,13 @@ int nova_reassign_file_tree(struct super_block *sb,
 	struct nova_file_write_entry *entryc, entry_copy;
 	u64 curr_p = begin_tail;
 	size_t entry_size = sizeof(struct nova_file_write_entry);
+	struct nova_free_batch batch;
+	int ret = 0;
 
 	entryc = (metadata_csum == 0) ? entry : &entry_copy;
 
+	nova_init_free_batch(&batch);
+
 	while (curr_p && curr_p != sih->log_tail) {
 		if (is_last_entry(curr_p, entry_size))
 			curr_p = next_log_page(sb, curr_p);
@@ -260,7 +264,8 @@ int nova_reassign_file_tree(struct super_block *sb,
 		if (curr_p == 0) {
 			nova_err(sb, "%s: File inode %lu log is NULL!\n",
 				__func__, sih->ino);
-			return -EINVAL;
+			ret = -EINVAL;
+			break;
 		}
 
 		addr = (void *) nova_get_block(sb, curr_p);
@@ -268,8 +273,10 @@ int nova_reassign_file_tree(struct super_block *sb,
 
 		if (metadata_csum == 0)
 			entryc = entry;
-		else if (!nova_verify_entry_csum(sb, entry, entryc))
-			return -EIO;
+		else if (!nova_verify_entry_csum(sb, entry, entryc)) {
+			ret = -EIO;
+			break;
+		}
 
 		if (nova_get_entry_type(entryc) != FILE_WRITE) {
 			nova_dbg("%s: entry type is not write? %d\n",
@@ -278,11 +285,12 @@ int nova_reassign_file_tree(struct super_block *sb,
 			continue;
 		}
 
-		nova_assign_write_entry(sb, sih, entry, entryc, true);
+		nova_assign_write_entry(sb, sih, entry, entryc, true, &batch);
 		curr_p += entry_size;
 	}
 
-	return 0;
+	nova_destroy_free_batch(sb, &batch);
+	return ret;
 }
 
 int nova_cleanup_incomplete_write(struct super_block *sb,
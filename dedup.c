@@ -1,7 +1,9 @@
 #include <linux/fs.h>
-#include "dedup.h"
+#include <linux/prefetch.h>
+#include <linux/vmalloc.h>
 #include "nova.h"
-#include <linux/random.h>
+#include "dedup.h"
+#include "nova_trace.h"
 
 #define FP_NOT_FOUND -1
 
@@ -10,6 +12,16 @@ inline bool cmp_fp_strong(struct nova_fp_strong *dst, struct nova_fp_strong *src
             && dst->u64s[2] == src->u64s[2] && dst->u64s[3] == src->u64s[3] );
 }
 
+/**
+ * The weak fingerprint is the crc32c of the block with the data checksum
+ * seed, the value nova_calc_block_stripe_csums folds from the stripe
+ * checksums, so writers that checksum the block get it for free.
+ */
+void nova_fp_weak_calc(const void *addr, struct nova_fp_weak *fp)
+{
+    fp->u32 = nova_crc32c(NOVA_INIT_CSUM, addr, PAGE_SIZE);
+}
+
 int nova_alloc_block_write(struct super_block *sb,const char *data_buffer, unsigned long *blocknr)
 {
     int allocated = 0;
@@ -42,54 +54,347 @@ out:
     return allocated;
 }
 
-struct nova_hentry *nova_alloc_hentry(struct super_block *sb)
+/**
+ * Byte-exact compare of two 4K chunks, eight words per iteration with the
+ * differences folded together so the loop has a single branch per 64B.
+ */
+static bool nova_dedup_block_equal(const void *a, const void *b)
+{
+    const u64 *x = a, *y = b;
+    u64 diff;
+    int i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(u64); i += 8) {
+        diff = (x[i] ^ y[i]) | (x[i + 1] ^ y[i + 1]) |
+               (x[i + 2] ^ y[i + 2]) | (x[i + 3] ^ y[i + 3]) |
+               (x[i + 4] ^ y[i + 4]) | (x[i + 5] ^ y[i + 5]) |
+               (x[i + 6] ^ y[i + 6]) | (x[i + 7] ^ y[i + 7]);
+        if (diff)
+            return false;
+    }
+    return true;
+}
+
+/* The node linking entrynr into a chain of the budgeted index, if any */
+static struct nova_hentry *nova_index_find_entry(struct nova_sb_info *sbi,
+    struct hlist_head *hlist, entrynr_t entrynr, bool strong)
+{
+    struct nova_hentry *hentry;
+
+    if (strong) {
+        hlist_for_each_entry(hentry, hlist, strong_node)
+            if (nova_hentry_entrynr(sbi, hentry) == entrynr)
+                return hentry;
+    } else {
+        hlist_for_each_entry(hentry, hlist, weak_node)
+            if (nova_hentry_entrynr(sbi, hentry) == entrynr)
+                return hentry;
+    }
+    return NULL;
+}
+
+static inline void nova_index_touch(struct nova_sb_info *sbi, struct nova_hentry *hentry)
+{
+    if (sbi->index_slots)
+        WRITE_ONCE(sbi->index_slots[hentry - sbi->hentries].referenced, true);
+}
+
+/**
+ * Unlink the node of a slot to recycle it, if the stripe lock of its
+ * chain can be taken. Callers hold index_lock and possibly stripe locks
+ * of their own, so the lock is only tried: a node on a stripe the caller
+ * holds, or on a busy one, is passed over.
+ */
+static bool nova_index_evict(struct super_block *sb, struct nova_hentry *hentry, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_fp_weak fp_weak;
+    struct spinlock *lock;
+    bool evicted = false;
+
+    if (!hlist_unhashed(&hentry->weak_node)) {
+        fp_weak.u32 = hentry->fp_weak;
+        lock = sbi->weak_hash_table_locks +
+            (fp_weak.u32 & ((1 << sbi->index_bits) - 1)) % HASH_TABLE_LOCK_NUM;
+        if (!spin_trylock(lock))
+            return false;
+        /* A racing free may have unlinked it meanwhile */
+        if (!hlist_unhashed(&hentry->weak_node)) {
+            hlist_del_init(&hentry->weak_node);
+            nova_filter_del(&sbi->weak_filter, &fp_weak);
+            nova_filter_add(&sbi->evicted_filter, &fp_weak);
+            evicted = true;
+        }
+        spin_unlock(lock);
+    } else if (!hlist_unhashed(&hentry->strong_node)) {
+        /* strong and 2MB chains share the strong stripe locks */
+        lock = sbi->strong_hash_table_locks +
+            (nova_entry_fp_strong_key(sbi, entrynr) & ((1 << sbi->index_bits) - 1)) % HASH_TABLE_LOCK_NUM;
+        if (!spin_trylock(lock))
+            return false;
+        if (!hlist_unhashed(&hentry->strong_node)) {
+            hlist_del_init(&hentry->strong_node);
+            evicted = true;
+        }
+        spin_unlock(lock);
+    }
+    if (evicted)
+        NOVA_STATS_ADD(index_evictions, 1);
+    return evicted;
+}
+
+/**
+ * Take a node of the budgeted index for entrynr. The CLOCK hand gives
+ * referenced slots a second chance and stops at a free or evictable one.
+ * Returns NULL after NOVA_INDEX_SCAN_MAX slots, the entry then stays out
+ * of DRAM. The caller links the node before dropping its stripe lock.
+ */
+static struct nova_hentry *nova_index_alloc_node(struct super_block *sb, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_index_slot *slot;
+    struct nova_hentry *hentry, *found = NULL;
+    entrynr_t owner;
+    unsigned long scanned;
+
+    spin_lock(&sbi->index_lock);
+    for (scanned = 0; scanned < NOVA_INDEX_SCAN_MAX; scanned++) {
+        slot = sbi->index_slots + sbi->index_hand;
+        hentry = sbi->hentries + sbi->index_hand;
+        if (++sbi->index_hand == sbi->index_nr_slots)
+            sbi->index_hand = 0;
+
+        owner = READ_ONCE(slot->entrynr);
+        if (owner == NOVA_INDEX_SLOT_FREE) {
+            found = hentry;
+            break;
+        }
+        if (READ_ONCE(slot->referenced)) {
+            WRITE_ONCE(slot->referenced, false);
+            continue;
+        }
+        if (nova_index_evict(sb, hentry, owner)) {
+            found = hentry;
+            break;
+        }
+    }
+    if (found) {
+        slot->referenced = true;
+        WRITE_ONCE(slot->entrynr, entrynr);
+    }
+    spin_unlock(&sbi->index_lock);
+    return found;
+}
+
+/* Return a node unlinked by the caller, under its stripe lock */
+static inline void nova_index_release(struct nova_sb_info *sbi, struct nova_hentry *hentry)
+{
+    WRITE_ONCE(sbi->index_slots[hentry - sbi->hentries].entrynr, NOVA_INDEX_SLOT_FREE);
+}
+
+/**
+ * The index node of an entry is preallocated, so linking never allocates.
+ * A budgeted index takes a node from its pool instead, and may leave the
+ * entry out, as does a PMEM index whose buckets are full. Callers hold the
+ * stripe lock of the bucket.
+ */
+void nova_link_weak_hentry(struct super_block *sb, entrynr_t entrynr, struct nova_fp_weak *fp_weak, u32 weak_idx)
 {
     struct nova_sb_info *sbi = NOVA_SB(sb);
     struct nova_hentry *hentry;
 
-    hentry = kmem_cache_zalloc(sbi->nova_hentry_cachep, GFP_ATOMIC);
-    if(unlikely(!hentry))
-        return NULL;
-    INIT_HLIST_NODE(&hentry->node);
-    return hentry;
+    if (nova_dedup_pindex(sbi)) {
+        if (nova_pindex_insert(&sbi->weak_pindex, fp_weak->u32, fp_weak->u32, entrynr))
+            NOVA_STATS_ADD(pindex_full, 1);
+        return;
+    }
+    if (sbi->index_slots) {
+        if (nova_index_find_entry(sbi, &sbi->weak_hash_table[weak_idx], entrynr, false))
+            return;
+        hentry = nova_index_alloc_node(sb, entrynr);
+        if (!hentry)
+            return;
+    } else {
+        hentry = nova_get_hentry(sbi, entrynr);
+        if(!hlist_unhashed(&hentry->weak_node))
+            return;
+    }
+    hentry->fp_weak = fp_weak->u32;
+    hlist_add_head(&hentry->weak_node, &sbi->weak_hash_table[weak_idx]);
+    nova_filter_add(&sbi->weak_filter, fp_weak);
 }
 
+void nova_link_strong_hentry(struct super_block *sb, entrynr_t entrynr, struct nova_fp_strong *fp_strong, u64 strong_idx)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_hentry *hentry;
 
+    if (nova_dedup_pindex(sbi)) {
+        if (nova_pindex_insert(&sbi->strong_pindex, fp_strong->u64s[0],
+                    NOVA_FP_STRONG_TAG(fp_strong), entrynr))
+            NOVA_STATS_ADD(pindex_full, 1);
+        return;
+    }
+    if (sbi->index_slots) {
+        if (nova_index_find_entry(sbi, &sbi->strong_hash_table[strong_idx], entrynr, true))
+            return;
+        hentry = nova_index_alloc_node(sb, entrynr);
+        if (!hentry)
+            return;
+    } else {
+        hentry = nova_get_hentry(sbi, entrynr);
+        if(!hlist_unhashed(&hentry->strong_node))
+            return;
+    }
+    hentry->fp_strong_tag = NOVA_FP_STRONG_TAG(fp_strong);
+    hlist_add_head(&hentry->strong_node, &sbi->strong_hash_table[strong_idx]);
+}
 
+/**
+ * A new chunk missed the weak table. With a budgeted index, count it if
+ * its weak fingerprint was evicted: an estimate of the dedup lost to the
+ * budget, as the filter only errs towards positives.
+ */
+static inline void nova_index_note_miss(struct nova_sb_info *sbi, const struct nova_fp_weak *fp_weak)
+{
+    if (sbi->index_slots && nova_filter_may_contain(&sbi->evicted_filter, fp_weak))
+        NOVA_STATS_ADD(index_evicted_miss, 1);
+}
+
+/* The weak fingerprint is cached in full, so the chain walk never touches PMEM */
 struct nova_hentry *nova_find_in_weak_hlist(struct super_block *sb, struct hlist_head *hlist, struct nova_fp_weak *fp_weak)
 {
     struct nova_hentry *hentry;
-    struct nova_sb_info *sbi = NOVA_SB(sb);
-    struct nova_pmm_entry *pentries, *pentry;
 
-    pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
-    hlist_for_each_entry(hentry, hlist, node) {
-        pentry = pentries + hentry->entrynr;
-        if(pentry->fp_weak.u32 == fp_weak->u32)
+    hlist_for_each_entry(hentry, hlist, weak_node) {
+        if(hentry->fp_weak == fp_weak->u32) {
+            nova_index_touch(NOVA_SB(sb), hentry);
             return hentry;
+        }
     }
 
     return NULL;
 }
 
+/* Only entries whose cached tag matches are compared against PMEM */
 struct nova_hentry *nova_find_in_strong_hlist(struct super_block *sb, struct hlist_head *hlist, struct nova_fp_strong *fp_strong)
 {
     struct nova_hentry *hentry;
     struct nova_sb_info *sbi = NOVA_SB(sb);
-    struct nova_pmm_entry *pentries, *pentry;
+    u32 tag = NOVA_FP_STRONG_TAG(fp_strong);
 
-    pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
-    hlist_for_each_entry(hentry, hlist, node) {
-        pentry = pentries + hentry->entrynr;
-        if(cmp_fp_strong(&pentry->fp_strong, fp_strong))
+    hlist_for_each_entry(hentry, hlist, strong_node) {
+        if(hentry->fp_strong_tag != tag)
+            continue;
+        if(nova_entry_fp_strong_equal(sbi, nova_hentry_entrynr(sbi, hentry), fp_strong)) {
+            nova_index_touch(sbi, hentry);
             return hentry;
+        }
     }
 
     return NULL;
 }
 
+/**
+ * Look a fingerprint up in the DRAM chains or the PMEM index, and return
+ * the entry found in *entrynr. Callers hold the stripe lock of the bucket.
+ */
+bool nova_dedup_find_weak(struct super_block *sb, struct nova_fp_weak *fp_weak, u32 weak_idx, entrynr_t *entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_hentry *hentry;
+    unsigned int pos = 0;
+
+    if (nova_dedup_pindex(sbi))
+        return nova_pindex_next(&sbi->weak_pindex, fp_weak->u32, fp_weak->u32, &pos, entrynr);
+
+    hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], fp_weak);
+    if (!hentry)
+        return false;
+    *entrynr = nova_hentry_entrynr(sbi, hentry);
+    return true;
+}
+
+bool nova_dedup_find_strong(struct super_block *sb, struct nova_fp_strong *fp_strong, u64 strong_idx, entrynr_t *entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_hentry *hentry;
+    unsigned int pos = 0;
+
+    if (nova_dedup_pindex(sbi)) {
+        /* a slot only holds a tag, confirm it against the entry */
+        while (nova_pindex_next(&sbi->strong_pindex, fp_strong->u64s[0],
+                    NOVA_FP_STRONG_TAG(fp_strong), &pos, entrynr))
+            if (nova_entry_fp_strong_equal(sbi, *entrynr, fp_strong))
+                return true;
+        return false;
+    }
+
+    hentry = nova_find_in_strong_hlist(sb, &sbi->strong_hash_table[strong_idx], fp_strong);
+    if (!hentry)
+        return false;
+    *entrynr = nova_hentry_entrynr(sbi, hentry);
+    return true;
+}
 
-int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned long *blocknr) 
+
+/**
+ * Allocate an entry and a block and write the chunk without holding any
+ * stripe lock. The entry is filled and persisted, but not indexed yet.
+ * Checksums and parity are written here too, so that a block is protected
+ * before anyone can dedup against it.
+ */
+static int nova_dedup_prepare_entry(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr, entrynr_t *entrynr, u8 flag,
+    struct nova_fp_weak *fp_weak, struct nova_fp_strong *fp_strong)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    int allocated;
+
+    allocated = nova_alloc_entry(sb, entrynr);
+    if(allocated < 0)
+        return allocated;
+    allocated = nova_alloc_block_write(sb, chunk->data, blocknr);
+    if(allocated < 0) {
+        nova_free_entry(sb, *entrynr);
+        return allocated;
+    }
+    if(data_csum > 0 || data_parity > 0)
+        nova_update_block_csum_parity_precomputed(sb, chunk->data, *blocknr,
+                            chunk->stripe_csums);
+
+    nova_entry_set_flag(sbi, *entrynr, flag);
+    if(fp_weak)
+        *nova_entry_fp_weak(sbi, *entrynr) = *fp_weak;
+    if(fp_strong)
+        nova_entry_set_fp_strong(sbi, *entrynr, fp_strong);
+    nova_entry_set_blocknr(sbi, *entrynr, *blocknr);
+    nova_entry_set_refcount(sbi, *entrynr, 1);
+    nova_entry_flush(sbi, *entrynr);
+    sbi->blocknr_to_entry[*blocknr] = *entrynr;
+
+    return allocated;
+}
+
+/**
+ * Undo nova_dedup_prepare_entry for a writer that lost the insertion race
+ * to a concurrent writer of the same chunk. Called without stripe locks.
+ */
+static void nova_dedup_discard_entry(struct super_block *sb, entrynr_t entrynr, unsigned long blocknr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+
+    nova_entry_set_refcount(sbi, entrynr, 0);
+    nova_entry_set_blocknr(sbi, entrynr, 0);
+    nova_entry_flush(sbi, entrynr);
+    sbi->blocknr_to_entry[blocknr] = -1;
+    nova_free_entry(sb, entrynr);
+    nova_free_data_block(sb, blocknr);
+    NOVA_STATS_ADD(dedup_race_discard, 1);
+}
+
+int nova_dedup_str_fin(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr) 
 {
     /**
      *  Str_Fin method calculates a single strong fingerprint for data 
@@ -101,15 +406,20 @@ int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned
      */
 
     struct nova_sb_info *sbi = NOVA_SB(sb);
+    const char *data_buffer = chunk->data;
     struct nova_fp_weak fp_weak;
     struct nova_fp_strong fp_strong = {0} ;
     struct nova_fp_strong entry_fp_strong = {0} ;
-    struct nova_pmm_entry *pentries, *pentry;
+    u64 refcount;
     u32 weak_idx;
     u64 strong_idx;
-    struct nova_hentry *weak_find_hentry, *strong_find_hentry;
-    struct nova_hentry *strong_hentry, *weak_hentry;
-    entrynr_t alloc_entry,strong_find_entry;
+    entrynr_t weak_find_entry, strong_find_entry;
+    bool weak_found, strong_found;
+    entrynr_t alloc_entry = 0;
+    entrynr_t cached_entry;
+    unsigned long cached_blocknr;
+    unsigned long alloc_blocknr = 0;
+    bool prepared = false;
     char *kmem;
     int allocated = 0;
     // void *kmem;
@@ -117,109 +427,214 @@ int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned
     INIT_TIMING(strong_fp_calc_time);
     INIT_TIMING(hash_table_time);
 
-    pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
+    if(chunk->fp_strong) {
+        fp_strong = *chunk->fp_strong;
+    } else {
+        NOVA_START_TIMING(strong_fp_calc_t, strong_fp_calc_time);
+        nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, data_buffer, &fp_strong);
+        NOVA_END_TIMING(strong_fp_calc_t, strong_fp_calc_time);
+    }
 
-    NOVA_START_TIMING(weak_fp_calc_t, weak_fp_calc_time);
-    nova_fp_weak_calc(&sbi->nova_fp_weak_ctx, data_buffer,&fp_weak);
-    NOVA_END_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+    /**
+     * Hot fingerprints are served by the DRAM cache: no chain walk,
+     * no PMEM fingerprint compare and no weak fingerprint at all.
+     */
+    strong_idx = (fp_strong.u64s[0] & ((1 << sbi->index_bits) - 1));
+	spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+    if(nova_fp_cache_lookup(&sbi->fp_cache, &fp_strong, &cached_entry, &cached_blocknr)) {
+        refcount = nova_entry_add_ref(sbi, cached_entry, 1);
+        nova_entry_flush_refcount(sbi, cached_entry);
+        trace_nova_dedup_lookup(sb, NOVA_LOOKUP_CACHE_HIT, cached_entry, cached_blocknr);
+        trace_nova_dedup_ref_get(sb, cached_entry, cached_blocknr, refcount);
+	    spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+        NOVA_STATS_ADD(fp_cache_hit, 1);
+        ++sbi->dup_block;
+        *blocknr = cached_blocknr;
+        chunk->existed = true;
+        return 1;
+    }
+	spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+    NOVA_STATS_ADD(fp_cache_miss, 1);
 
-    NOVA_START_TIMING(strong_fp_calc_t, strong_fp_calc_time);
-    nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, data_buffer, &fp_strong);
-    NOVA_END_TIMING(strong_fp_calc_t, strong_fp_calc_time);
+    if(chunk->fp_weak) {
+        fp_weak = *chunk->fp_weak;
+    } else {
+        NOVA_START_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+        nova_fp_weak_calc(data_buffer, &fp_weak);
+        NOVA_END_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+    }
 
-    weak_idx = (fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
+    weak_idx = (fp_weak.u32 & ((1 << sbi->index_bits) - 1));
+retry:
 	spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
     NOVA_START_TIMING(hash_table_t, hash_table_time);
-    weak_find_hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], &fp_weak);
+    weak_found = nova_dedup_find_weak(sb, &fp_weak, weak_idx, &weak_find_entry);
     NOVA_END_TIMING(hash_table_t, hash_table_time);
     
-    strong_idx = (fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
 	spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
     NOVA_START_TIMING(hash_table_t, hash_table_time);
-    strong_find_hentry = nova_find_in_strong_hlist(sb, &sbi->strong_hash_table[strong_idx], &fp_strong);
+    strong_found = nova_dedup_find_strong(sb, &fp_strong, strong_idx, &strong_find_entry);
     NOVA_END_TIMING(hash_table_t, hash_table_time);
 
-    if( strong_find_hentry ) {
-        pentry = pentries + strong_find_hentry->entrynr;
-        ++pentry->refcount;
-        pentry->fp_weak = fp_weak;
-        pentry->flag = FP_STRONG_FLAG;
+    /* a chunk is counted once, by the lookup before it was written */
+    if (!prepared) {
+        NOVA_STATS_ADD(weak_found ? weak_table_hit : weak_table_miss, 1);
+        NOVA_STATS_ADD(strong_found ? strong_table_hit : strong_table_miss, 1);
+    }
+
+    if( strong_found ) {
+        refcount = nova_entry_add_ref(sbi, strong_find_entry, 1);
+        *nova_entry_fp_weak(sbi, strong_find_entry) = fp_weak;
+        nova_entry_set_flag(sbi, strong_find_entry, FP_STRONG_FLAG);
+        nova_entry_flush(sbi, strong_find_entry);
         ++sbi->dup_block;
-        *blocknr = pentry->blocknr;
+        *blocknr = nova_entry_blocknr(sbi, strong_find_entry);
         allocated = 1;
-        strong_find_entry = strong_find_hentry->entrynr;
-    }else {
-        /* handle the situation */
-        if (weak_find_hentry) {
-            pentry = pentries + weak_find_hentry->entrynr;
-            kmem = nova_get_block(sb, nova_get_block_off(sb, pentry->blocknr, NOVA_BLOCK_TYPE_4K));
-            nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, kmem, &entry_fp_strong);
-            if (cmp_fp_strong(&entry_fp_strong, &fp_strong)) {
-                pentry->fp_strong = entry_fp_strong;
-                ++pentry->refcount;
-                pentry->flag = FP_STRONG_FLAG;
-                ++sbi->dup_block;
-                *blocknr = pentry->blocknr;
-                allocated = 1;
-                strong_hentry = nova_alloc_hentry(sb);
-                strong_hentry->entrynr = weak_find_hentry->entrynr;
-                hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
-                strong_find_entry = weak_find_hentry->entrynr;
-            }
-            else {
-                alloc_entry = nova_alloc_entry(sb);
-                allocated = nova_alloc_block_write(sb,data_buffer,blocknr);
-                if(allocated < 0) 
-                    goto out;
-
-                pentry = pentries + alloc_entry;
-                pentry->flag = FP_STRONG_FLAG;
-                pentry->blocknr = *blocknr;
-                pentry->fp_strong = fp_strong;
-                pentry->fp_weak = fp_weak;
-                pentry->refcount = 1;
-                strong_hentry = nova_alloc_hentry(sb);
-                strong_hentry->entrynr = alloc_entry;
-                hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
-                sbi->blocknr_to_entry[*blocknr] = alloc_entry;
-                strong_find_entry = alloc_entry;
-            }
-        }
-        else {
-            alloc_entry = nova_alloc_entry(sb);
-            allocated = nova_alloc_block_write(sb,data_buffer,blocknr);
-            if(allocated < 0) 
-                goto out;
-
-            pentry = pentries + alloc_entry;
-            pentry->flag = FP_STRONG_FLAG;
-            pentry->blocknr = *blocknr;
-            pentry->fp_strong = fp_strong;
-            pentry->fp_weak = fp_weak;
-            pentry->refcount = 1;
-            strong_hentry = nova_alloc_hentry(sb);
-            strong_hentry->entrynr = alloc_entry;
-            hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
-            sbi->blocknr_to_entry[*blocknr] = alloc_entry;
-            strong_find_entry = alloc_entry;
-        }
+        chunk->existed = true;
+        trace_nova_dedup_lookup(sb, NOVA_LOOKUP_STRONG_HIT, strong_find_entry, *blocknr);
+        trace_nova_dedup_ref_get(sb, strong_find_entry, *blocknr, refcount);
+        nova_fp_cache_insert(&sbi->fp_cache, &fp_strong, strong_find_entry, *blocknr);
+        goto link_weak;
     }
 
-    nova_flush_buffer(pentry, sizeof(*pentry), true);
+    /**
+     * A weak hit is confirmed by the contents on either pass: a duplicate
+     * written by another chunk while this one was being prepared is only
+     * found here, its strong fingerprint may not be indexed yet.
+     */
+    if (weak_found) {
+        kmem = nova_get_block(sb, nova_get_block_off(sb, nova_entry_blocknr(sbi, weak_find_entry),
+                                                     NOVA_BLOCK_TYPE_4K));
+        nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, kmem, &entry_fp_strong);
+        if (cmp_fp_strong(&entry_fp_strong, &fp_strong)) {
+            nova_entry_set_fp_strong(sbi, weak_find_entry, &entry_fp_strong);
+            refcount = nova_entry_add_ref(sbi, weak_find_entry, 1);
+            nova_entry_set_flag(sbi, weak_find_entry, FP_STRONG_FLAG);
+            nova_entry_flush(sbi, weak_find_entry);
+            ++sbi->dup_block;
+            *blocknr = nova_entry_blocknr(sbi, weak_find_entry);
+            allocated = 1;
+            chunk->existed = true;
+            strong_find_entry = weak_find_entry;
+            trace_nova_dedup_lookup(sb, NOVA_LOOKUP_WEAK_HIT, strong_find_entry, *blocknr);
+            trace_nova_dedup_ref_get(sb, strong_find_entry, *blocknr, refcount);
+            nova_link_strong_hentry(sb, strong_find_entry, &fp_strong, strong_idx);
+            nova_fp_cache_insert(&sbi->fp_cache, &fp_strong, strong_find_entry, *blocknr);
+            goto link_weak;
+        }
+        trace_nova_dedup_lookup(sb, NOVA_LOOKUP_COLLISION, weak_find_entry,
+                                nova_entry_blocknr(sbi, weak_find_entry));
+    }
 
-    if(!weak_find_hentry) {
-        weak_hentry = nova_alloc_hentry(sb);
-        weak_hentry->entrynr = strong_find_entry;
-        hlist_add_head(&weak_hentry->node, &sbi->weak_hash_table[weak_idx]);
+    if (!prepared) {
+        /**
+         * The chunk is new: allocate and write it with no stripe lock held,
+         * then come back and insert it. A writer that indexed the same chunk
+         * meanwhile is found by the second lookup, and this copy is discarded.
+         */
+	    spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	    spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+        allocated = nova_dedup_prepare_entry(sb, chunk, &alloc_blocknr, &alloc_entry,
+                            FP_STRONG_FLAG, &fp_weak, &fp_strong);
+        if(allocated < 0)
+            return allocated;
+        prepared = true;
+        goto retry;
     }
 
-out:
+    nova_link_strong_hentry(sb, alloc_entry, &fp_strong, strong_idx);
+    *blocknr = alloc_blocknr;
+    strong_find_entry = alloc_entry;
+    allocated = 1;
+    trace_nova_dedup_lookup(sb, NOVA_LOOKUP_MISS, alloc_entry, alloc_blocknr);
+    if(!weak_found)
+        nova_index_note_miss(sbi, &fp_weak);
+
+link_weak:
+    if(!weak_found)
+        nova_link_weak_hentry(sb, strong_find_entry, &fp_weak, weak_idx);
+
 	spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
 	spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+
+    if(prepared && strong_find_entry != alloc_entry)
+        nova_dedup_discard_entry(sb, alloc_entry, alloc_blocknr);
     return allocated;
 }
 
-int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, unsigned long *blocknr) 
+/**
+ * Write a chunk whose weak fingerprint is not indexed yet and add it to the
+ * weak hash table. The weak stripe lock is only taken to link the entry,
+ * after checking that no racing writer linked the same weak fingerprint
+ * meanwhile; the loser stays unindexed.
+ */
+static int nova_dedup_weak_new_entry(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr, struct nova_fp_weak *fp_weak, u32 weak_idx)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    entrynr_t alloc_entry, found_entry;
+    int allocated;
+
+    allocated = nova_dedup_prepare_entry(sb, chunk, blocknr, &alloc_entry,
+                        FP_WEAK_FLAG, fp_weak, NULL);
+    if(allocated < 0)
+        return allocated;
+    trace_nova_dedup_lookup(sb, NOVA_LOOKUP_MISS, alloc_entry, *blocknr);
+    nova_index_note_miss(sbi, fp_weak);
+
+	spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+    if(!nova_dedup_find_weak(sb, fp_weak, weak_idx, &found_entry))
+        nova_link_weak_hentry(sb, alloc_entry, fp_weak, weak_idx);
+	spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+
+    return allocated;
+}
+
+/**
+ * Write a chunk whose strong fingerprint was not found and add it to the
+ * strong hash table, with the write done outside the strong stripe lock.
+ * If a racing writer inserted the same chunk first, dedup against it.
+ */
+static int nova_dedup_strong_new_entry(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr, struct nova_fp_weak *fp_weak, struct nova_fp_strong *fp_strong,
+    u64 strong_idx)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    entrynr_t alloc_entry, strong_find_entry;
+    bool strong_found;
+    u64 refcount;
+    unsigned long alloc_blocknr;
+    int allocated;
+
+    allocated = nova_dedup_prepare_entry(sb, chunk, &alloc_blocknr, &alloc_entry,
+                        FP_STRONG_FLAG, fp_weak, fp_strong);
+    if(allocated < 0)
+        return allocated;
+
+	spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+    strong_found = nova_dedup_find_strong(sb, fp_strong, strong_idx, &strong_find_entry);
+    if(strong_found) {
+        refcount = nova_entry_add_ref(sbi, strong_find_entry, 1);
+        nova_entry_flush(sbi, strong_find_entry);
+        *blocknr = nova_entry_blocknr(sbi, strong_find_entry);
+        ++sbi->dup_block;
+        chunk->existed = true;
+        trace_nova_dedup_lookup(sb, NOVA_LOOKUP_STRONG_HIT, strong_find_entry, *blocknr);
+        trace_nova_dedup_ref_get(sb, strong_find_entry, *blocknr, refcount);
+    } else {
+        nova_link_strong_hentry(sb, alloc_entry, fp_strong, strong_idx);
+        *blocknr = alloc_blocknr;
+        trace_nova_dedup_lookup(sb, NOVA_LOOKUP_MISS, alloc_entry, alloc_blocknr);
+    }
+	spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+
+    if(strong_found)
+        nova_dedup_discard_entry(sb, alloc_entry, alloc_blocknr);
+    return allocated;
+}
+
+int nova_dedup_weak_str_fin(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr) 
 {
     /**
      * w_s_Fin method calculates a weak fingerprint for a data chunk
@@ -227,229 +642,1022 @@ int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, uns
      * check data that are not surely identified by comparing weak fingerprinting. 
      */
     struct nova_sb_info *sbi = NOVA_SB(sb);
+    const char *data_buffer = chunk->data;
     struct nova_fp_weak fp_weak;
     struct nova_fp_strong fp_strong = {0}, entry_fp_strong = {0};
-    struct nova_pmm_entry *pentries, *weak_entry, *strong_entry, *pentry;
-    struct nova_hentry *weak_hentry, *strong_hentry;
     u32 weak_idx;
     u64 strong_idx;
-    struct nova_hentry *weak_find_hentry, *strong_find_hentry;
-    entrynr_t alloc_entry;
+    entrynr_t weak_find_entry, strong_find_entry;
+    bool weak_found, strong_found;
+    u64 refcount;
+    u8 weak_flag;
     int allocated = 0;
     void *kmem;
     bool flush_entry = false;
+    bool same;
     INIT_TIMING(weak_fp_calc_time);
     INIT_TIMING(strong_fp_calc_time);
     INIT_TIMING(hash_table_time);
+    INIT_TIMING(verify_cmp_time);
 
-    pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
+    if(chunk->fp_weak) {
+        fp_weak = *chunk->fp_weak;
+    } else {
+        NOVA_START_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+        nova_fp_weak_calc(data_buffer, &fp_weak);
+        NOVA_END_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+    }
 
-    NOVA_START_TIMING(weak_fp_calc_t, weak_fp_calc_time);
-    nova_fp_weak_calc(&sbi->nova_fp_weak_ctx, data_buffer,&fp_weak);
-    NOVA_END_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+    weak_idx = (fp_weak.u32 & ((1 << sbi->index_bits) - 1));
+    if(sbi->weak_filter.words && !nova_filter_may_contain(&sbi->weak_filter, &fp_weak)) {
+        /**
+         * The filter proves the weak fingerprint is absent, so the chunk is new
+         * and neither the weak stripe lock nor the chain walk is needed to know it.
+         */
+        NOVA_STATS_ADD(weak_filter_skip, 1);
+        NOVA_STATS_ADD(weak_table_miss, 1);
+        return nova_dedup_weak_new_entry(sb, chunk, blocknr, &fp_weak, weak_idx);
+    }
 
-    weak_idx = (fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
 	spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
     NOVA_START_TIMING(hash_table_t, hash_table_time);
-    weak_find_hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], &fp_weak);
+    weak_found = nova_dedup_find_weak(sb, &fp_weak, weak_idx, &weak_find_entry);
     NOVA_END_TIMING(hash_table_t, hash_table_time);
+    NOVA_STATS_ADD(weak_found ? weak_table_hit : weak_table_miss, 1);
 
-    if(weak_find_hentry) {
+    if(!weak_found) {
         /**
-         * If a newlyarrived chunk has the same weak fingerprint as a stored chunk
-         *  NV-Dedup calculates the strong fingerprint of both chunks for further comparison. 
-         * Then, NV-Dedup updates the entry of the stored chunk by adding the strong fingerprint.
+         * If the weak fingerprint is not found in the metadata table, 
+         * NV-Dedup will deem the chunk to be non-existent 
+         * and the calculation of strong fingerprint needs not be done for the chunk
          */
-        weak_entry = pentries + weak_find_hentry->entrynr;
-        if(weak_entry->flag == FP_STRONG_FLAG) {
-             /**
-            *  The sixth field is a 1 B flag to indicate 
-            *  whether the strong fingerprint is valid or not.
-            *  from NV-Dedup
-            */
-           // if the strong fingerprint is valid
-           // assign it to entry_fp_strong
-
-           entry_fp_strong = weak_entry->fp_strong;
-        }
-        else if(weak_entry->flag == FP_WEAK_FLAG){
-            kmem = nova_get_block(sb, nova_get_block_off(sb, weak_entry->blocknr, NOVA_BLOCK_TYPE_4K));
-            NOVA_START_TIMING(strong_fp_calc_t, strong_fp_calc_time);
-            nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, kmem, &entry_fp_strong);
-            NOVA_END_TIMING(strong_fp_calc_t, strong_fp_calc_time);
-            
-            weak_entry->flag = FP_STRONG_FLAG;
-            weak_entry->fp_strong = entry_fp_strong;
-            flush_entry = true;
-            
-            strong_hentry = nova_alloc_hentry(sb);
-            strong_hentry->entrynr = weak_find_hentry->entrynr;
-            strong_idx = (entry_fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
-	        spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
-            hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
-	        spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	    spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+        return nova_dedup_weak_new_entry(sb, chunk, blocknr, &fp_weak, weak_idx);
+    }
+
+    /**
+     * If a newlyarrived chunk has the same weak fingerprint as a stored chunk
+     *  NV-Dedup calculates the strong fingerprint of both chunks for further comparison. 
+     * Then, NV-Dedup updates the entry of the stored chunk by adding the strong fingerprint.
+     */
+    weak_flag = nova_entry_flag(sbi, weak_find_entry);
+    if(test_opt(sb, DEDUP_VERIFY)) {
+        /**
+         * Verify-by-compare: confirm the duplicate against the stored bytes
+         * instead of hashing both chunks, and leave the entry as it is.
+         * A mismatch means the stored chunk is not ours, so only the
+         * incoming chunk is strongly fingerprinted below.
+         */
+        kmem = nova_get_block(sb, nova_get_block_off(sb, nova_entry_blocknr(sbi, weak_find_entry),
+                                                     NOVA_BLOCK_TYPE_4K));
+        NOVA_START_TIMING(verify_cmp_t, verify_cmp_time);
+        same = nova_dedup_block_equal(kmem, data_buffer);
+        NOVA_END_TIMING(verify_cmp_t, verify_cmp_time);
+        if(same) {
+            *blocknr = nova_entry_blocknr(sbi, weak_find_entry);
+            refcount = nova_entry_add_ref(sbi, weak_find_entry, 1);
+            nova_entry_flush_refcount(sbi, weak_find_entry);
+            ++sbi->dup_block;
+            allocated = 1;
+            chunk->existed = true;
+            trace_nova_dedup_lookup(sb, NOVA_LOOKUP_WEAK_HIT, weak_find_entry, *blocknr);
+            trace_nova_dedup_ref_get(sb, weak_find_entry, *blocknr, refcount);
+            goto out;
         }
+        NOVA_STATS_ADD(verify_cmp_mismatch, 1);
+        if(weak_flag == FP_STRONG_FLAG)
+            nova_entry_fp_strong(sbi, weak_find_entry, &entry_fp_strong);
+    }
+    else if(weak_flag == FP_STRONG_FLAG) {
+         /**
+        *  The sixth field is a 1 B flag to indicate 
+        *  whether the strong fingerprint is valid or not.
+        *  from NV-Dedup
+        */
+       // if the strong fingerprint is valid
+       // assign it to entry_fp_strong
+
+       nova_entry_fp_strong(sbi, weak_find_entry, &entry_fp_strong);
+    }
+    else if(weak_flag == FP_WEAK_FLAG){
+        kmem = nova_get_block(sb, nova_get_block_off(sb, nova_entry_blocknr(sbi, weak_find_entry),
+                                                     NOVA_BLOCK_TYPE_4K));
+        NOVA_START_TIMING(strong_fp_calc_t, strong_fp_calc_time);
+        nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, kmem, &entry_fp_strong);
+        NOVA_END_TIMING(strong_fp_calc_t, strong_fp_calc_time);
+        
+        nova_entry_set_flag(sbi, weak_find_entry, FP_STRONG_FLAG);
+        nova_entry_set_fp_strong(sbi, weak_find_entry, &entry_fp_strong);
+        flush_entry = true;
+        
+        strong_idx = (entry_fp_strong.u64s[0] & ((1 << sbi->index_bits) - 1));
+	    spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+        nova_link_strong_hentry(sb, weak_find_entry, &entry_fp_strong, strong_idx);
+	    spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+    }
 
+    if(chunk->fp_strong) {
+        fp_strong = *chunk->fp_strong;
+    } else {
         NOVA_START_TIMING(strong_fp_calc_t, strong_fp_calc_time);
         nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, data_buffer, &fp_strong);
         NOVA_END_TIMING(strong_fp_calc_t, strong_fp_calc_time);
+    }
 
-        if(cmp_fp_strong(&fp_strong, &entry_fp_strong)) {
-            *blocknr = weak_entry->blocknr;
-            ++weak_entry->refcount;
-            flush_entry = true;
-            ++sbi->dup_block;
+    if(cmp_fp_strong(&fp_strong, &entry_fp_strong)) {
+        *blocknr = nova_entry_blocknr(sbi, weak_find_entry);
+        refcount = nova_entry_add_ref(sbi, weak_find_entry, 1);
+        flush_entry = true;
+        ++sbi->dup_block;
+        allocated = 1;
+        chunk->existed = true;
+        trace_nova_dedup_lookup(sb, NOVA_LOOKUP_WEAK_HIT, weak_find_entry, *blocknr);
+        trace_nova_dedup_ref_get(sb, weak_find_entry, *blocknr, refcount);
+    } 
+    else {
+        trace_nova_dedup_lookup(sb, NOVA_LOOKUP_COLLISION, weak_find_entry,
+                                nova_entry_blocknr(sbi, weak_find_entry));
+        strong_idx = (fp_strong.u64s[0] & ((1 << sbi->index_bits) - 1));
+	    spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+        NOVA_START_TIMING(hash_table_t, hash_table_time);
+        strong_found = nova_dedup_find_strong(sb, &fp_strong, strong_idx, &strong_find_entry);
+        NOVA_END_TIMING(hash_table_t, hash_table_time);
+        NOVA_STATS_ADD(strong_found ? strong_table_hit : strong_table_miss, 1);
+        
+        if(strong_found) {
+            // if the corresponding strong fingerprint is found
+            // add the refcount and return
+            refcount = nova_entry_add_ref(sbi, strong_find_entry, 1);
+            nova_entry_flush(sbi, strong_find_entry);
+            *blocknr = nova_entry_blocknr(sbi, strong_find_entry);
             allocated = 1;
-        } 
-        else {
-            strong_idx = (fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
-	        spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
-            NOVA_START_TIMING(hash_table_t, hash_table_time);
-            strong_find_hentry = nova_find_in_strong_hlist(sb, &sbi->strong_hash_table[strong_idx], &fp_strong);
-            NOVA_END_TIMING(hash_table_t, hash_table_time);
-            
-            if(strong_find_hentry) {
-                // if the corresponding strong fingerprint is found
-                // add the refcount and return
-                strong_entry = pentries + strong_find_hentry->entrynr;
-                ++strong_entry->refcount;
-                nova_flush_buffer(strong_entry,sizeof(*strong_entry),true);
-                *blocknr = strong_entry->blocknr;
-                allocated = 1;
-                ++sbi->dup_block;
-            } else {
-                // if the corresponding strong fingerprint is not found
-                // alloc a new entry and write
-                // add the strong fingerprint to strong fingerprint hash table
-                alloc_entry = nova_alloc_entry(sb);
-                allocated = nova_alloc_block_write(sb,data_buffer,blocknr);
-                if(allocated < 0) {
-	                spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
-                    goto out;
-                }
-                
-                pentry = pentries + alloc_entry;
-                pentry->flag = FP_STRONG_FLAG;
-                pentry->fp_weak = fp_weak;
-                pentry->fp_strong = fp_strong;
-                pentry->blocknr = *blocknr;
-                pentry->refcount = 1;
-                nova_flush_buffer(pentry, sizeof(*pentry), true);
-                strong_hentry = nova_alloc_hentry(sb);
-                strong_hentry->entrynr = alloc_entry;
-                hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
-                sbi->blocknr_to_entry[*blocknr] = alloc_entry;
-            }
+            ++sbi->dup_block;
+            chunk->existed = true;
+            trace_nova_dedup_lookup(sb, NOVA_LOOKUP_STRONG_HIT, strong_find_entry, *blocknr);
+            trace_nova_dedup_ref_get(sb, strong_find_entry, *blocknr, refcount);
 	        spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+        } else {
+            // if the corresponding strong fingerprint is not found
+            // alloc a new entry and write, with no stripe lock held,
+            // and add the strong fingerprint to strong fingerprint hash table
+	        spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+            if(flush_entry) nova_entry_flush(sbi, weak_find_entry);
+	        spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+            return nova_dedup_strong_new_entry(sb, chunk, blocknr, &fp_weak, &fp_strong, strong_idx);
         }
-
-        if(flush_entry) nova_flush_buffer(weak_entry, sizeof(*weak_entry), true);
     }
-    else {
-        /**
-         * If the weak fingerprint is not found in the metadata table, 
-         * NV-Dedup will deem the chunk to be non-existent 
-         * and the calculation of strong fingerprint needs not be done for the chunk
-         */
-
-        alloc_entry = nova_alloc_entry(sb);
-
-        allocated = nova_alloc_block_write(sb,data_buffer,blocknr);
-        if(allocated < 0 )
-            goto out;
-        
-        pentry = pentries + alloc_entry;
-        pentry->flag = FP_WEAK_FLAG;
-        pentry->fp_weak = fp_weak;
-        pentry->blocknr = *blocknr;
-        pentry->refcount = 1;
-        nova_flush_buffer(pentry, sizeof(*pentry),true);
 
-        weak_hentry = nova_alloc_hentry(sb);
-        weak_hentry->entrynr = alloc_entry;
-        hlist_add_head(&weak_hentry->node, &sbi->weak_hash_table[weak_idx]);
-        sbi->blocknr_to_entry[*blocknr] = alloc_entry;
-    }
+    if(flush_entry) nova_entry_flush(sbi, weak_find_entry);
 
 out:
 	spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
     return allocated;
 }
 
-int nova_dedup_non_fin(struct super_block *sb, const char* data_buffer, unsigned long* blocknr)
+int nova_dedup_non_fin(struct super_block *sb, struct nova_dedup_chunk *chunk, unsigned long* blocknr)
 {
-    struct nova_sb_info *sbi = NOVA_SB(sb);
-    struct nova_pmm_entry *pentries, *pentry;
     entrynr_t alloc_entry;
-    int allocated = 0;
-    
-    alloc_entry = nova_alloc_entry(sb);
-    allocated = nova_alloc_block_write(sb, data_buffer,blocknr);
-    if(allocated < 0)
-        goto out;
-    pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start,NOVA_BLOCK_TYPE_4K));
-    pentry = pentries + alloc_entry;
-    pentry->blocknr = *blocknr;
-    pentry->flag = NON_FIN_FLAG;
-    pentry->refcount = 1;
-    nova_flush_buffer(pentry, sizeof(*pentry), true);
-    sbi->blocknr_to_entry[*blocknr] = alloc_entry;
 
-out:
-    return allocated;
+    return nova_dedup_prepare_entry(sb, chunk, blocknr, &alloc_entry,
+                    NON_FIN_FLAG, NULL, NULL);
 }
 
-int nova_dedup_new_write(struct super_block *sb,const char* data_buffer, unsigned long *blocknr)
+static const struct {
+    const char *name;
+    u32 mode;
+} nova_dedup_modes[] = {
+    { "auto", 0 },
+    { "off", DEDUP_OFF },
+    { "non_fin", NON_FIN },
+    { "ws_fin", WEAK_STR_FIN },
+    { "str_fin", STR_FIN },
+};
+
+static const int nova_dedup_cost_timer[DEDUP_COST_NUM] = {
+    [DEDUP_COST_WEAK] = weak_fp_calc_t,
+    [DEDUP_COST_STRONG] = strong_fp_calc_t,
+    [DEDUP_COST_HASH] = hash_table_t,
+    [DEDUP_COST_WRITE] = nv_dedup_alloc_write_t,
+};
+
+int nova_dedup_parse_mode(const char *name, u32 *mode)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(nova_dedup_modes); i++) {
+        if (strcmp(name, nova_dedup_modes[i].name) == 0) {
+            *mode = nova_dedup_modes[i].mode;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+const char *nova_dedup_mode_name(u32 mode)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(nova_dedup_modes); i++)
+        if (nova_dedup_modes[i].mode == mode)
+            return nova_dedup_modes[i].name;
+    return "unknown";
+}
+
+void nova_dedup_init_ctl(struct nova_sb_info *sbi)
+{
+    struct nova_dedup_ctl *ctl = &sbi->dedup_ctl;
+
+    memset(ctl, 0, sizeof(*ctl));
+    spin_lock_init(&ctl->lock);
+    ctl->sample_blocks = SAMPLE_BLOCK;
+    ctl->non_fin_thresh = NON_FIN_THRESH;
+    ctl->str_fin_thresh = STR_FIN_THRESH;
+    ctl->hysteresis = DEDUP_HYSTERESIS;
+    ctl->probe_interval = DEDUP_PROBE_INTERVAL;
+    ctl->parallel_fp_kb = DEDUP_PARALLEL_FP_KB;
+    ctl->cost[DEDUP_COST_WEAK] = DEDUP_WEAK_FP_COST;
+    ctl->cost[DEDUP_COST_STRONG] = DEDUP_STRONG_FP_COST;
+    ctl->cost[DEDUP_COST_HASH] = DEDUP_HASH_TABLE_COST;
+    ctl->cost[DEDUP_COST_WRITE] = DEDUP_WRITE_COST;
+    sbi->dedup_mode = NON_FIN;
+}
+
+/**
+ * Fold the timer deltas since the last sample into the per-block costs.
+ * The timers only accumulate time with measure_timing on, and the deltas
+ * are dropped if the stats have been cleared in between.
+ */
+static void nova_dedup_update_costs(struct nova_dedup_ctl *ctl)
+{
+    u64 timing, count, hit, miss;
+    int i;
+
+    for (i = 0; i < DEDUP_COST_NUM; i++) {
+        timing = nova_sum_timing_stat(nova_dedup_cost_timer[i], &count);
+        if (count > ctl->last_count[i] && timing > ctl->last_time[i])
+            ctl->cost[i] = (ctl->cost[i] * 3 +
+                (timing - ctl->last_time[i]) / (count - ctl->last_count[i])) / 4;
+        ctl->last_time[i] = timing;
+        ctl->last_count[i] = count;
+    }
+
+    hit = nova_sum_IO_stat(fp_cache_hit);
+    miss = nova_sum_IO_stat(fp_cache_miss);
+    if (hit >= ctl->last_cache_hit && miss >= ctl->last_cache_miss &&
+        hit + miss > ctl->last_cache_hit + ctl->last_cache_miss)
+        ctl->cache_hit_percent = (hit - ctl->last_cache_hit) * 100 /
+            (hit + miss - ctl->last_cache_hit - ctl->last_cache_miss);
+    ctl->last_cache_hit = hit;
+    ctl->last_cache_miss = miss;
+}
+
+/**
+ * Expected foreground cost of one block in the given mode, scaled by 100,
+ * at dup percent of duplicate blocks. NON_FIN leaves the fingerprinting to
+ * the background thread, WEAK_STR_FIN computes a strong fingerprint for weak
+ * hits only, and STR_FIN skips the weak fingerprint on fingerprint cache hits.
+ */
+static u64 nova_dedup_mode_cost(struct nova_dedup_ctl *ctl, u32 mode, unsigned int dup)
+{
+    u64 *cost = ctl->cost;
+    u64 write = cost[DEDUP_COST_WRITE] * (100 - dup);
+
+    switch (mode) {
+    case NON_FIN:
+        return cost[DEDUP_COST_WRITE] * 100;
+    case WEAK_STR_FIN:
+        return (cost[DEDUP_COST_WEAK] + cost[DEDUP_COST_HASH]) * 100 +
+            cost[DEDUP_COST_STRONG] * dup + write;
+    default:
+        return cost[DEDUP_COST_STRONG] * 100 +
+            (cost[DEDUP_COST_WEAK] + cost[DEDUP_COST_HASH]) *
+            (100 - ctl->cache_hit_percent) + write;
+    }
+}
+
+/**
+ * Pick the mode for the next sample. Duplicates are not found inline in
+ * NON_FIN mode, so every probe_interval samples one sample is written with
+ * WEAK_STR_FIN to measure the duplicate ratio again. Without timing the
+ * duplicate ratio is compared to the thresholds, with timing the cheapest
+ * mode wins if it beats the current one by the hysteresis margin.
+ */
+static u32 nova_dedup_select_mode(struct nova_sb_info *sbi)
+{
+    struct nova_dedup_ctl *ctl = &sbi->dedup_ctl;
+    static const u32 modes[] = { NON_FIN, WEAK_STR_FIN, STR_FIN };
+    u32 cur = sbi->dedup_mode, best;
+    u64 cost, best_cost;
+    unsigned int dup;
+    int i;
+
+    if (cur == NON_FIN) {
+        if (++ctl->non_fin_samples < ctl->probe_interval)
+            return NON_FIN;
+        ctl->non_fin_samples = 0;
+        return WEAK_STR_FIN;
+    }
+
+    dup = min_t(unsigned int, sbi->dup_block * 100 / ctl->sample_blocks, 100);
+    ctl->dup_percent = dup;
+
+    if (!measure_timing) {
+        if (dup > ctl->str_fin_thresh)
+            return STR_FIN;
+        if (dup > ctl->non_fin_thresh)
+            return WEAK_STR_FIN;
+        return NON_FIN;
+    }
+
+    nova_dedup_update_costs(ctl);
+    best = cur;
+    best_cost = nova_dedup_mode_cost(ctl, cur, dup) * (100 - ctl->hysteresis) / 100;
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        if (modes[i] == cur)
+            continue;
+        cost = nova_dedup_mode_cost(ctl, modes[i], dup);
+        if (cost < best_cost) {
+            best = modes[i];
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+int nova_dedup_new_write(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr)
 {
     struct nova_sb_info *sbi = NOVA_SB(sb);
-    u32 dup_block = 0;
-    u32 dup_mode = 0;
-    unsigned long randomNum;
-    int allocated;
-    INIT_TIMING(calc_t);
+    struct nova_dedup_ctl *ctl = &sbi->dedup_ctl;
+    u32 dup_mode = 0, old_mode;
 
     ++sbi->cur_block;
-    if(sbi->cur_block >= SAMPLE_BLOCK) {
-        if(sbi->dedup_mode == NON_FIN) {
+    if(sbi->cur_block >= ctl->sample_blocks && spin_trylock(&ctl->lock)) {
+        old_mode = sbi->dedup_mode;
+        if(old_mode == NON_FIN) {
             wakeup_calc_non_fin(sb);
         }
-        dup_block = sbi->dup_block;
-        if(dup_block > STR_FIN_THRESH) {
-            sbi->dedup_mode = STR_FIN;
-        }else if(dup_block > NON_FIN_THRESH) {
-            sbi->dedup_mode = WEAK_STR_FIN;
-        }else {
-            get_random_bytes(&randomNum, sizeof(unsigned long));
-            if(randomNum & 1) {
-                sbi->dedup_mode = NON_FIN;
-            }
-            else {
-                sbi->dedup_mode = WEAK_STR_FIN;
-            }
-        }
+        if(ctl->pinned_mode)
+            sbi->dedup_mode = ctl->pinned_mode;
+        else
+            sbi->dedup_mode = nova_dedup_select_mode(sbi);
+        if(sbi->dedup_mode != old_mode)
+            trace_nova_dedup_mode(sb, old_mode, sbi->dedup_mode, ctl->dup_percent);
         sbi->cur_block = 0;
         sbi->dup_block = 0;
+        spin_unlock(&ctl->lock);
     }
 
-    dup_mode = sbi->dedup_mode;
+    dup_mode = ctl->pinned_mode ? ctl->pinned_mode : sbi->dedup_mode;
+    return nova_dedup_write_mode(sb, chunk, blocknr, dup_mode);
+}
+
+/**
+ * Write a chunk in the given dedup mode, leaving the mode selection of
+ * nova_dedup_new_write out. The perf harness uses it to compare the modes.
+ */
+int nova_dedup_write_mode(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr, u32 dup_mode)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    int allocated;
+    INIT_TIMING(calc_t);
+
+    chunk->existed = false;
     if(dup_mode & NON_FIN) {
         NOVA_START_TIMING(non_fin_calc_t, calc_t);
-        allocated = nova_dedup_non_fin(sb, data_buffer, blocknr);
+        allocated = nova_dedup_non_fin(sb, chunk, blocknr);
         NOVA_END_TIMING(non_fin_calc_t, calc_t);
         goto out;
     }else if(dup_mode & WEAK_STR_FIN) {
         NOVA_START_TIMING(ws_fin_calc_t, calc_t);
-        allocated = nova_dedup_weak_str_fin(sb, data_buffer, blocknr);
+        allocated = nova_dedup_weak_str_fin(sb, chunk, blocknr);
         NOVA_END_TIMING(ws_fin_calc_t, calc_t);
         goto out;
     }else if(dup_mode & STR_FIN) {
         NOVA_START_TIMING(str_fin_calc_t, calc_t);
-        allocated = nova_dedup_str_fin(sb, data_buffer, blocknr);
+        allocated = nova_dedup_str_fin(sb, chunk, blocknr);
         NOVA_END_TIMING(str_fin_calc_t, calc_t);
         goto out;
+    }else if(dup_mode & DEDUP_OFF) {
+        /* plain write, the block is never deduplicated */
+        allocated = nova_alloc_block_write(sb, chunk->data, blocknr);
+        if(allocated < 0)
+            goto out;
+        if(data_csum > 0 || data_parity > 0)
+            nova_update_block_csum_parity_precomputed(sb, chunk->data, *blocknr,
+                                chunk->stripe_csums);
+        sbi->blocknr_to_entry[*blocknr] = -1;
+        NOVA_STATS_ADD(dedup_off_blocks, 1);
+        goto out;
     }else {
         return -ESRCH;
     }
 out:
+    if(allocated > 0) {
+        NOVA_STATS_ADD(dedup_logical_blocks, 1);
+        if(!chunk->existed)
+            NOVA_STATS_ADD(dedup_stored_blocks, 1);
+    }
     return allocated;
+}
+
+/* Whether new chunks currently go through the weak fingerprint table */
+bool nova_dedup_weak_index_active(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    u32 mode = sbi->dedup_ctl.pinned_mode ? sbi->dedup_ctl.pinned_mode : sbi->dedup_mode;
+
+    return mode & WEAK_STR_FIN;
+}
+
+/**
+ * Software pipeline for multi-block writes. The first stage runs as soon
+ * as the weak fingerprint of a chunk is known and starts loading its
+ * filter block and weak bucket. The second stage runs one block later,
+ * when the bucket is cached: it reads the chain head and prefetches the
+ * first index node and its pmm entry, whose addresses follow from the
+ * node pointer alone. Both are hints, done without locks.
+ */
+void nova_dedup_prefetch_bucket(struct super_block *sb, const struct nova_fp_weak *fp_weak)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    u32 weak_idx;
+
+    if(!fp_weak || !nova_dedup_weak_index_active(sb))
+        return;
+
+    if (nova_dedup_pindex(sbi)) {
+        nova_pindex_prefetch(&sbi->weak_pindex, fp_weak->u32);
+        return;
+    }
+    weak_idx = (fp_weak->u32 & ((1 << sbi->index_bits) - 1));
+    nova_filter_prefetch(&sbi->weak_filter, fp_weak);
+    prefetch(&sbi->weak_hash_table[weak_idx]);
+}
+
+void nova_dedup_prefetch_entry(struct super_block *sb, const struct nova_fp_weak *fp_weak)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct hlist_node *first;
+    struct nova_hentry *hentry;
+    u32 weak_idx;
+
+    /* a PMEM slot has no pointer to chase before the lookup proper */
+    if(!fp_weak || !nova_dedup_weak_index_active(sb) || nova_dedup_pindex(sbi))
+        return;
+
+    weak_idx = (fp_weak->u32 & ((1 << sbi->index_bits) - 1));
+    first = READ_ONCE(sbi->weak_hash_table[weak_idx].first);
+    if(!first)
+        return;
+
+    hentry = hlist_entry(first, struct nova_hentry, weak_node);
+    prefetch(hentry);
+    prefetch(nova_get_entry(sbi, nova_hentry_entrynr(sbi, hentry)));
+}
+
+/**
+ * Whether a write of len bytes is worth fingerprinting in parallel. str_fin
+ * has the strong fingerprint of every chunk calculated in the batch, ws_fin
+ * only the weak fingerprints and stripe csums: it calculates the strong one
+ * for weak hits only, on the write path.
+ */
+bool nova_dedup_fp_parallel_wanted(struct super_block *sb, size_t len)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    unsigned int kb = READ_ONCE(sbi->dedup_ctl.parallel_fp_kb);
+    u32 mode = sbi->dedup_ctl.pinned_mode ? sbi->dedup_ctl.pinned_mode : sbi->dedup_mode;
+
+    return kb && sbi->fp_wq && len >= ((size_t)kb << 10) &&
+        (mode & (WEAK_STR_FIN | STR_FIN)) && num_online_cpus() > 1;
+}
+
+struct nova_fp_batch *nova_dedup_fp_batch_alloc(struct super_block *sb)
+{
+    struct nova_fp_batch *batch;
+
+    batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+    if (!batch)
+        return NULL;
+    batch->data = vmalloc((size_t)NOVA_FP_BATCH_BLOCKS << PAGE_SHIFT);
+    if (!batch->data) {
+        kfree(batch);
+        return NULL;
+    }
+    batch->num = 0;
+    return batch;
+}
+
+void nova_dedup_fp_batch_free(struct nova_fp_batch *batch)
+{
+    if (!batch)
+        return;
+    vfree(batch->data);
+    kfree(batch);
+}
+
+/*
+ * Fingerprint one slice of a batch. The timers are per-CPU, so workers keep
+ * feeding the cost model the mode controller works from.
+ */
+static void nova_fp_batch_slice(struct nova_fp_work *fw)
+{
+    struct nova_sb_info *sbi = NOVA_SB(fw->sb);
+    struct nova_fp_batch *batch = fw->batch;
+    unsigned int i, end = fw->start + fw->num;
+    const char *data;
+    INIT_TIMING(weak_fp_calc_time);
+    INIT_TIMING(strong_fp_calc_time);
+
+    fw->ret = 0;
+    for (i = fw->start; i < end; i++) {
+        data = batch->data + ((size_t)i << PAGE_SHIFT);
+        if (batch->csums) {
+            /* One checksum pass yields the stripe csums and the weak fp */
+            batch->fp_weak[i].u32 = nova_calc_block_stripe_csums(data,
+                                    batch->stripe_csums[i]);
+        } else {
+            NOVA_START_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+            nova_fp_weak_calc(data, &batch->fp_weak[i]);
+            NOVA_END_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+        }
+        if (!batch->strong)
+            continue;
+        memset(&batch->fp_strong[i], 0, sizeof(batch->fp_strong[i]));
+        NOVA_START_TIMING(strong_fp_calc_t, strong_fp_calc_time);
+        fw->ret = nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, data, &batch->fp_strong[i]);
+        NOVA_END_TIMING(strong_fp_calc_t, strong_fp_calc_time);
+        if (fw->ret)
+            return;
+    }
+}
+
+static void nova_fp_batch_work(struct work_struct *work)
+{
+    nova_fp_batch_slice(container_of(work, struct nova_fp_work, work));
+}
+
+/**
+ * Fingerprint the first num chunks of batch->data. The chunks are split
+ * into slices that run on the fp workqueue, the caller takes the first
+ * slice itself and waits for the others, so the lookups that follow still
+ * see the chunks in write order. Without a strong fingerprint mode only the
+ * weak fingerprints (and stripe csums) are filled in.
+ */
+int nova_dedup_fp_batch_calc(struct super_block *sb, struct nova_fp_batch *batch,
+    unsigned int num)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    u32 mode = sbi->dedup_ctl.pinned_mode ? sbi->dedup_ctl.pinned_mode : sbi->dedup_mode;
+    struct nova_fp_work *fw;
+    unsigned int nr, per, start = 0, i;
+    int ret;
+
+    batch->num = num;
+    batch->strong = mode & STR_FIN;
+    batch->csums = data_csum > 0;
+    if (num == 0)
+        return 0;
+
+    nr = min3(num_online_cpus(), (unsigned int)NOVA_FP_MAX_WORKERS,
+              DIV_ROUND_UP(num, NOVA_FP_SLICE_MIN));
+    per = DIV_ROUND_UP(num, nr);
+    for (i = 0; i < nr && start < num; i++) {
+        fw = &batch->works[i];
+        fw->sb = sb;
+        fw->batch = batch;
+        fw->start = start;
+        fw->num = min(per, num - start);
+        start += fw->num;
+        if (i == 0)
+            continue;
+        INIT_WORK(&fw->work, nova_fp_batch_work);
+        queue_work(sbi->fp_wq, &fw->work);
+    }
+    nr = i;
+
+    nova_fp_batch_slice(&batch->works[0]);
+    ret = batch->works[0].ret;
+    for (i = 1; i < nr; i++) {
+        fw = &batch->works[i];
+        flush_work(&fw->work);
+        if (fw->ret)
+            ret = fw->ret;
+    }
+    return ret;
+}
+
+/**
+ * Deduplicate a 2MB aligned extent as a whole. The data is copied into a
+ * new 2MB aligned superpage and fingerprinted there. If an identical extent
+ * is indexed already, the new superpage is released and the old one is
+ * shared, so the extent can still be mapped with a single PMD.
+ * The entry refcount counts 4K block references, NOVA_HUGE_BLOCKS per
+ * extent, so a partially overwritten extent keeps its superpage until the
+ * last of its blocks is released.
+ * Checksums and parity of a new extent are written before it is indexed,
+ * and *existed tells the caller that the shared extent has them already.
+ * Returns NOVA_HUGE_BLOCKS, or < 0 if the caller should write 4K blocks.
+ */
+int nova_dedup_huge_write(struct super_block *sb, const char __user *buf,
+    unsigned long *blocknr, bool *existed)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_fp_strong fp_strong = {0};
+    struct nova_hentry *hentry, *find_hentry;
+    entrynr_t alloc_entry, find_entry;
+    unsigned long sp_blocknr, i;
+    u64 strong_idx, huge_idx, refcount;
+    bool protect_done = false;
+    void *kmem;
+    int ret;
+    INIT_TIMING(huge_time);
+    INIT_TIMING(memcpy_time);
+
+    NOVA_START_TIMING(huge_dedup_t, huge_time);
+    *existed = false;
+    ret = nova_new_data_superpage(sb, &sp_blocknr);
+    if(ret < 0)
+        goto out;
+
+    kmem = nova_get_block(sb, nova_get_block_off(sb, sp_blocknr, NOVA_BLOCK_TYPE_4K));
+    NOVA_START_TIMING(memcpy_w_nvmm_t, memcpy_time);
+	nova_memunlock_range(sb, kmem, NOVA_HUGE_SIZE);
+	ret = memcpy_to_pmem_nocache(kmem, buf, NOVA_HUGE_SIZE);
+	nova_memlock_range(sb, kmem, NOVA_HUGE_SIZE);
+	NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
+    if(ret) {
+        nova_free_data_superpage(sb, sp_blocknr);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    ret = nova_fp_strong_calc_len(&sbi->nova_fp_strong_ctx, kmem, NOVA_HUGE_SIZE, &fp_strong);
+    if(ret < 0) {
+        nova_free_data_superpage(sb, sp_blocknr);
+        goto out;
+    }
+
+    ret = nova_alloc_entry(sb, &alloc_entry);
+    if(ret < 0) {
+        nova_free_data_superpage(sb, sp_blocknr);
+        goto out;
+    }
+    nova_entry_set_flag(sbi, alloc_entry, FP_HUGE_FLAG);
+    nova_entry_set_fp_strong(sbi, alloc_entry, &fp_strong);
+    nova_entry_set_blocknr(sbi, alloc_entry, sp_blocknr);
+    nova_entry_set_refcount(sbi, alloc_entry, NOVA_HUGE_BLOCKS);
+    nova_entry_flush(sbi, alloc_entry);
+
+    /* The huge table shares the strong stripe locks, picked the same way */
+    strong_idx = (fp_strong.u64s[0] & ((1 << sbi->index_bits) - 1));
+    huge_idx = (fp_strong.u64s[0] & ((1 << sbi->huge_table_bits) - 1));
+retry:
+	spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+    find_hentry = nova_find_in_strong_hlist(sb, &sbi->huge_hash_table[huge_idx], &fp_strong);
+    if(find_hentry) {
+        find_entry = nova_hentry_entrynr(sbi, find_hentry);
+        refcount = nova_entry_add_ref(sbi, find_entry, NOVA_HUGE_BLOCKS);
+        nova_entry_flush_refcount(sbi, find_entry);
+        *blocknr = nova_entry_blocknr(sbi, find_entry);
+        *existed = true;
+        trace_nova_dedup_lookup(sb, NOVA_LOOKUP_STRONG_HIT, find_entry, *blocknr);
+        trace_nova_dedup_ref_get(sb, find_entry, *blocknr, refcount);
+    } else if(!protect_done && (data_csum > 0 || data_parity > 0)) {
+        /* Protect the new extent out of the lock, then look again */
+	    spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+        for(i = 0; i < NOVA_HUGE_BLOCKS; i++)
+            nova_update_block_csum_parity_precomputed(sb,
+                (const u8 *)kmem + (i << PAGE_SHIFT), sp_blocknr + i, NULL);
+        protect_done = true;
+        goto retry;
+    } else {
+        for(i = 0; i < NOVA_HUGE_BLOCKS; i++)
+            sbi->blocknr_to_entry[sp_blocknr + i] = alloc_entry;
+        hentry = sbi->index_slots ? nova_index_alloc_node(sb, alloc_entry) :
+                        nova_get_hentry(sbi, alloc_entry);
+        if(hentry) {
+            hentry->fp_strong_tag = NOVA_FP_STRONG_TAG(&fp_strong);
+            hlist_add_head(&hentry->strong_node, &sbi->huge_hash_table[huge_idx]);
+        }
+        *blocknr = sp_blocknr;
+    }
+	spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+
+    if(find_hentry) {
+        nova_entry_set_refcount(sbi, alloc_entry, 0);
+        nova_entry_set_blocknr(sbi, alloc_entry, 0);
+        nova_entry_flush(sbi, alloc_entry);
+        nova_free_entry(sb, alloc_entry);
+        nova_free_data_superpage(sb, sp_blocknr);
+        NOVA_STATS_ADD(huge_dedup_hit, 1);
+    } else {
+        NOVA_STATS_ADD(dedup_stored_blocks, NOVA_HUGE_BLOCKS);
+    }
+    NOVA_STATS_ADD(dedup_logical_blocks, NOVA_HUGE_BLOCKS);
+    ret = NOVA_HUGE_BLOCKS;
+out:
+    NOVA_END_TIMING(huge_dedup_t, huge_time);
+    return ret;
+}
+
+static inline unsigned int nova_dedup_hist_slot(u64 val)
+{
+    return min_t(unsigned int, fls64(val), NOVA_DEDUP_HIST_SLOTS - 1);
+}
+
+/**
+ * Chain lengths of the weak or strong table, over at most
+ * NOVA_DEDUP_HIST_SAMPLE buckets spread evenly across it. Each bucket is
+ * walked under its stripe lock, so a scrape never holds a lock for long.
+ * A PMEM index reports the used slots of its buckets instead.
+ */
+void nova_dedup_chain_hist(struct super_block *sb, bool strong, u64 *hist)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct hlist_head *table = strong ? sbi->strong_hash_table : sbi->weak_hash_table;
+    struct spinlock *locks = strong ? sbi->strong_hash_table_locks : sbi->weak_hash_table_locks;
+    struct nova_pindex *pindex = strong ? &sbi->strong_pindex : &sbi->weak_pindex;
+    unsigned long nr = 1UL << (nova_dedup_pindex(sbi) ? pindex->bucket_bits : sbi->index_bits);
+    unsigned long step = max(nr / NOVA_DEDUP_HIST_SAMPLE, 1UL);
+    unsigned long idx;
+    struct hlist_node *pos;
+    u64 len;
+
+    memset(hist, 0, sizeof(u64) * NOVA_DEDUP_HIST_SLOTS);
+    for (idx = 0; idx < nr; idx += step) {
+        len = 0;
+	    spin_lock(locks + idx % HASH_TABLE_LOCK_NUM);
+        if (nova_dedup_pindex(sbi))
+            len = nova_pindex_bucket_fill(pindex, idx);
+        else
+            hlist_for_each(pos, &table[idx])
+                len++;
+	    spin_unlock(locks + idx % HASH_TABLE_LOCK_NUM);
+        hist[nova_dedup_hist_slot(len)]++;
+    }
+}
+
+/* Refcounts over a sample of the allocated pmm entries, read without locks */
+void nova_dedup_refcount_hist(struct super_block *sb, u64 *hist)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    unsigned long nr = nova_entries_allocated(sbi);
+    unsigned long step = max(nr / NOVA_DEDUP_HIST_SAMPLE, 1UL);
+    unsigned long idx;
+
+    memset(hist, 0, sizeof(u64) * NOVA_DEDUP_HIST_SLOTS);
+    for (idx = 0; idx < nr; idx += step)
+        hist[nova_dedup_hist_slot(nova_entry_refcount(sbi, idx))]++;
+}
+
+/**
+ * Unlink a freed entry from a budgeted index, where its nodes, if any are
+ * left, have to be looked up in the chains, or from the PMEM index. Called
+ * with the stripe locks.
+ */
+static void nova_index_unlink_entry(struct super_block *sb, entrynr_t entrynr,
+    u32 weak_idx, u64 strong_idx)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_fp_weak *fp_weak = nova_entry_fp_weak(sbi, entrynr);
+    struct nova_fp_strong fp_strong;
+    struct hlist_head *hlist;
+    struct nova_hentry *hentry;
+
+    if (nova_dedup_pindex(sbi)) {
+        /* slots hold the entry number, so a stale fingerprint matches nothing */
+        nova_entry_fp_strong(sbi, entrynr, &fp_strong);
+        nova_pindex_delete(&sbi->weak_pindex, fp_weak->u32, fp_weak->u32, entrynr);
+        nova_pindex_delete(&sbi->strong_pindex, fp_strong.u64s[0],
+                NOVA_FP_STRONG_TAG(&fp_strong), entrynr);
+        return;
+    }
+    hentry = nova_index_find_entry(sbi, &sbi->weak_hash_table[weak_idx], entrynr, false);
+    if (hentry) {
+        hlist_del_init(&hentry->weak_node);
+        nova_filter_del(&sbi->weak_filter, fp_weak);
+        nova_index_release(sbi, hentry);
+    }
+    if (nova_entry_flag(sbi, entrynr) == FP_HUGE_FLAG)
+        hlist = &sbi->huge_hash_table[nova_entry_fp_strong_key(sbi, entrynr) & ((1 << sbi->huge_table_bits) - 1)];
+    else
+        hlist = &sbi->strong_hash_table[strong_idx];
+    hentry = nova_index_find_entry(sbi, hlist, entrynr, true);
+    if (hentry) {
+        hlist_del_init(&hentry->strong_node);
+        nova_index_release(sbi, hentry);
+    }
+}
+
+/**
+ * Drop one reference of a data block. Returns true if the block is not
+ * referenced anymore and has to be freed by the caller. Blocks of a 2MB
+ * extent are never returned to the caller, the superpage is freed here
+ * with the last of its references.
+ */
+bool nova_dedup_free_block(struct super_block *sb, unsigned long blocknr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_fp_strong fp_strong;
+    struct nova_hentry *hentry;
+    struct nova_fp_weak fp_weak;
+    u32 weak_idx;
+    u64 strong_idx, refcount;
+    u8 flag;
+    int64_t to_be_free_idx;
+    unsigned long huge_blocknr = 0, i;
+    bool is_free = false;
+
+    to_be_free_idx = sbi->blocknr_to_entry[blocknr];
+    if (to_be_free_idx < 0)
+        return true;
+
+    hentry = sbi->index_slots || nova_dedup_pindex(sbi) ? NULL : nova_get_hentry(sbi, to_be_free_idx);
+
+	spin_lock(sbi->non_dedup_fp_locks + to_be_free_idx % NON_DEDUP_FP_LOCK_NUM);
+    /* The links can only be changed by calc_non_fin thread under the non_dedup lock */
+    fp_weak.u32 = hentry ? hentry->fp_weak : nova_entry_fp_weak(sbi, to_be_free_idx)->u32;
+    weak_idx = (fp_weak.u32 & ((1 << sbi->index_bits) - 1));
+    strong_idx = (nova_entry_fp_strong_key(sbi, to_be_free_idx) & ((1 << sbi->index_bits) - 1));
+	spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+	spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+
+    refcount = nova_entry_add_ref(sbi, to_be_free_idx, -1);
+    flag = nova_entry_flag(sbi, to_be_free_idx);
+    trace_nova_dedup_ref_put(sb, to_be_free_idx, blocknr, refcount);
+    if (refcount == 0) {
+        is_free = true;
+        if (flag == FP_STRONG_FLAG) {
+            nova_entry_fp_strong(sbi, to_be_free_idx, &fp_strong);
+            nova_fp_cache_invalidate(&sbi->fp_cache, &fp_strong, to_be_free_idx);
+        }
+        if (!hentry) {
+            nova_index_unlink_entry(sb, to_be_free_idx, weak_idx, strong_idx);
+        } else {
+            if (!hlist_unhashed(&hentry->strong_node))
+                hlist_del_init(&hentry->strong_node);
+            if (!hlist_unhashed(&hentry->weak_node)) {
+                hlist_del_init(&hentry->weak_node);
+                nova_filter_del(&sbi->weak_filter, &fp_weak);
+            }
+        }
+        if (flag == FP_HUGE_FLAG)
+            huge_blocknr = nova_entry_blocknr(sbi, to_be_free_idx);
+        else
+            sbi->blocknr_to_entry[blocknr] = -1;
+        nova_entry_set_blocknr(sbi, to_be_free_idx, 0);
+        /* Entries churn with deletes, return them to the free list in batches */
+        nova_reclaim_entry(sb, to_be_free_idx);
+    }
+
+	spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+	spin_unlock(sbi->non_dedup_fp_locks + to_be_free_idx % NON_DEDUP_FP_LOCK_NUM);
+
+    if (flag == FP_HUGE_FLAG) {
+        if (is_free) {
+            for (i = 0; i < NOVA_HUGE_BLOCKS; i++)
+                sbi->blocknr_to_entry[huge_blocknr + i] = -1;
+            nova_free_data_superpage(sb, huge_blocknr);
+        }
+        return false;
+    }
+    return is_free;
+}
+
+/**
+ * Size the index for dedup_index_mb: the largest power of two of slots
+ * whose nodes, buckets and filters fit the budget. A budget that covers
+ * every entry leaves the index full.
+ */
+static void nova_dedup_size_index(struct nova_sb_info *sbi)
+{
+    unsigned long slots;
+
+    sbi->index_bits = sbi->num_entries_bits;
+    sbi->index_nr_slots = 0;
+    /* a PMEM index costs no DRAM per entry */
+    if (!sbi->index_budget_mb || sbi->pindex_blocks)
+        return;
+
+    slots = ((unsigned long)sbi->index_budget_mb << 20) / NOVA_INDEX_SLOT_BYTES;
+    if (slots >= sbi->num_entries)
+        return;
+    sbi->index_bits = max_t(int, fls64(slots) - 1, HASH_TABLE_LOCK_BITS);
+    sbi->index_nr_slots = 1UL << sbi->index_bits;
+}
+
+/**
+ * Allocate the DRAM index: hash tables, the index node pool, blocknr to
+ * entry map, weak fingerprint filter and fingerprint cache. The pool has
+ * a node per entry, or index_nr_slots of them with a budget. With a PMEM
+ * index, reserved by nova_init, only the map and the cache are in DRAM.
+ */
+int nova_dedup_init_index(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    size_t sz;
+    unsigned long i;
+
+    nova_dedup_size_index(sbi);
+    sz = 1 << sbi->num_entries_bits;
+    for (i = 0; i < HASH_TABLE_LOCK_NUM; ++i)
+        spin_lock_init(sbi->weak_hash_table_locks + i);
+    for (i = 0; i < HASH_TABLE_LOCK_NUM; ++i)
+        spin_lock_init(sbi->strong_hash_table_locks + i);
+    for (i = 0; i < NON_DEDUP_FP_LOCK_NUM; i++)
+        spin_lock_init(sbi->non_dedup_fp_locks + i);
+
+    sbi->blocknr_to_entry = vmalloc(sizeof(u64) * sz);
+    if (!sbi->blocknr_to_entry)
+        goto out_nomem;
+    for (i = 0; i < sz; i++)
+        sbi->blocknr_to_entry[i] = -1;
+
+    if (sbi->pindex_blocks) {
+        nova_pindex_init(&sbi->weak_pindex, nova_get_block(sb, nova_get_block_off(sb,
+                    sbi->pindex_start, NOVA_BLOCK_TYPE_4K)),
+                    sbi->num_entries_bits, HASH_TABLE_LOCK_BITS);
+        nova_pindex_init(&sbi->strong_pindex, nova_get_block(sb, nova_get_block_off(sb,
+                    sbi->pindex_start + sbi->pindex_blocks / 2, NOVA_BLOCK_TYPE_4K)),
+                    sbi->num_entries_bits, HASH_TABLE_LOCK_BITS);
+        nova_info("dedup index in PMEM: %lu blocks, %u bucket bits\n",
+              sbi->pindex_blocks, sbi->weak_pindex.bucket_bits);
+        goto init_cache;
+    }
+
+    /* zeroed hlist heads and nodes are empty heads and unhashed nodes */
+    sbi->weak_hash_table = vzalloc(sizeof(struct hlist_head) << sbi->index_bits);
+    sbi->strong_hash_table = vzalloc(sizeof(struct hlist_head) << sbi->index_bits);
+    sbi->hentries = vzalloc(sizeof(struct nova_hentry) *
+                (sbi->index_nr_slots ? sbi->index_nr_slots : sbi->num_entries));
+    /* one 2MB extent stands for NOVA_HUGE_BLOCKS blocks */
+    sbi->huge_table_bits = max_t(int, sbi->index_bits -
+                    (NOVA_HUGE_SHIFT - PAGE_SHIFT), HASH_TABLE_LOCK_BITS);
+    sbi->huge_hash_table = vzalloc(sizeof(struct hlist_head) << sbi->huge_table_bits);
+    if (!sbi->weak_hash_table || !sbi->strong_hash_table ||
+        !sbi->hentries || !sbi->huge_hash_table)
+        goto out_nomem;
+
+    if (nova_filter_init(&sbi->weak_filter, sbi->index_bits))
+        goto out_nomem;
+    if (sbi->index_nr_slots) {
+        sbi->index_slots = vmalloc(sizeof(struct nova_index_slot) * sbi->index_nr_slots);
+        if (!sbi->index_slots)
+            goto out_nomem;
+        for (i = 0; i < sbi->index_nr_slots; i++) {
+            sbi->index_slots[i].entrynr = NOVA_INDEX_SLOT_FREE;
+            sbi->index_slots[i].referenced = false;
+        }
+        sbi->index_hand = 0;
+        spin_lock_init(&sbi->index_lock);
+        if (nova_filter_init(&sbi->evicted_filter, sbi->index_bits))
+            goto out_nomem;
+        nova_info("dedup index budget %u MB: %lu of %lu entries in DRAM\n",
+              sbi->index_budget_mb, sbi->index_nr_slots, sbi->num_entries);
+    }
+init_cache:
+    if (nova_fp_cache_init(&sbi->fp_cache))
+        goto out_nomem;
+    sbi->fp_wq = alloc_workqueue("nova_fp", WQ_UNBOUND | WQ_HIGHPRI, 0);
+    if (!sbi->fp_wq)
+        goto out_nomem;
+
+    sbi->dup_block = 0;
+    sbi->cur_block = 0;
+    return 0;
+
+out_nomem:
+    nova_dedup_free_index(sb);
+    return -ENOMEM;
+}
+
+void nova_dedup_free_index(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+
+    vfree(sbi->weak_hash_table);
+    sbi->weak_hash_table = NULL;
+    vfree(sbi->strong_hash_table);
+    sbi->strong_hash_table = NULL;
+    vfree(sbi->huge_hash_table);
+    sbi->huge_hash_table = NULL;
+    vfree(sbi->hentries);
+    sbi->hentries = NULL;
+    vfree(sbi->index_slots);
+    sbi->index_slots = NULL;
+    nova_filter_free(&sbi->evicted_filter);
+    vfree(sbi->blocknr_to_entry);
+    sbi->blocknr_to_entry = NULL;
+    nova_filter_free(&sbi->weak_filter);
+    /* the PMEM index stays with the file system */
+    sbi->weak_pindex.buckets = NULL;
+    sbi->strong_pindex.buckets = NULL;
+    nova_fp_cache_free(&sbi->fp_cache);
+    if (sbi->fp_wq) {
+        destroy_workqueue(sbi->fp_wq);
+        sbi->fp_wq = NULL;
+    }
 }
\ No newline at end of file
@@ -2,19 +2,357 @@
 #define __NOVA_DEDUP_H
 
 #include <linux/types.h>
+#include <linux/workqueue.h>
 #include "entry.h"
+#include "super.h"
 
+/*
+ * Index node of a metadata entry, shared by the weak and the strong hash
+ * table. Nodes live in a pool indexed by entrynr that is allocated at mount,
+ * so nothing is allocated on the write path. An unhashed link means the
+ * entry is not in that table.
+ */
 struct nova_hentry{
-    struct hlist_node node;
-    entrynr_t entrynr;
+    struct hlist_node weak_node;
+    struct hlist_node strong_node;
+    u32 fp_weak;            /* pentry->fp_weak, valid while weak_node is linked */
+    u32 fp_strong_tag;      /* NOVA_FP_STRONG_TAG, valid while strong_node is linked */
 };
 
-extern int nova_dedup_new_write(struct super_block *sb,const char* data_buffer, unsigned long *blocknr);
+/* u64s[0] selects the strong bucket, so tag the chain with other bits */
+#define NOVA_FP_STRONG_TAG(fp) ((u32)(fp)->u64s[1])
+
+/* 2MB extents deduplicated as a whole, see nova_dedup_huge_write */
+#define NOVA_HUGE_SHIFT 21
+#define NOVA_HUGE_SIZE (1UL << NOVA_HUGE_SHIFT)
+#define NOVA_HUGE_BLOCKS (NOVA_HUGE_SIZE >> PAGE_SHIFT)
+
+/*
+ * A 4K chunk on its way through nova_dedup_new_write. fp_weak, fp_strong
+ * and stripe_csums are optional, filled in by a caller that fingerprinted
+ * or checksummed the chunk already. existed is set when the chunk was found
+ * stored: its block is shared and already carries valid checksums and parity.
+ */
+struct nova_dedup_chunk {
+    const char *data;
+    const struct nova_fp_weak *fp_weak;
+    const struct nova_fp_strong *fp_strong;
+    const u32 *stripe_csums;
+    bool existed;
+};
+
+/* Chunks of a large write fingerprinted together, see nova_dedup_fp_batch_calc */
+#define NOVA_FP_BATCH_BLOCKS 64
+#define NOVA_FP_MAX_WORKERS 16
+/* Fewer blocks per worker cost more to hand off than to hash inline */
+#define NOVA_FP_SLICE_MIN 4
+
+struct nova_fp_work {
+    struct work_struct work;
+    struct super_block *sb;
+    struct nova_fp_batch *batch;
+    unsigned int start, num;
+    int ret;
+};
+
+struct nova_fp_batch {
+    char *data;                 /* NOVA_FP_BATCH_BLOCKS chunks */
+    unsigned int num;
+    bool strong;                /* fp_strong is filled in */
+    bool csums;                 /* stripe_csums are filled in */
+    struct nova_fp_weak fp_weak[NOVA_FP_BATCH_BLOCKS];
+    struct nova_fp_strong fp_strong[NOVA_FP_BATCH_BLOCKS];
+    u32 stripe_csums[NOVA_FP_BATCH_BLOCKS][8];
+    struct nova_fp_work works[NOVA_FP_MAX_WORKERS];
+};
+
+/*
+ * Histograms of the dedup proc file, slot i > 0 counts values in
+ * [2^(i-1), 2^i), the last slot everything above. Sampled, see
+ * nova_dedup_chain_hist.
+ */
+#define NOVA_DEDUP_HIST_SLOTS 8
+#define NOVA_DEDUP_HIST_SAMPLE 4096
+
+/* Outcome of an index lookup, reported by the nova_dedup_lookup tracepoint */
+enum nova_dedup_lookup_result {
+    NOVA_LOOKUP_MISS,
+    NOVA_LOOKUP_WEAK_HIT,
+    NOVA_LOOKUP_STRONG_HIT,
+    NOVA_LOOKUP_CACHE_HIT,
+    NOVA_LOOKUP_COLLISION,
+};
+
+/*
+ * Slot of the budgeted index, mounted with dedup_index_mb. The node pool
+ * then holds index_nr_slots nodes rather than one per entry: a node is
+ * taken for every table an entry is linked in, and recycled by a CLOCK
+ * sweep once the pool is full. Evicted fingerprints stay in PMEM but are
+ * no longer found by lookups.
+ */
+struct nova_index_slot {
+    entrynr_t entrynr;      /* NOVA_INDEX_SLOT_FREE when the node is free */
+    bool referenced;
+};
+
+#define NOVA_INDEX_SLOT_FREE ((entrynr_t)-1)
+/* Slots a CLOCK sweep looks at before giving up on indexing an entry */
+#define NOVA_INDEX_SCAN_MAX 256
+/* DRAM per slot: node, slot, weak and strong bucket, two filter entries */
+#define NOVA_INDEX_SLOT_BYTES (sizeof(struct nova_hentry) + \
+    sizeof(struct nova_index_slot) + 2 * sizeof(struct hlist_head) + 8)
+
+/* Only for a full index, a budgeted one has no node per entry */
+static inline struct nova_hentry *nova_get_hentry(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    return sbi->hentries + entrynr;
+}
+
+static inline entrynr_t nova_hentry_entrynr(struct nova_sb_info *sbi, struct nova_hentry *hentry)
+{
+    if (sbi->index_slots)
+        return READ_ONCE(sbi->index_slots[hentry - sbi->hentries].entrynr);
+    return hentry - sbi->hentries;
+}
+
+/* Whether the entries are nova_pmm_centry, formatted with dedup_compact */
+static inline bool nova_dedup_compact(struct nova_sb_info *sbi)
+{
+    return sbi->entry_shift == NOVA_CENTRY_SHIFT;
+}
+
+/* Entries are handed out only once their chunk is in entry_chunks */
+static inline void *nova_get_entry(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    return sbi->entry_chunks[entrynr >> NOVA_ENTRY_CHUNK_SHIFT(sbi)]->entries +
+        ((entrynr & (NOVA_ENTRY_CHUNK_ENTRIES(sbi) - 1)) << sbi->entry_shift);
+}
+
+static inline struct nova_pmm_entry *nova_get_pentry(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    return nova_get_entry(sbi, entrynr);
+}
+
+static inline struct nova_pmm_centry *nova_get_centry(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    return nova_get_entry(sbi, entrynr);
+}
+
+/* Entries below this number have their chunk, for lockless scans */
+static inline unsigned long nova_entries_allocated(struct nova_sb_info *sbi)
+{
+    return smp_load_acquire(&sbi->entry_nr_chunks) << NOVA_ENTRY_CHUNK_SHIFT(sbi);
+}
+
+extern u64 nova_centry_refcount_ext(struct nova_sb_info *sbi, entrynr_t entrynr);
+extern u64 nova_centry_add_ref_ext(struct nova_sb_info *sbi, entrynr_t entrynr, s64 delta);
+
+/*
+ * Entry fields for either format. The setters leave flushing to the
+ * caller, see nova_entry_flush, except for a compact refcount that moves
+ * to or from the extension table.
+ */
+static inline unsigned long nova_entry_blocknr(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    if (nova_dedup_compact(sbi))
+        return nova_get_centry(sbi, entrynr)->blocknr_flag & NOVA_CENTRY_BLOCKNR_MASK;
+    return nova_get_pentry(sbi, entrynr)->blocknr;
+}
+
+static inline void nova_entry_set_blocknr(struct nova_sb_info *sbi, entrynr_t entrynr,
+    unsigned long blocknr)
+{
+    struct nova_pmm_centry *centry;
+
+    if (nova_dedup_compact(sbi)) {
+        centry = nova_get_centry(sbi, entrynr);
+        centry->blocknr_flag = (centry->blocknr_flag & ~NOVA_CENTRY_BLOCKNR_MASK) | blocknr;
+    } else {
+        nova_get_pentry(sbi, entrynr)->blocknr = blocknr;
+    }
+}
+
+static inline u8 nova_entry_flag(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    if (nova_dedup_compact(sbi))
+        return nova_get_centry(sbi, entrynr)->blocknr_flag >> NOVA_CENTRY_FLAG_SHIFT;
+    return nova_get_pentry(sbi, entrynr)->flag;
+}
+
+static inline void nova_entry_set_flag(struct nova_sb_info *sbi, entrynr_t entrynr, u8 flag)
+{
+    struct nova_pmm_centry *centry;
+
+    if (nova_dedup_compact(sbi)) {
+        centry = nova_get_centry(sbi, entrynr);
+        centry->blocknr_flag = (centry->blocknr_flag & NOVA_CENTRY_BLOCKNR_MASK) |
+            (u64)flag << NOVA_CENTRY_FLAG_SHIFT;
+    } else {
+        nova_get_pentry(sbi, entrynr)->flag = flag;
+    }
+}
+
+/* Both formats keep the weak fingerprint whole */
+static inline struct nova_fp_weak *nova_entry_fp_weak(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    if (nova_dedup_compact(sbi))
+        return &nova_get_centry(sbi, entrynr)->fp_weak;
+    return &nova_get_pentry(sbi, entrynr)->fp_weak;
+}
+
+/* u64s[0], the strong bucket key */
+static inline u64 nova_entry_fp_strong_key(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    if (nova_dedup_compact(sbi))
+        return nova_get_centry(sbi, entrynr)->fp_strong[0];
+    return nova_get_pentry(sbi, entrynr)->fp_strong.u64s[0];
+}
+
+static inline void nova_entry_fp_strong(struct nova_sb_info *sbi, entrynr_t entrynr,
+    struct nova_fp_strong *fp)
+{
+    struct nova_pmm_centry *centry;
+
+    if (nova_dedup_compact(sbi)) {
+        centry = nova_get_centry(sbi, entrynr);
+        memset(fp, 0, sizeof(*fp));
+        memcpy(fp->u64s, centry->fp_strong, sizeof(centry->fp_strong));
+    } else {
+        *fp = nova_get_pentry(sbi, entrynr)->fp_strong;
+    }
+}
+
+static inline void nova_entry_set_fp_strong(struct nova_sb_info *sbi, entrynr_t entrynr,
+    const struct nova_fp_strong *fp)
+{
+    if (nova_dedup_compact(sbi))
+        memcpy(nova_get_centry(sbi, entrynr)->fp_strong, fp->u64s,
+               sizeof(((struct nova_pmm_centry *)0)->fp_strong));
+    else
+        nova_get_pentry(sbi, entrynr)->fp_strong = *fp;
+}
+
+static inline bool nova_entry_fp_strong_equal(struct nova_sb_info *sbi, entrynr_t entrynr,
+    const struct nova_fp_strong *fp)
+{
+    struct nova_pmm_centry *centry;
+
+    if (nova_dedup_compact(sbi)) {
+        centry = nova_get_centry(sbi, entrynr);
+        return centry->fp_strong[0] == fp->u64s[0] && centry->fp_strong[1] == fp->u64s[1];
+    }
+    return !memcmp(&nova_get_pentry(sbi, entrynr)->fp_strong, fp, sizeof(*fp));
+}
+
+/* NOVA_CENTRY_REF_PINNED for a compact entry that can no longer be counted */
+static inline u64 nova_entry_refcount(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    u32 refcount;
+
+    if (nova_dedup_compact(sbi)) {
+        refcount = READ_ONCE(nova_get_centry(sbi, entrynr)->refcount);
+        return refcount == NOVA_CENTRY_REF_EXT ?
+            nova_centry_refcount_ext(sbi, entrynr) : refcount;
+    }
+    return READ_ONCE(nova_get_pentry(sbi, entrynr)->refcount);
+}
+
+/* Only for counts that fit a compact entry inline, when it is created or reset */
+static inline void nova_entry_set_refcount(struct nova_sb_info *sbi, entrynr_t entrynr,
+    u32 refcount)
+{
+    if (nova_dedup_compact(sbi))
+        nova_get_centry(sbi, entrynr)->refcount = refcount;
+    else
+        nova_get_pentry(sbi, entrynr)->refcount = refcount;
+}
+
+/*
+ * Returns the new count. A reference is taken under the weak or the strong
+ * stripe lock of the entry, not always both, so the count is updated
+ * atomically rather than under a lock all paths share. Only the free path
+ * holds both, which keeps a count that dropped to 0 from being raised again.
+ */
+static inline u64 nova_entry_add_ref(struct nova_sb_info *sbi, entrynr_t entrynr, s64 delta)
+{
+    struct nova_pmm_centry *centry;
+    struct nova_pmm_entry *pentry;
+    u32 old_inline;
+    u64 old;
+    s64 refcount;
+
+    if (nova_dedup_compact(sbi)) {
+        centry = nova_get_centry(sbi, entrynr);
+        do {
+            old_inline = READ_ONCE(centry->refcount);
+            refcount = (s64)old_inline + delta;
+            if (old_inline == NOVA_CENTRY_REF_EXT || refcount >= NOVA_CENTRY_REF_EXT)
+                return nova_centry_add_ref_ext(sbi, entrynr, delta);
+        } while (cmpxchg(&centry->refcount, old_inline, (u32)refcount) != old_inline);
+        return refcount;
+    }
+    pentry = nova_get_pentry(sbi, entrynr);
+    do {
+        old = READ_ONCE(pentry->refcount);
+    } while (cmpxchg(&pentry->refcount, old, old + delta) != old);
+    return old + delta;
+}
+
+static inline void nova_entry_flush(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    nova_flush_buffer(nova_get_entry(sbi, entrynr), 1UL << sbi->entry_shift, true);
+}
+
+static inline void nova_entry_flush_refcount(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    if (nova_dedup_compact(sbi))
+        nova_flush_buffer(&nova_get_centry(sbi, entrynr)->refcount,
+                          sizeof(((struct nova_pmm_centry *)0)->refcount), true);
+    else
+        nova_flush_buffer(&nova_get_pentry(sbi, entrynr)->refcount,
+                          sizeof(((struct nova_pmm_entry *)0)->refcount), true);
+}
+
+/* Whether the fingerprint index lives in PMEM, see pindex.h */
+static inline bool nova_dedup_pindex(struct nova_sb_info *sbi)
+{
+    return sbi->weak_pindex.buckets != NULL;
+}
+
+extern void nova_dedup_init_ctl(struct nova_sb_info *sbi);
+extern int nova_dedup_parse_mode(const char *name, u32 *mode);
+extern const char *nova_dedup_mode_name(u32 mode);
+extern void nova_fp_weak_calc(const void *addr, struct nova_fp_weak *fp);
+extern bool nova_dedup_weak_index_active(struct super_block *sb);
+extern void nova_dedup_prefetch_bucket(struct super_block *sb, const struct nova_fp_weak *fp_weak);
+extern void nova_dedup_prefetch_entry(struct super_block *sb, const struct nova_fp_weak *fp_weak);
+extern bool nova_dedup_fp_parallel_wanted(struct super_block *sb, size_t len);
+extern struct nova_fp_batch *nova_dedup_fp_batch_alloc(struct super_block *sb);
+extern void nova_dedup_fp_batch_free(struct nova_fp_batch *batch);
+extern int nova_dedup_fp_batch_calc(struct super_block *sb, struct nova_fp_batch *batch,
+    unsigned int num);
+extern int nova_dedup_new_write(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr);
+extern int nova_dedup_write_mode(struct super_block *sb, struct nova_dedup_chunk *chunk,
+    unsigned long *blocknr, u32 dup_mode);
+extern int nova_dedup_huge_write(struct super_block *sb, const char __user *buf,
+    unsigned long *blocknr, bool *existed);
+extern bool nova_dedup_free_block(struct super_block *sb, unsigned long blocknr);
+extern void nova_dedup_chain_hist(struct super_block *sb, bool strong, u64 *hist);
+extern void nova_dedup_refcount_hist(struct super_block *sb, u64 *hist);
+extern int nova_dedup_init_index(struct super_block *sb);
+extern void nova_dedup_free_index(struct super_block *sb);
 
 struct nova_hentry *nova_find_in_weak_hlist(struct super_block *sb, struct hlist_head *hlist, struct nova_fp_weak *fp_weak);
 
 struct nova_hentry *nova_find_in_strong_hlist(struct super_block *sb, struct hlist_head *hlist, struct nova_fp_strong *fp_strong);
 
-struct nova_hentry *nova_alloc_hentry(struct super_block* sb);
+bool nova_dedup_find_weak(struct super_block *sb, struct nova_fp_weak *fp_weak, u32 weak_idx, entrynr_t *entrynr);
+
+bool nova_dedup_find_strong(struct super_block *sb, struct nova_fp_strong *fp_strong, u64 strong_idx, entrynr_t *entrynr);
+
+void nova_link_weak_hentry(struct super_block *sb, entrynr_t entrynr, struct nova_fp_weak *fp_weak, u32 weak_idx);
+
+void nova_link_strong_hentry(struct super_block *sb, entrynr_t entrynr, struct nova_fp_strong *fp_strong, u64 strong_idx);
 
 #endif
\ No newline at end of file
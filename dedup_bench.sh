@@ -0,0 +1,149 @@
+#!/bin/bash
+#
+# Sweep fio over NV-Dedup configurations and record one CSV row per run.
+#
+# Every configuration remounts a fresh file system through setup.sh, then
+# runs the write, overwrite, read and unlink phases against it. Stats are
+# cleared before each phase; the fio JSON and the timing_stats, IO_stats
+# and dedup proc files it leaves behind are kept under $OUT/<run>/.
+#
+# /dev/pmem0 must exist and support DAX. Without NVDIMMs, emulate one by
+# booting with memmap=<size>G!<offset>G; brd devices do not support DAX.
+#
+#   sudo bash dedup_bench.sh [results dir]
+#
+# Knobs, each a space separated list where it makes sense:
+#   MODES="auto str_fin"   dedup= mount option
+#   DUPS="0 50 80"         fio dedupe_percentage
+#   BSS="4k 64k"           block size
+#   JOBS="1 4"             fio numjobs, one file per job
+#   ENGINES="sync libaio"  ioengine, libaio runs at IODEPTH
+#   PHASES="write overwrite read unlink"
+#   SIZE=1G IODEPTH=16 TIMING=1
+
+set -e
+
+MODES=${MODES:-"auto non_fin ws_fin str_fin off"}
+DUPS=${DUPS:-"0 50 80 100"}
+BSS=${BSS:-"4k 64k"}
+JOBS=${JOBS:-"1 4"}
+ENGINES=${ENGINES:-"sync libaio"}
+PHASES=${PHASES:-"write overwrite read unlink"}
+SIZE=${SIZE:-1G}
+IODEPTH=${IODEPTH:-16}
+TIMING=${TIMING:-1}
+
+DEV=pmem0
+MNT=/mnt/pmem0
+PROC=/proc/fs/NOVA/$DEV
+OUT=${1:-bench-$(date +%Y%m%d-%H%M%S)}
+CSV=$OUT/results.csv
+
+if [ ! -b /dev/$DEV ]; then
+	echo "/dev/$DEV not found, boot with memmap=<size>G!<offset>G" >&2
+	exit 1
+fi
+for tool in fio python3; do
+	if ! command -v $tool > /dev/null; then
+		echo "$tool is required" >&2
+		exit 1
+	fi
+done
+
+mkdir -p $OUT
+echo "run,mode,dedupe_pct,bs,jobs,engine,phase,bw_kib,iops,clat_mean_ns,clat_p99_ns,runtime_ms,dedup_ratio,logical_bytes,physical_bytes,weak_hit,strong_hit" > $CSV
+
+# bw,iops,clat mean,clat p99,runtime of one direction of a fio JSON report
+fio_fields() {
+	python3 - "$1" "$2" <<'EOF'
+import json, sys
+job = json.load(open(sys.argv[1]))['jobs'][0][sys.argv[2]]
+clat = job.get('clat_ns', {})
+p99 = clat.get('percentile', {}).get('99.000000', 0)
+print('%d,%d,%d,%d,%d' % (job['bw'], job['iops'], clat.get('mean', 0),
+			  p99, job['runtime']))
+EOF
+}
+
+# dedup ratio,logical,physical,weak hits,strong hits from the dedup file
+dedup_fields() {
+	awk '
+	/^Logical bytes/ { gsub(",", ""); l = $3; p = $6; r = $9 }
+	/^Weak table hit/ { gsub(",", ""); w = $4 }
+	/^Strong table hit/ { gsub(",", ""); s = $4 }
+	END { printf "%s,%s,%s,%s,%s", r, l, p, w, s }' $1
+}
+
+clear_stats() {
+	echo 1 > $PROC/timing_stats
+	echo 1 > $PROC/dedup
+}
+
+save_stats() {
+	cat $PROC/timing_stats > $1.timing_stats
+	cat $PROC/IO_stats > $1.IO_stats
+	cat $PROC/dedup > $1.dedup
+}
+
+run_fio() {
+	local rw=$1 json=$2
+
+	fio --name=dedup_bench --directory=$MNT --filename_format='bench.$jobnum' \
+		--rw=$rw --bs=$bs --size=$SIZE --numjobs=$jobs --thread \
+		--ioengine=$engine --iodepth=$depth --direct=1 --fallocate=none \
+		--dedupe_percentage=$dup --group_reporting \
+		--output-format=json --output=$json > /dev/null
+}
+
+run=0
+for mode in $MODES; do
+for dup in $DUPS; do
+for bs in $BSS; do
+for jobs in $JOBS; do
+for engine in $ENGINES; do
+	run=$((run + 1))
+	dir=$OUT/$run
+	mkdir -p $dir
+	depth=1
+	[ $engine = libaio ] && depth=$IODEPTH
+
+	echo "run $run: mode $mode, dedupe $dup%, bs $bs, $jobs jobs, $engine"
+	bash setup.sh $TIMING dedup=$mode > $dir/setup.log 2>&1
+
+	for phase in $PHASES; do
+		clear_stats
+		case $phase in
+		write)
+			run_fio write $dir/$phase.json
+			fields=$(fio_fields $dir/$phase.json write)
+			;;
+		overwrite)
+			run_fio randwrite $dir/$phase.json
+			fields=$(fio_fields $dir/$phase.json write)
+			;;
+		read)
+			run_fio read $dir/$phase.json
+			fields=$(fio_fields $dir/$phase.json read)
+			;;
+		unlink)
+			start=$(date +%s%N)
+			rm -f $MNT/bench.*
+			sync
+			end=$(date +%s%N)
+			fields=",,,,$(((end - start) / 1000000))"
+			;;
+		*)
+			echo "unknown phase $phase" >&2
+			exit 1
+		esac
+		save_stats $dir/$phase
+		echo "$run,$mode,$dup,$bs,$jobs,$engine,$phase,$fields,$(dedup_fields $dir/$phase.dedup)" >> $CSV
+	done
+done
+done
+done
+done
+done
+
+umount $MNT
+echo "results in $CSV"
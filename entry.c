@@ -3,24 +3,209 @@
 #include "super.h"
 #include "nova.h"
 #include "dedup.h"
+#include "nova_trace.h"
+
+/* Entries between two nova_dedup_non_fin progress events */
+#define NOVA_NON_FIN_TRACE_STRIDE 65536
+
+/* Below this many free entries allocators reclaim the queued ones themselves */
+#define NOVA_ENTRY_LOW_WATERMARK(sbi) ((unsigned long)(sbi)->cpus * NOVA_ENTRY_RECLAIM_BATCH)
+
+static inline struct nova_entry_node *nova_entry_node(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    return &sbi->entry_chunks[entrynr >> NOVA_ENTRY_CHUNK_SHIFT(sbi)]->nodes[entrynr & (NOVA_ENTRY_CHUNK_ENTRIES(sbi) - 1)];
+}
+
+static inline struct nova_centry_ext *nova_centry_ext_find(struct nova_sb_info *sbi,
+    entrynr_t entrynr, struct nova_centry_ext **free_slot)
+{
+    unsigned int i;
+
+    for (i = 0; i < NOVA_CENTRY_EXT_SLOTS; i++) {
+        if (sbi->entry_ext[i].entrynr == entrynr + 1)
+            return &sbi->entry_ext[i];
+        if (free_slot && !*free_slot && !sbi->entry_ext[i].entrynr)
+            *free_slot = &sbi->entry_ext[i];
+    }
+    return NULL;
+}
+
+u64 nova_centry_refcount_ext(struct nova_sb_info *sbi, entrynr_t entrynr)
+{
+    struct nova_centry_ext *slot;
+    u64 refcount = NOVA_CENTRY_REF_PINNED;
+
+    spin_lock(&sbi->entry_ext_lock);
+    slot = nova_centry_ext_find(sbi, entrynr, NULL);
+    if (slot)
+        refcount = slot->refcount;
+    spin_unlock(&sbi->entry_ext_lock);
+    return refcount;
+}
+
+/*
+ * Change the refcount of a compact entry that is or is going to be kept in
+ * the extension table. The slot is persisted before the entry points to
+ * it, and the count back in the entry before the slot is released, so a
+ * crash leaves a stale slot at worst. With every slot taken the entry is
+ * pinned: it keeps NOVA_CENTRY_REF_EXT and is never freed.
+ *
+ * Inline counts are changed by cmpxchg without entry_ext_lock, see
+ * nova_entry_add_ref, so moving a count out of the entry is a cmpxchg too.
+ * Once the entry holds NOVA_CENTRY_REF_EXT only this lock changes it.
+ */
+u64 nova_centry_add_ref_ext(struct nova_sb_info *sbi, entrynr_t entrynr, s64 delta)
+{
+    struct nova_pmm_centry *centry = nova_get_centry(sbi, entrynr);
+    struct nova_centry_ext *slot, *free_slot;
+    u32 old_inline;
+    u64 refcount;
+
+    spin_lock(&sbi->entry_ext_lock);
+retry:
+    free_slot = NULL;
+    slot = nova_centry_ext_find(sbi, entrynr, &free_slot);
+    old_inline = READ_ONCE(centry->refcount);
+    if (old_inline != NOVA_CENTRY_REF_EXT) {
+        refcount = old_inline + delta;
+        if (refcount < NOVA_CENTRY_REF_EXT) {
+            /* an inline update brought the count back down meanwhile */
+            if (cmpxchg(&centry->refcount, old_inline, (u32)refcount) != old_inline)
+                goto retry;
+            nova_flush_buffer(&centry->refcount, sizeof(centry->refcount), true);
+            goto out;
+        }
+        if (!slot)
+            slot = free_slot;
+        if (slot) {
+            slot->refcount = refcount;
+            slot->entrynr = entrynr + 1;
+            nova_flush_buffer(slot, sizeof(*slot), true);
+        }
+        if (cmpxchg(&centry->refcount, old_inline, NOVA_CENTRY_REF_EXT) != old_inline) {
+            if (slot) {
+                slot->entrynr = 0;
+                nova_flush_buffer(slot, sizeof(*slot), true);
+            }
+            goto retry;
+        }
+        nova_flush_buffer(&centry->refcount, sizeof(centry->refcount), true);
+        if (!slot) {
+            refcount = NOVA_CENTRY_REF_PINNED;
+            NOVA_STATS_ADD(entry_ref_pinned, 1);
+        }
+        goto out;
+    }
+
+    if (!slot) {
+        refcount = NOVA_CENTRY_REF_PINNED;
+        goto out;
+    }
+    refcount = slot->refcount + delta;
+    if (refcount < NOVA_CENTRY_REF_EXT) {
+        WRITE_ONCE(centry->refcount, (u32)refcount);
+        nova_flush_buffer(&centry->refcount, sizeof(centry->refcount), true);
+        slot->entrynr = 0;
+        nova_flush_buffer(slot, sizeof(*slot), true);
+    } else {
+        slot->refcount = refcount;
+        nova_flush_buffer(slot, sizeof(*slot), true);
+    }
+out:
+    spin_unlock(&sbi->entry_ext_lock);
+    return refcount;
+}
+
+/*
+ * Add a chunk to the entry table: a zeroed data block, whose number is
+ * persisted in the next directory slot before any of its entries is handed
+ * out, so the directory only ever points at initialized entries. No inode
+ * log references the block; failure recovery keeps it allocated from the
+ * directory, see nova_set_entry_table_bm. Returns 0 as well when a racing
+ * allocator has grown the table meanwhile.
+ */
+static int nova_grow_entry_table(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_entry_chunk *chunk;
+    unsigned long blocknr, nr, i;
+    __le64 *dir;
+    int ret = 0;
+
+    mutex_lock(&sbi->entry_grow_lock);
+    if (READ_ONCE(sbi->num_free_entries))
+        goto out;
+    nr = sbi->entry_nr_chunks;
+    ret = -ENOSPC;
+    if (nr == sbi->num_entries >> NOVA_ENTRY_CHUNK_SHIFT(sbi))
+        goto out;
+    ret = -ENOMEM;
+    chunk = kmalloc(sizeof(*chunk) + NOVA_ENTRY_CHUNK_ENTRIES(sbi) * sizeof(chunk->nodes[0]),
+                    GFP_KERNEL);
+    if (!chunk)
+        goto out;
+    ret = nova_new_data_block(sb, &blocknr, ALLOC_INIT_ZERO);
+    if (ret < 0) {
+        kfree(chunk);
+        goto out;
+    }
+    PERSISTENT_BARRIER();
+
+    dir = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
+    dir[nr] = cpu_to_le64(blocknr);
+    nova_flush_buffer(&dir[nr], sizeof(dir[nr]), true);
+    chunk->entries = nova_get_block(sb, nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K));
+    sbi->entry_chunks[nr] = chunk;
+    smp_store_release(&sbi->entry_nr_chunks, nr + 1);
+
+    spin_lock(&sbi->free_list_lock);
+    for (i = 0; i < NOVA_ENTRY_CHUNK_ENTRIES(sbi); i++) {
+        chunk->nodes[i].entrynr = (nr << NOVA_ENTRY_CHUNK_SHIFT(sbi)) + i;
+        list_add_tail(&chunk->nodes[i].link, &sbi->meta_free_list);
+    }
+    sbi->num_free_entries += NOVA_ENTRY_CHUNK_ENTRIES(sbi);
+    spin_unlock(&sbi->free_list_lock);
+    NOVA_STATS_ADD(entry_table_grow, 1);
+    ret = 0;
+out:
+    mutex_unlock(&sbi->entry_grow_lock);
+    return ret;
+}
 
 /* 
 * Author:Hsiao
 * Assume the lock is acquired before calling
+*
+* Returns -ENOSPC rather than waiting when no entry is left. Writers that
+* find entries running low first pay for the pending reclaim, and grow the
+* table only when that leaves the free list empty.
 */
-entrynr_t nova_alloc_entry(struct super_block *sb)
+int nova_alloc_entry(struct super_block *sb, entrynr_t *entrynr)
 {
-    entrynr_t entrynr;
     struct nova_sb_info *sbi = NOVA_SB(sb);
     struct nova_entry_node *alloc_entry;
 
+    if (READ_ONCE(sbi->num_free_entries) < NOVA_ENTRY_LOW_WATERMARK(sbi) &&
+        nova_drain_entry_reclaim(sb))
+        NOVA_STATS_ADD(entry_alloc_throttle, 1);
+
     spin_lock(&sbi->free_list_lock);
+    while (list_empty(&sbi->meta_free_list)) {
+        spin_unlock(&sbi->free_list_lock);
+        if (nova_grow_entry_table(sb) < 0) {
+            NOVA_STATS_ADD(entry_alloc_fail, 1);
+            return -ENOSPC;
+        }
+        spin_lock(&sbi->free_list_lock);
+    }
     alloc_entry = list_first_entry(&sbi->meta_free_list,struct nova_entry_node, link);
     list_del(&alloc_entry->link);
-    entrynr = alloc_entry->entrynr;
+    --sbi->num_free_entries;
+    *entrynr = alloc_entry->entrynr;
     spin_unlock(&sbi->free_list_lock);
+    trace_nova_dedup_entry_alloc(sb, *entrynr, READ_ONCE(sbi->num_free_entries));
 
-    return entrynr;
+    return 0;
 }
 
 /*
@@ -33,39 +218,115 @@ int nova_free_entry(struct super_block *sb, entrynr_t entrynr)
     struct nova_entry_node *free_entry;
     
     spin_lock(&sbi->free_list_lock);
-    free_entry = &sbi->free_list_buf[entrynr];
+    free_entry = nova_entry_node(sbi, entrynr);
     list_add_tail(&free_entry->link,&sbi->meta_free_list);
+    ++sbi->num_free_entries;
     spin_unlock(&sbi->free_list_lock);
+    trace_nova_dedup_entry_free(sb, entrynr, READ_ONCE(sbi->num_free_entries));
 
     return 0;
 }
 
+/* Return a queue to the free list, with the queue lock held */
+static unsigned int nova_flush_entry_reclaim(struct nova_sb_info *sbi,
+    struct nova_entry_reclaim *rq)
+{
+    unsigned int i, num = rq->num;
+
+    spin_lock(&sbi->free_list_lock);
+    for (i = 0; i < num; i++)
+        list_add_tail(&nova_entry_node(sbi, rq->entries[i])->link, &sbi->meta_free_list);
+    sbi->num_free_entries += num;
+    spin_unlock(&sbi->free_list_lock);
+    rq->num = 0;
+
+    return num;
+}
+
+/*
+ * Queue a freed entry on this CPU. A full queue goes back to the free list
+ * right away, the others are drained by the non_fin thread or by an
+ * allocator running low.
+ */
+void nova_reclaim_entry(struct super_block *sb, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_entry_reclaim *rq = &sbi->entry_reclaim[nova_get_cpuid(sb)];
+
+    trace_nova_dedup_entry_free(sb, entrynr, READ_ONCE(sbi->num_free_entries));
+    spin_lock(&rq->lock);
+    rq->entries[rq->num++] = entrynr;
+    if (rq->num == NOVA_ENTRY_RECLAIM_BATCH) {
+        nova_flush_entry_reclaim(sbi, rq);
+        NOVA_STATS_ADD(entry_reclaim_sync, 1);
+    }
+    spin_unlock(&rq->lock);
+}
+
+/* Return every queued entry to the free list, returns how many */
+unsigned long nova_drain_entry_reclaim(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_entry_reclaim *rq;
+    unsigned long drained = 0;
+    int cpu;
+
+    for (cpu = 0; cpu < sbi->cpus; cpu++) {
+        rq = &sbi->entry_reclaim[cpu];
+        if (!READ_ONCE(rq->num))
+            continue;
+        spin_lock(&rq->lock);
+        drained += nova_flush_entry_reclaim(sbi, rq);
+        spin_unlock(&rq->lock);
+    }
+    return drained;
+}
+
+unsigned long nova_entry_reclaim_pending(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    unsigned long pending = 0;
+    int cpu;
+
+    for (cpu = 0; cpu < sbi->cpus; cpu++)
+        pending += READ_ONCE(sbi->entry_reclaim[cpu].num);
+    return pending;
+}
+
 /*
 * Author:Hsiao
 * init entry free list
+*
+* The list starts empty: entries and their nodes come with the chunks
+* nova_alloc_entry adds to the table, so nothing here scales with the
+* device but the chunk pointers.
 */
 int nova_init_entry_list(struct super_block *sb){
     struct nova_sb_info *sbi = NOVA_SB(sb);
-    size_t buf_sz;
     unsigned long i;
-    struct nova_entry_node *i_node;
 
-    buf_sz = sbi->num_blocks * sizeof(struct nova_entry_node);
-    sbi->free_list_buf = vzalloc(buf_sz);
-    if( sbi->free_list_buf == NULL) {
-        vfree(sbi->free_list_buf);
+    sbi->entry_chunks = vzalloc(sizeof(struct nova_entry_chunk *) *
+                (sbi->num_entries >> NOVA_ENTRY_CHUNK_SHIFT(sbi)));
+    if (sbi->entry_chunks == NULL)
+        return -ENOMEM;
+    sbi->entry_reclaim = kcalloc(sbi->cpus, sizeof(struct nova_entry_reclaim), GFP_KERNEL);
+    if (!sbi->entry_reclaim) {
+        vfree(sbi->entry_chunks);
+        sbi->entry_chunks = NULL;
         return -ENOMEM;
     }
+    for (i = 0; i < sbi->cpus; i++)
+        spin_lock_init(&sbi->entry_reclaim[i].lock);
 
     INIT_LIST_HEAD(&sbi->meta_free_list);
     spin_lock_init(&sbi->free_list_lock);
-
-
-    for(i = 0; i < sbi->num_blocks; ++i) {
-        i_node = &sbi->free_list_buf[i];
-        i_node->entrynr = i;
-        list_add_tail(&i_node->link,&sbi->meta_free_list);
-    }
+    mutex_init(&sbi->entry_grow_lock);
+    if (sbi->entry_ext_start)
+        sbi->entry_ext = nova_get_block(sb, nova_get_block_off(sb, sbi->entry_ext_start,
+                                        NOVA_BLOCK_TYPE_4K));
+    spin_lock_init(&sbi->entry_ext_lock);
+    sbi->entry_nr_chunks = 0;
+    sbi->num_free_entries = 0;
     return 0;
 }
 
@@ -76,8 +337,16 @@ int nova_init_entry_list(struct super_block *sb){
 void nova_free_entry_list(struct super_block *sb) 
 {
     struct nova_sb_info *sbi = NOVA_SB(sb);
+    unsigned long i;
 
-    vfree(sbi->free_list_buf);
+    /* the chunks themselves stay with the file system */
+    if (sbi->entry_chunks)
+        for (i = 0; i < sbi->entry_nr_chunks; i++)
+            kfree(sbi->entry_chunks[i]);
+    vfree(sbi->entry_chunks);
+    sbi->entry_chunks = NULL;
+    kfree(sbi->entry_reclaim);
+    sbi->entry_reclaim = NULL;
 }
 /**
  * @author
@@ -109,49 +378,45 @@ static void calc_non_fin_try_sleeping(struct nova_sb_info *sbi)
 static int nova_calc_non_fin(struct super_block *sb)
 {
     struct nova_sb_info *sbi = NOVA_SB(sb);
-    struct nova_pmm_entry *pentries, *pentry;
     struct nova_fp_weak fp_weak;
     // struct nova_fp_strong fp_strong;
     u32 weak_idx;
     // u64 strong_idx;
     void *kmem;
-    unsigned long idx;
-    struct nova_hentry *hentry;
-    struct nova_hentry *weak_find_hentry;
+    unsigned long idx, nr, linked = 0;
+    entrynr_t weak_find_entry;
     // struct nova_hentry  *strong_find_hentry;
     u64 blocknr;
 
-    pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
+    nova_drain_entry_reclaim(sb);
 
-    for(idx = 0; idx < sbi->num_entries; ++idx) {
-        pentry = pentries + idx;
+    /* chunks added during the pass are left to the next one */
+    nr = nova_entries_allocated(sbi);
+    for(idx = 0; idx < nr; ++idx) {
         spin_lock(sbi->non_dedup_fp_locks + idx % NON_DEDUP_FP_LOCK_NUM);
-        if(pentry->flag == NON_FIN_FLAG) {
+        if(nova_entry_flag(sbi, idx) == NON_FIN_FLAG) {
             /* The bug here is: 
                 * 1. The block is already referenced by a weak hash table
                 * 2. The block is not referenced by a strong hash table
              */
-            /* The entry is removed by user */
-            if (pentry->refcount == 0) {
-                /* make sure not held by others */
-                nova_free_entry(sb, idx);
+            /* The entry is removed by user, and queued for reclaim by nova_dedup_free_block */
+            if (nova_entry_refcount(sbi, idx) == 0) {
                 spin_unlock(sbi->non_dedup_fp_locks + idx % NON_DEDUP_FP_LOCK_NUM);
                 continue;
             }
-            if(pentry->blocknr != 0 && 
-               pentry->blocknr < sbi->num_blocks && 
-               sbi->blocknr_to_entry[pentry->blocknr] == idx) {
-                blocknr = pentry->blocknr;
+            blocknr = nova_entry_blocknr(sbi, idx);
+            if(blocknr != 0 && 
+               blocknr < sbi->num_blocks && 
+               sbi->blocknr_to_entry[blocknr] == idx) {
                 kmem = nova_get_block(sb, nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K));
-                nova_fp_weak_calc(&sbi->nova_fp_weak_ctx, kmem, &fp_weak);
-                weak_idx = (fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
+                nova_fp_weak_calc(kmem, &fp_weak);
+                weak_idx = (fp_weak.u32 & ((1 << sbi->index_bits) - 1));
 	            spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
-                weak_find_hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], &fp_weak);
-                if (weak_find_hentry) {
+                if (nova_dedup_find_weak(sb, &fp_weak, weak_idx, &weak_find_entry)) {
                     /* non dedup this block now, or we must free the block, if this block is 
                        referenced by file already, things get complex. */
 
-                    /* If weak_find_hentry, we shall not change the corresponding entry even the strong entry is 
+                    /* If weak_find_entry, we shall not change the corresponding entry even the strong entry is 
                        not found. Assume we find the strong entry is missing and inserts the entry into strong hlist. 
                        After that, we observe the sequence below:  
                         1. Block A is referenced by entry EA where EA is an entry with NON_FIN_FLAG
@@ -173,20 +438,22 @@ static int nova_calc_non_fin(struct super_block *sb)
                      */
                 } 
                 else {
-                    pentry->flag = FP_WEAK_FLAG;
-                    pentry->fp_weak = fp_weak;
-                    nova_flush_buffer(pentry, sizeof(*pentry), true);
-                    hentry = nova_alloc_hentry(sb);
-                    hentry->entrynr = idx;
-                    hlist_add_head(&hentry->node, &sbi->weak_hash_table[weak_idx]);
+                    nova_entry_set_flag(sbi, idx, FP_WEAK_FLAG);
+                    *nova_entry_fp_weak(sbi, idx) = fp_weak;
+                    nova_entry_flush(sbi, idx);
+                    nova_link_weak_hentry(sb, idx, &fp_weak, weak_idx);
+                    ++linked;
                 }
 	            spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
                 // sbi->weak_hash_table[weak_idx] = idx;
             }
         }
         spin_unlock(sbi->non_dedup_fp_locks + idx % NON_DEDUP_FP_LOCK_NUM);
+        if((idx + 1) % NOVA_NON_FIN_TRACE_STRIDE == 0)
+            trace_nova_dedup_non_fin(sb, idx + 1, linked, nr);
         schedule();
     }
+    trace_nova_dedup_non_fin(sb, idx, linked, nr);
     return 0;
 }
 /**
@@ -8,6 +8,7 @@ typedef uint64_t entrynr_t;
 #define NON_FIN_FLAG 0xFF
 #define FP_WEAK_FLAG 0xFE
 #define FP_STRONG_FLAG 0xEF
+#define FP_HUGE_FLAG 0xDF   // fp_strong covers a whole 2MB superpage
 
 struct nova_pmm_entry {
     uint64_t tag_TXID;
@@ -22,15 +23,73 @@ struct nova_pmm_entry {
 
 _Static_assert(sizeof(struct nova_pmm_entry) == 64, "Metadata Entry not 64B!");
 
+/*
+ * Compact entry, formatted with dedup_compact: two per cache line. The
+ * block number shares a word with the flag. A refcount that outgrows 32
+ * bits moves to the extension table, see nova_centry_add_ref_ext. The
+ * strong fingerprint is MD5, so its first 16 bytes are all of it.
+ */
+struct nova_pmm_centry {
+    uint64_t blocknr_flag;
+    uint32_t refcount;
+    struct nova_fp_weak fp_weak;
+    uint64_t fp_strong[2];
+};
+
+_Static_assert(sizeof(struct nova_pmm_centry) == 32, "Compact Entry not 32B!");
+_Static_assert(NOVA_FP_STRONG_DIGEST <= sizeof(((struct nova_pmm_centry *)0)->fp_strong),
+    "Strong fingerprint does not fit a compact entry!");
+
+#define NOVA_ENTRY_SHIFT 6
+#define NOVA_CENTRY_SHIFT 5
+#define NOVA_CENTRY_BLOCKNR_BITS 48
+#define NOVA_CENTRY_BLOCKNR_MASK ((1ULL << NOVA_CENTRY_BLOCKNR_BITS) - 1)
+#define NOVA_CENTRY_FLAG_SHIFT 56
+/* refcount of a compact entry whose count is in the extension table */
+#define NOVA_CENTRY_REF_EXT U32_MAX
+/* count of an entry that overflowed a full extension table, never freed */
+#define NOVA_CENTRY_REF_PINNED U64_MAX
+
+struct nova_centry_ext {
+    uint64_t entrynr;       /* + 1, 0 when the slot is free */
+    uint64_t refcount;
+};
+
+#define NOVA_CENTRY_EXT_SLOTS (PAGE_SIZE / sizeof(struct nova_centry_ext))
+
 struct nova_entry_node
 {
     struct list_head link;
     entrynr_t entrynr;
 };
 
-extern entrynr_t nova_alloc_entry(struct super_block *sb);
+/*
+ * The entry table grows a chunk at a time, one data block of entries,
+ * found through a directory of block numbers at metadata_start.
+ */
+#define NOVA_ENTRY_CHUNK_SHIFT(sbi) (PAGE_SHIFT - (sbi)->entry_shift)
+#define NOVA_ENTRY_CHUNK_ENTRIES(sbi) (1UL << NOVA_ENTRY_CHUNK_SHIFT(sbi))
+
+struct nova_entry_chunk {
+    void *entries;                      /* in PMEM */
+    struct nova_entry_node nodes[];
+};
+
+/* Freed entries a CPU queues before returning them to the free list */
+#define NOVA_ENTRY_RECLAIM_BATCH 64
+
+struct nova_entry_reclaim {
+    spinlock_t lock;
+    unsigned int num;
+    entrynr_t entries[NOVA_ENTRY_RECLAIM_BATCH];
+};
+
+extern int nova_alloc_entry(struct super_block *sb, entrynr_t *entrynr);
 extern int nova_init_entry_list(struct super_block *sb);
 extern int nova_free_entry(struct super_block *sb,entrynr_t entry);
+extern void nova_reclaim_entry(struct super_block *sb, entrynr_t entrynr);
+extern unsigned long nova_drain_entry_reclaim(struct super_block *sb);
+extern unsigned long nova_entry_reclaim_pending(struct super_block *sb);
 extern void nova_free_entry_list(struct super_block *sb) ;
 // entrynr_t nova_alloc_free_entry(struct super_block *sb);
 
@@ -613,6 +613,185 @@ static ssize_t nova_dax_file_read(struct file *filp, char __user *buf,
 	return res;
 }
 
+/* Whether the 2MB extent at pos can be deduplicated as a whole */
+static inline bool nova_dedup_huge_extent(struct super_block *sb,
+	struct nova_inode_info_header *sih, loff_t pos, size_t count)
+{
+	return test_opt(sb, DEDUP_HUGE) &&
+		NOVA_SB(sb)->dedup_ctl.pinned_mode != DEDUP_OFF &&
+		sih->i_blk_type == NOVA_BLOCK_TYPE_4K &&
+		(pos & (NOVA_HUGE_SIZE - 1)) == 0 && count >= NOVA_HUGE_SIZE;
+}
+
+/*
+ * A block of a COW write staged ahead of its dedup: merged with the old
+ * head/tail, copied in from user space and fingerprinted. The write loop
+ * stages block i+1 while block i is deduplicated and committed, so the
+ * index lines block i+1 needs are already on their way when its turn comes.
+ */
+struct nova_cow_stage {
+	char *buffer;
+	loff_t pos;		/* -1 when nothing is staged */
+	struct nova_dedup_chunk chunk;
+	struct nova_fp_weak fp_weak;
+	u32 stripe_csums[8];
+};
+
+static int nova_cow_stage_block(struct super_block *sb, struct inode *inode,
+	struct nova_cow_stage *stage, loff_t pos, size_t bytes,
+	const char __user *buf)
+{
+	size_t offset = pos & (sb->s_blocksize - 1);
+	INIT_TIMING(weak_fp_calc_time);
+	int ret;
+
+	stage->pos = -1;
+	if (offset || ((offset + bytes) & (PAGE_SIZE - 1)) != 0) {
+		ret = nova_handle_head_tail_blocks_in_buf(sb, inode, pos,
+						bytes, stage->buffer);
+		if (ret)
+			return ret;
+	}
+	if (copy_from_user(stage->buffer + offset, buf, bytes))
+		return -EFAULT;
+
+	/*
+	 * The buffer holds the whole block after the head/tail merge, so one
+	 * checksum pass yields the stripe csums and the weak fp.
+	 */
+	stage->chunk.data = stage->buffer;
+	stage->chunk.fp_weak = NULL;
+	stage->chunk.fp_strong = NULL;
+	stage->chunk.stripe_csums = NULL;
+	if (data_csum > 0) {
+		stage->fp_weak.u32 = nova_calc_block_stripe_csums(
+					stage->buffer, stage->stripe_csums);
+		stage->chunk.fp_weak = &stage->fp_weak;
+		stage->chunk.stripe_csums = stage->stripe_csums;
+	} else if (nova_dedup_weak_index_active(sb)) {
+		NOVA_START_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+		nova_fp_weak_calc(stage->buffer, &stage->fp_weak);
+		NOVA_END_TIMING(weak_fp_calc_t, weak_fp_calc_time);
+		stage->chunk.fp_weak = &stage->fp_weak;
+	}
+
+	nova_dedup_prefetch_bucket(sb, stage->chunk.fp_weak);
+	stage->pos = pos;
+	return 0;
+}
+
+/*
+ * Whole blocks of a large COW write, copied in and fingerprinted in
+ * parallel ahead of their dedup. The blocks are then taken one at a time,
+ * in file order, through the same dedup and log path as staged blocks.
+ */
+struct nova_cow_window {
+	struct nova_fp_batch *batch;
+	loff_t pos;		/* file offset of block next, -1 when empty */
+	unsigned int next;
+	struct nova_dedup_chunk chunk;
+};
+
+static int nova_cow_fill_window(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_cow_window *win,
+	loff_t pos, size_t count, const char __user *buf)
+{
+	struct nova_fp_batch *batch = win->batch;
+	unsigned int num = 0;
+	int ret;
+
+	win->pos = -1;
+	win->next = 0;
+	/* Stop short of the next extent deduplicated as a whole */
+	while (num < NOVA_FP_BATCH_BLOCKS && count >= PAGE_SIZE) {
+		if (num && nova_dedup_huge_extent(sb, sih, pos, count))
+			break;
+		pos += PAGE_SIZE;
+		count -= PAGE_SIZE;
+		num++;
+	}
+
+	if (copy_from_user(batch->data, buf, (size_t)num << PAGE_SHIFT))
+		return -EFAULT;
+	ret = nova_dedup_fp_batch_calc(sb, batch, num);
+	if (ret)
+		return ret;
+
+	nova_dedup_prefetch_bucket(sb, &batch->fp_weak[0]);
+	win->pos = pos - ((loff_t)num << PAGE_SHIFT);
+	return 0;
+}
+
+/* Take the next window block through dedup */
+static int nova_cow_window_write(struct super_block *sb,
+	struct nova_cow_window *win, unsigned long *blocknr)
+{
+	struct nova_fp_batch *batch = win->batch;
+	unsigned int i = win->next;
+	int allocated;
+
+	win->chunk.data = batch->data + ((size_t)i << PAGE_SHIFT);
+	win->chunk.fp_weak = &batch->fp_weak[i];
+	win->chunk.fp_strong = batch->strong ? &batch->fp_strong[i] : NULL;
+	win->chunk.stripe_csums = batch->csums ? batch->stripe_csums[i] : NULL;
+	if (i + 1 < batch->num)
+		nova_dedup_prefetch_bucket(sb, &batch->fp_weak[i + 1]);
+	nova_dedup_prefetch_entry(sb, win->chunk.fp_weak);
+
+	allocated = nova_dedup_new_write(sb, &win->chunk, blocknr);
+	if (++win->next < batch->num)
+		win->pos += PAGE_SIZE;
+	else
+		win->pos = -1;
+	return allocated;
+}
+
+/* Write entries a COW write collects before appending them to the log */
+#define NOVA_WRITE_ENTRY_BATCH	\
+	(PAGE_SIZE / sizeof(struct nova_file_write_entry))
+
+/*
+ * Append the batched write entries of a COW write. Entries that could not
+ * be logged are kept at the front of the batch and their blocks are still
+ * owned by the caller.
+ */
+static int nova_flush_write_entries(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode,
+	struct nova_file_write_entry *batch, unsigned int *nr,
+	struct nova_inode_update *update, u64 *begin_tail)
+{
+	unsigned int appended = 0;
+	u64 first_entry = 0;
+	int ret;
+
+	if (*nr == 0)
+		return 0;
+
+	ret = nova_append_file_write_entries(sb, pi, inode, batch, *nr,
+					update, &first_entry, &appended);
+	if (appended && *begin_tail == 0)
+		*begin_tail = first_entry;
+
+	*nr -= appended;
+	if (*nr)
+		memmove(batch, batch + appended, *nr * sizeof(*batch));
+	return ret;
+}
+
+/* Drop the blocks of batched write entries that never reached the log */
+static void nova_free_batched_write_blocks(struct super_block *sb,
+	struct nova_inode_info_header *sih,
+	struct nova_file_write_entry *batch, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		nova_free_data_blocks(sb, sih,
+			nova_get_blocknr(sb, le64_to_cpu(batch[i].block),
+					 sih->i_blk_type),
+			le32_to_cpu(batch[i].num_pages));
+}
+
 /*
  * Perform a COW write.   Must hold the inode lock before calling.
  */
@@ -625,7 +804,8 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 	struct nova_inode_info_header *sih = &si->header;
 	struct super_block *sb = inode->i_sb;
 	struct nova_inode *pi, inode_copy;
-	struct nova_file_write_entry entry_data;
+	struct nova_file_write_entry *entry_batch = NULL;
+	unsigned int nr_batch = 0;
 	struct nova_inode_update update;
 	ssize_t	    written = 0;
 	loff_t pos;
@@ -647,15 +827,33 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 	u64 epoch_id;
 	u32 time;
 	char* data_buffer;
-
-	data_buffer = (char *)kmalloc(PAGE_SIZE, GFP_KERNEL);
-
+	struct nova_cow_stage stages[2], *stage;
+	struct nova_cow_window win = { .pos = -1 };
+	unsigned int cur = 0;
+	size_t next_bytes;
+	bool existed;
 
 	if (len == 0)
 		return 0;
 
+	data_buffer = (char *)kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	stages[0].buffer = data_buffer;
+	stages[0].pos = -1;
+	stages[1].buffer = data_buffer + PAGE_SIZE;
+	stages[1].pos = -1;
+
 	NOVA_START_TIMING(do_cow_write_t, cow_write_time);
 
+	entry_batch = kmalloc(NOVA_WRITE_ENTRY_BATCH * sizeof(*entry_batch),
+				GFP_KERNEL);
+	if (!data_buffer || !entry_batch) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	/* Without the window the write is fingerprinted block by block */
+	if (nova_dedup_fp_parallel_wanted(sb, len))
+		win.batch = nova_dedup_fp_batch_alloc(sb);
+
 	if (!access_ok(buf, len)) {
 		ret = -EFAULT;
 		goto out;
@@ -736,21 +934,57 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 
 		// kmem = nova_get_block(inode->i_sb,
 		// 	     nova_get_block_off(sb, blocknr, sih->i_blk_type));
-		
-		if (offset || ((offset + bytes) & (PAGE_SIZE - 1)) != 0)  {
-			ret = nova_handle_head_tail_blocks_in_buf(sb, inode, pos,
-							   bytes, data_buffer);
+
+		allocated = -ENOSPC;
+		existed = false;
+		if (nova_dedup_huge_extent(sb, sih, pos, count)) {
+			allocated = nova_dedup_huge_write(sb, buf, &blocknr,
+							  &existed);
+			if (allocated > 0)
+				bytes = NOVA_HUGE_SIZE;
+		}
+
+		if (allocated <= 0 && win.batch && win.pos != pos &&
+		    offset == 0 && count >= PAGE_SIZE) {
+			ret = nova_cow_fill_window(sb, sih, &win, pos, count,
+						   buf);
 			if (ret)
 				goto out;
 		}
-		/* Now copy from user buf */
-		//		nova_dbg("Write: %p\n", kmem);
-		if( copy_from_user(data_buffer + offset, buf, bytes) ) {
-			ret = -EFAULT;
-			goto out;
-		}
 
-		allocated = nova_dedup_new_write(sb, data_buffer, &blocknr);
+		if (allocated <= 0 && win.pos == pos) {
+			allocated = nova_cow_window_write(sb, &win, &blocknr);
+			existed = win.chunk.existed;
+		} else if (allocated <= 0) {
+			stage = &stages[cur];
+			if (stage->pos != pos) {
+				ret = nova_cow_stage_block(sb, inode, stage,
+							pos, bytes, buf);
+				if (ret)
+					goto out;
+			}
+			nova_dedup_prefetch_entry(sb, stage->chunk.fp_weak);
+
+			/*
+			 * Stage the next block before committing this one. A
+			 * failure is left for its own iteration to report.
+			 */
+			next_bytes = min_t(size_t, count - bytes,
+						sb->s_blocksize);
+			if (win.batch && next_bytes == PAGE_SIZE)
+				next_bytes = 0;	/* goes through the window */
+			if (next_bytes && !nova_dedup_huge_extent(sb, sih,
+						pos + bytes, count - bytes))
+				nova_cow_stage_block(sb, inode, &stages[cur ^ 1],
+						pos + bytes, next_bytes,
+						buf + bytes);
+
+			allocated = nova_dedup_new_write(sb, &stage->chunk,
+							 &blocknr);
+			existed = stage->chunk.existed;
+			stage->pos = -1;
+			cur ^= 1;
+		}
 		copied = bytes;
 		if (allocated < 0) {
 			nova_dbg("%s alloc blocks failed %d\n", __func__,
@@ -767,28 +1001,34 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 		// nova_memlock_range(sb, kmem + offset, bytes);
 		// NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
 
-		if (data_csum > 0 || data_parity > 0) {
-			ret = nova_protect_file_data(sb, inode, pos, bytes,
-							buf, blocknr, false);
-			if (ret)
-				goto out;
-		}
+		/*
+		 * The dedup path protects a new block before it is indexed,
+		 * and a shared block carries valid checksums and parity, so
+		 * there is nothing left to write here.
+		 */
+		if (existed && (data_csum > 0 || data_parity > 0))
+			NOVA_STATS_ADD(dedup_protect_skip, 1);
 
 		if (pos + copied > inode->i_size)
 			file_size = cpu_to_le64(pos + copied);
 		else
 			file_size = cpu_to_le64(inode->i_size);
 
-		nova_init_file_write_entry(sb, sih, &entry_data, epoch_id,
-					start_blk, 1, blocknr, time,
-					file_size);
-
-		ret = nova_append_file_write_entry(sb, pi, inode,
-					&entry_data, &update);
-		if (ret) {
-			nova_dbg("%s: append inode entry failed\n", __func__);
-			ret = -ENOSPC;
-			goto out;
+		/* From here on the blocks belong to the batched entry */
+		nova_init_file_write_entry(sb, sih, &entry_batch[nr_batch++],
+					epoch_id, start_blk, allocated, blocknr,
+					time, file_size);
+
+		if (nr_batch == NOVA_WRITE_ENTRY_BATCH) {
+			ret = nova_flush_write_entries(sb, pi, inode,
+					entry_batch, &nr_batch, &update,
+					&begin_tail);
+			if (ret) {
+				nova_dbg("%s: append inode entry failed\n",
+					 __func__);
+				ret = -ENOSPC;
+				goto out;
+			}
 		}
 
 		nova_dbgv("Write: %p, %lu\n", data_buffer, copied);
@@ -808,9 +1048,14 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 		}
 		if (status < 0)
 			break;
+	}
 
-		if (begin_tail == 0)
-			begin_tail = update.curr_entry;
+	ret = nova_flush_write_entries(sb, pi, inode, entry_batch, &nr_batch,
+					&update, &begin_tail);
+	if (ret) {
+		nova_dbg("%s: append inode entry failed\n", __func__);
+		ret = -ENOSPC;
+		goto out;
 	}
 
 	data_bits = blk_type_to_shift[sih->i_blk_type];
@@ -841,9 +1086,14 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 out:
 	if(data_buffer)
 		kfree(data_buffer);
-	if (ret < 0)
-		nova_cleanup_incomplete_write(sb, sih, blocknr, allocated,
+	if (ret < 0) {
+		/* A failed append leaves the last blocks in the batch */
+		nova_free_batched_write_blocks(sb, sih, entry_batch, nr_batch);
+		nova_cleanup_incomplete_write(sb, sih, 0, 0,
 						begin_tail, update.tail);
+	}
+	kfree(entry_batch);
+	nova_dedup_fp_batch_free(win.batch);
 
 	NOVA_END_TIMING(do_cow_write_t, cow_write_time);
 	NOVA_STATS_ADD(cow_write_bytes, written);
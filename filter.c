@@ -0,0 +1,143 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Membership filter for the NV-Dedup weak fingerprint table
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/hash.h>
+#include <linux/prefetch.h>
+#include <linux/vmalloc.h>
+#include "filter.h"
+
+#define NOVA_FILTER_WORDS_PER_BLOCK	(NOVA_FILTER_BLOCK_SIZE / sizeof(u32))
+#define NOVA_FILTER_COUNTERS_PER_WORD	(32 / NOVA_FILTER_COUNTER_BITS)
+
+static inline u32 *nova_filter_block(struct nova_filter *filter, u32 fp)
+{
+	return filter->words +
+		hash_64(fp, filter->block_bits) * NOVA_FILTER_WORDS_PER_BLOCK;
+}
+
+/* Probe positions are taken from a hash independent of the block choice */
+static inline u32 nova_filter_probes(u32 fp)
+{
+	return hash_32(fp, NOVA_FILTER_PROBES * NOVA_FILTER_PROBE_BITS);
+}
+
+static inline void nova_filter_locate(u32 *block, u32 probes, int i,
+	u32 **word, unsigned int *shift)
+{
+	unsigned int pos;
+
+	pos = (probes >> (i * NOVA_FILTER_PROBE_BITS)) &
+		(NOVA_FILTER_COUNTERS_PER_BLOCK - 1);
+	*word = block + pos / NOVA_FILTER_COUNTERS_PER_WORD;
+	*shift = (pos % NOVA_FILTER_COUNTERS_PER_WORD) *
+		NOVA_FILTER_COUNTER_BITS;
+}
+
+static void nova_filter_update(u32 *word, unsigned int shift, int delta)
+{
+	u32 old, new, val;
+
+	do {
+		old = READ_ONCE(*word);
+		val = (old >> shift) & NOVA_FILTER_COUNTER_MAX;
+		/* Saturated counters are sticky, empty ones have nothing to drop */
+		if (val == NOVA_FILTER_COUNTER_MAX || (delta < 0 && val == 0))
+			return;
+		new = (old & ~(NOVA_FILTER_COUNTER_MAX << shift)) |
+			((val + delta) << shift);
+	} while (cmpxchg(word, old, new) != old);
+}
+
+int nova_filter_init(struct nova_filter *filter, unsigned int entries_bits)
+{
+	int block_bits;
+	size_t size;
+
+	block_bits = entries_bits + NOVA_FILTER_ENTRY_SHIFT -
+			NOVA_FILTER_PROBE_BITS;
+	if (block_bits < 1)
+		block_bits = 1;
+
+	size = (size_t)NOVA_FILTER_BLOCK_SIZE << block_bits;
+	filter->words = vzalloc(size);
+	if (!filter->words)
+		return -ENOMEM;
+
+	filter->block_bits = block_bits;
+	return 0;
+}
+
+void nova_filter_free(struct nova_filter *filter)
+{
+	vfree(filter->words);
+	filter->words = NULL;
+}
+
+void nova_filter_add(struct nova_filter *filter,
+	const struct nova_fp_weak *fp_weak)
+{
+	u32 *block = nova_filter_block(filter, fp_weak->u32);
+	u32 probes = nova_filter_probes(fp_weak->u32);
+	unsigned int shift;
+	u32 *word;
+	int i;
+
+	for (i = 0; i < NOVA_FILTER_PROBES; i++) {
+		nova_filter_locate(block, probes, i, &word, &shift);
+		nova_filter_update(word, shift, 1);
+	}
+}
+
+void nova_filter_del(struct nova_filter *filter,
+	const struct nova_fp_weak *fp_weak)
+{
+	u32 *block = nova_filter_block(filter, fp_weak->u32);
+	u32 probes = nova_filter_probes(fp_weak->u32);
+	unsigned int shift;
+	u32 *word;
+	int i;
+
+	for (i = 0; i < NOVA_FILTER_PROBES; i++) {
+		nova_filter_locate(block, probes, i, &word, &shift);
+		nova_filter_update(word, shift, -1);
+	}
+}
+
+/* Start loading the filter block of fp_weak ahead of a lookup */
+void nova_filter_prefetch(struct nova_filter *filter,
+	const struct nova_fp_weak *fp_weak)
+{
+	prefetch(nova_filter_block(filter, fp_weak->u32));
+}
+
+/*
+ * Lock-free.  A false return means the fingerprint is not in the weak
+ * table, unless an insert is racing with us, in which case the caller
+ * only loses a dedup opportunity.
+ */
+bool nova_filter_may_contain(struct nova_filter *filter,
+	const struct nova_fp_weak *fp_weak)
+{
+	u32 *block = nova_filter_block(filter, fp_weak->u32);
+	u32 probes = nova_filter_probes(fp_weak->u32);
+	unsigned int shift;
+	u32 *word;
+	int i;
+
+	for (i = 0; i < NOVA_FILTER_PROBES; i++) {
+		nova_filter_locate(block, probes, i, &word, &shift);
+		if (((READ_ONCE(*word) >> shift) & NOVA_FILTER_COUNTER_MAX) == 0)
+			return false;
+	}
+
+	return true;
+}
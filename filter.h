@@ -0,0 +1,43 @@
+#ifndef __NOVA_FILTER_H
+#define __NOVA_FILTER_H
+
+#include <linux/types.h>
+#include "fingerprint.h"
+
+/*
+ * Counting blocked Bloom filter in front of the weak fingerprint table.
+ *
+ * Every weak fingerprint selects one 64B block (one cache line) and
+ * NOVA_FILTER_PROBES 4-bit counters inside it, so a lookup costs a single
+ * cache miss and no lock.  Counters are updated with cmpxchg on the
+ * containing word; a counter that reaches its maximum sticks there, which
+ * keeps deletes safe at the cost of a stale positive.
+ */
+#define NOVA_FILTER_BLOCK_SHIFT		6
+#define NOVA_FILTER_BLOCK_SIZE		(1 << NOVA_FILTER_BLOCK_SHIFT)
+#define NOVA_FILTER_COUNTER_BITS	4
+#define NOVA_FILTER_COUNTER_MAX		((1U << NOVA_FILTER_COUNTER_BITS) - 1)
+#define NOVA_FILTER_COUNTERS_PER_BLOCK	\
+	(NOVA_FILTER_BLOCK_SIZE * 8 / NOVA_FILTER_COUNTER_BITS)
+#define NOVA_FILTER_PROBE_BITS		7	/* log2(counters per block) */
+#define NOVA_FILTER_PROBES		4
+/* Counters per indexed entry, as a shift: 8 counters, 4 bytes */
+#define NOVA_FILTER_ENTRY_SHIFT		3
+
+struct nova_filter {
+	u32 *words;
+	unsigned int block_bits;
+};
+
+int nova_filter_init(struct nova_filter *filter, unsigned int entries_bits);
+void nova_filter_free(struct nova_filter *filter);
+void nova_filter_add(struct nova_filter *filter,
+	const struct nova_fp_weak *fp_weak);
+void nova_filter_del(struct nova_filter *filter,
+	const struct nova_fp_weak *fp_weak);
+bool nova_filter_may_contain(struct nova_filter *filter,
+	const struct nova_fp_weak *fp_weak);
+void nova_filter_prefetch(struct nova_filter *filter,
+	const struct nova_fp_weak *fp_weak);
+
+#endif
@@ -7,6 +7,8 @@
 #include "stats.h"
 
 #define NOVA_FP_STRONG_CTX_BUF_SIZE 256
+/* Bytes of fp_strong the md5 digest fills, the rest stays zero */
+#define NOVA_FP_STRONG_DIGEST 16
 
 struct nova_fp_hash_ctx {
 	struct crypto_shash *alg;
@@ -40,23 +42,11 @@ static inline int nova_fp_strong_ctx_init(struct nova_fp_hash_ctx *ctx) {
 	return 0;
 }
 
-static inline int nova_fp_weak_ctx_init(struct nova_fp_hash_ctx *ctx) {
-	struct crypto_shash *alg = crypto_alloc_shash("crc32", 0, 0);
-	if (IS_ERR(alg))
-		return PTR_ERR(alg);
-	if (crypto_shash_descsize(alg) > NOVA_FP_STRONG_CTX_BUF_SIZE) {
-		crypto_free_shash(alg);
-		return -EINVAL;
-	}
-	ctx->alg = alg;
-	return 0;
-}
-
 static inline void nova_fp_hash_ctx_free(struct nova_fp_hash_ctx *ctx) {
 	crypto_free_shash(ctx->alg);
 }
 
-static inline int nova_fp_strong_calc(struct nova_fp_hash_ctx *fp_ctx, const void *addr, struct nova_fp_strong *fp)
+static inline int nova_fp_strong_calc_len(struct nova_fp_hash_ctx *fp_ctx, const void *addr, unsigned int len, struct nova_fp_strong *fp)
 {
 	struct shash_desc *shash_desc;
 	int ret;
@@ -66,26 +56,15 @@ static inline int nova_fp_strong_calc(struct nova_fp_hash_ctx *fp_ctx, const voi
 	if (shash_desc == NULL)
 		return -ENOMEM;
 	shash_desc->tfm = fp_ctx->alg;
-	ret = crypto_shash_digest(shash_desc, (const void*)addr, 4096, (void*)fp->u64s);
+	ret = crypto_shash_digest(shash_desc, (const void*)addr, len, (void*)fp->u64s);
 	kfree(shash_desc);
 
 	return ret;
 }
 
-static inline int nova_fp_weak_calc(struct nova_fp_hash_ctx *fp_ctx, const void *addr, struct nova_fp_weak *fp)
+static inline int nova_fp_strong_calc(struct nova_fp_hash_ctx *fp_ctx, const void *addr, struct nova_fp_strong *fp)
 {
-	struct shash_desc *shash_desc;
-	int ret;
-
-	shash_desc = kmalloc(sizeof(struct shash_desc) +
-		crypto_shash_descsize(fp_ctx->alg), GFP_ATOMIC);
-	if (shash_desc == NULL)
-		return -ENOMEM;
-	shash_desc->tfm = fp_ctx->alg;
-	ret = crypto_shash_digest(shash_desc, (const void*)addr, 4096, (void*)&fp->u32);
-	kfree(shash_desc);
-
-	return ret;
+	return nova_fp_strong_calc_len(fp_ctx, addr, 4096, fp);
 }
 
 #endif // FINGERPRINT_H_
\ No newline at end of file
@@ -0,0 +1,129 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * DRAM cache of hot NV-Dedup strong fingerprints
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/vmalloc.h>
+#include "fpcache.h"
+
+static inline struct nova_fp_cache_set *
+nova_fp_cache_get_set(struct nova_fp_cache *cache,
+	const struct nova_fp_strong *fp)
+{
+	/* u64s[0] picks the strong table bucket, use other bits here */
+	return cache->sets + (fp->u64s[1] & (NOVA_FP_CACHE_SETS - 1));
+}
+
+static inline bool nova_fp_cache_match(const struct nova_fp_cache_way *way,
+	const struct nova_fp_strong *fp)
+{
+	return way->valid &&
+		way->fp.u64s[0] == fp->u64s[0] &&
+		way->fp.u64s[1] == fp->u64s[1] &&
+		way->fp.u64s[2] == fp->u64s[2] &&
+		way->fp.u64s[3] == fp->u64s[3];
+}
+
+int nova_fp_cache_init(struct nova_fp_cache *cache)
+{
+	int i;
+
+	cache->sets = vzalloc(sizeof(struct nova_fp_cache_set) *
+				NOVA_FP_CACHE_SETS);
+	if (!cache->sets)
+		return -ENOMEM;
+
+	for (i = 0; i < NOVA_FP_CACHE_SETS; i++)
+		spin_lock_init(&cache->sets[i].lock);
+
+	return 0;
+}
+
+void nova_fp_cache_free(struct nova_fp_cache *cache)
+{
+	vfree(cache->sets);
+	cache->sets = NULL;
+}
+
+bool nova_fp_cache_lookup(struct nova_fp_cache *cache,
+	const struct nova_fp_strong *fp, u64 *entrynr, unsigned long *blocknr)
+{
+	struct nova_fp_cache_set *set = nova_fp_cache_get_set(cache, fp);
+	struct nova_fp_cache_way *way;
+	bool found = false;
+	int i;
+
+	spin_lock(&set->lock);
+	for (i = 0; i < NOVA_FP_CACHE_WAYS; i++) {
+		way = &set->ways[i];
+		if (nova_fp_cache_match(way, fp)) {
+			way->referenced = 1;
+			*entrynr = way->entrynr;
+			*blocknr = way->blocknr;
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&set->lock);
+
+	return found;
+}
+
+void nova_fp_cache_insert(struct nova_fp_cache *cache,
+	const struct nova_fp_strong *fp, u64 entrynr, unsigned long blocknr)
+{
+	struct nova_fp_cache_set *set = nova_fp_cache_get_set(cache, fp);
+	struct nova_fp_cache_way *way = NULL;
+	int i;
+
+	spin_lock(&set->lock);
+	for (i = 0; i < NOVA_FP_CACHE_WAYS; i++) {
+		if (nova_fp_cache_match(&set->ways[i], fp) ||
+				!set->ways[i].valid) {
+			way = &set->ways[i];
+			break;
+		}
+	}
+
+	/* CLOCK: give referenced ways a second chance */
+	while (!way) {
+		way = &set->ways[set->hand];
+		set->hand = (set->hand + 1) % NOVA_FP_CACHE_WAYS;
+		if (way->referenced) {
+			way->referenced = 0;
+			way = NULL;
+		}
+	}
+
+	way->fp = *fp;
+	way->entrynr = entrynr;
+	way->blocknr = blocknr;
+	way->referenced = 1;
+	way->valid = 1;
+	spin_unlock(&set->lock);
+}
+
+void nova_fp_cache_invalidate(struct nova_fp_cache *cache,
+	const struct nova_fp_strong *fp, u64 entrynr)
+{
+	struct nova_fp_cache_set *set = nova_fp_cache_get_set(cache, fp);
+	struct nova_fp_cache_way *way;
+	int i;
+
+	spin_lock(&set->lock);
+	for (i = 0; i < NOVA_FP_CACHE_WAYS; i++) {
+		way = &set->ways[i];
+		if (nova_fp_cache_match(way, fp) && way->entrynr == entrynr) {
+			way->valid = 0;
+			way->referenced = 0;
+		}
+	}
+	spin_unlock(&set->lock);
+}
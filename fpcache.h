@@ -0,0 +1,49 @@
+#ifndef __NOVA_FPCACHE_H
+#define __NOVA_FPCACHE_H
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include "fingerprint.h"
+
+/*
+ * DRAM cache of hot strong fingerprints.
+ *
+ * Set-associative with CLOCK replacement inside each set.  A cached
+ * fingerprint resolves directly to its metadata entry and block, so hits
+ * skip the strong chain walk and the PMEM fingerprint compare.  Callers
+ * hold the strong hash stripe lock of the fingerprint for every operation;
+ * since nova_free_data_blocks invalidates under the same lock, a cached
+ * mapping is live whenever it is found.
+ */
+#define NOVA_FP_CACHE_SET_BITS	10
+#define NOVA_FP_CACHE_SETS	(1 << NOVA_FP_CACHE_SET_BITS)
+#define NOVA_FP_CACHE_WAYS	4
+
+struct nova_fp_cache_way {
+	struct nova_fp_strong fp;
+	u64 entrynr;
+	unsigned long blocknr;
+	u32 valid;
+	u32 referenced;
+};
+
+struct nova_fp_cache_set {
+	spinlock_t lock;
+	unsigned int hand;
+	struct nova_fp_cache_way ways[NOVA_FP_CACHE_WAYS];
+};
+
+struct nova_fp_cache {
+	struct nova_fp_cache_set *sets;
+};
+
+int nova_fp_cache_init(struct nova_fp_cache *cache);
+void nova_fp_cache_free(struct nova_fp_cache *cache);
+bool nova_fp_cache_lookup(struct nova_fp_cache *cache,
+	const struct nova_fp_strong *fp, u64 *entrynr, unsigned long *blocknr);
+void nova_fp_cache_insert(struct nova_fp_cache *cache,
+	const struct nova_fp_strong *fp, u64 entrynr, unsigned long blocknr);
+void nova_fp_cache_invalidate(struct nova_fp_cache *cache,
+	const struct nova_fp_strong *fp, u64 entrynr);
+
+#endif
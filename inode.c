@@ -305,7 +305,7 @@ int nova_delete_file_tree(struct super_block *sb,
 					nova_free_old_entry(sb, sih,
 							old_entry, old_pgoff,
 							num_free, delete_dead,
-							epoch_id);
+							epoch_id, NULL);
 					freed += num_free;
 				}
 
@@ -334,7 +334,7 @@ int nova_delete_file_tree(struct super_block *sb,
 
 	if (old_entry && delete_nvmm) {
 		nova_free_old_entry(sb, sih, old_entry, old_pgoff,
-					num_free, delete_dead, epoch_id);
+					num_free, delete_dead, epoch_id, NULL);
 		freed += num_free;
 	}
 
@@ -125,11 +125,15 @@ static inline int nova_invalidate_write_entry(struct super_block *sb,
 							reassign, num_free);
 }
 
+/*
+ * With a batch, 4K data blocks are queued there instead of being freed
+ * right away; the caller flushes the batch.
+ */
 unsigned int nova_free_old_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih,
 	struct nova_file_write_entry *entry,
 	unsigned long pgoff, unsigned int num_free,
-	bool delete_dead, u64 epoch_id)
+	bool delete_dead, u64 epoch_id, struct nova_free_batch *batch)
 {
 	struct nova_file_write_entry *entryc, entry_copy;
 	unsigned long old_nvmm;
@@ -164,7 +168,9 @@ unsigned int nova_free_old_entry(struct super_block *sb,
 
 	nova_dbgv("%s: pgoff %lu, free %u blocks\n",
 				__func__, pgoff, num_free);
-	nova_free_data_blocks(sb, sih, old_nvmm, num_free);
+	if (!batch || sih->i_blk_type != NOVA_BLOCK_TYPE_4K ||
+	    nova_free_batch_add(sb, batch, old_nvmm, num_free))
+		nova_free_data_blocks(sb, sih, old_nvmm, num_free);
 
 out:
 	sih->i_blocks -= num_free;
@@ -785,65 +791,80 @@ out:
 	return ret;
 }
 
+/*
+ * Map the pages of entry in sih->tree. Pages already mapped are replaced
+ * in one ordered walk of the tree, the holes left are inserted afterwards.
+ * If free is set, the blocks of the replaced entries are released, through
+ * batch when one is given.
+ */
 int nova_assign_write_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih,
 	struct nova_file_write_entry *entry,
 	struct nova_file_write_entry *entryc,
-	bool free)
+	bool free, struct nova_free_batch *batch)
 {
 	struct nova_file_write_entry *old_entry;
 	struct nova_file_write_entry *start_old_entry = NULL;
+	struct radix_tree_iter iter;
 	void **pentry;
 	unsigned long start_pgoff = entryc->pgoff;
 	unsigned long start_old_pgoff = 0;
 	unsigned int num = entryc->num_pages;
 	unsigned int num_free = 0;
+	unsigned int mapped = 0;
 	unsigned long curr_pgoff;
-	int i;
 	int ret = 0;
 	INIT_TIMING(assign_time);
 
 	NOVA_START_TIMING(assign_t, assign_time);
-	for (i = 0; i < num; i++) {
-		curr_pgoff = start_pgoff + i;
-
-		pentry = radix_tree_lookup_slot(&sih->tree, curr_pgoff);
-		if (pentry) {
-			old_entry = radix_tree_deref_slot(pentry);
-			if (old_entry != start_old_entry) {
-				if (start_old_entry && free)
-					nova_free_old_entry(sb, sih,
-							start_old_entry,
-							start_old_pgoff,
-							num_free, false,
-							entryc->epoch_id);
-				nova_invalidate_write_entry(sb,
-						start_old_entry, 1, 0);
-
-				start_old_entry = old_entry;
-				start_old_pgoff = curr_pgoff;
-				num_free = 1;
-			} else {
-				num_free++;
-			}
+	radix_tree_for_each_slot(pentry, &sih->tree, &iter, start_pgoff) {
+		curr_pgoff = iter.index;
+		if (curr_pgoff >= start_pgoff + num)
+			break;
 
-			radix_tree_replace_slot(&sih->tree, pentry, entry);
+		old_entry = radix_tree_deref_slot(pentry);
+		if (old_entry != start_old_entry ||
+		    curr_pgoff != start_old_pgoff + num_free) {
+			if (start_old_entry && free)
+				nova_free_old_entry(sb, sih, start_old_entry,
+						start_old_pgoff, num_free,
+						false, entryc->epoch_id,
+						batch);
+			nova_invalidate_write_entry(sb, start_old_entry, 1, 0);
+
+			start_old_entry = old_entry;
+			start_old_pgoff = curr_pgoff;
+			num_free = 1;
 		} else {
-			ret = radix_tree_insert(&sih->tree, curr_pgoff, entry);
-			if (ret) {
-				nova_dbg("%s: ERROR %d\n", __func__, ret);
-				goto out;
-			}
+			num_free++;
 		}
+
+		/* Same-size replace, the walk is not disturbed */
+		radix_tree_replace_slot(&sih->tree, pentry, entry);
+		mapped++;
 	}
 
 	if (start_old_entry && free)
 		nova_free_old_entry(sb, sih, start_old_entry,
 					start_old_pgoff, num_free, false,
-					entryc->epoch_id);
+					entryc->epoch_id, batch);
 
 	nova_invalidate_write_entry(sb, start_old_entry, 1, 0);
 
+	for (curr_pgoff = start_pgoff;
+	     mapped < num && curr_pgoff < start_pgoff + num; curr_pgoff++) {
+		ret = radix_tree_insert(&sih->tree, curr_pgoff, entry);
+		if (ret == -EEXIST) {
+			ret = 0;
+			continue;
+		}
+		if (ret) {
+			nova_dbg("%s: ERROR %d\n", __func__, ret);
+			goto out;
+		}
+		mapped++;
+	}
+
 out:
 	NOVA_END_TIMING(assign_t, assign_time);
 
@@ -905,6 +926,111 @@ int nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 	return ret;
 }
 
+/*
+ * Copy up to num write entries into the log page at tail with one streaming
+ * store, stopping at the end of the page. Returns the number of entries
+ * copied, 0 if the log cannot be extended.
+ */
+static unsigned int nova_append_write_entry_run(struct super_block *sb,
+	struct nova_inode *pi, struct nova_inode_info_header *sih,
+	struct nova_file_write_entry *data, unsigned int num, u64 tail,
+	int log_id, u64 *curr_p)
+{
+	size_t size = sizeof(struct nova_file_write_entry);
+	unsigned int fit;
+	void *entry;
+	int extended = 0;
+	u64 p;
+
+	p = nova_get_append_head(sb, pi, sih, tail, size, log_id, 0,
+					&extended);
+	if (p == 0)
+		return 0;
+
+	fit = (LOG_BLOCK_TAIL - ENTRY_LOC(p)) / size;
+	if (fit > num)
+		fit = num;
+
+	entry = nova_get_block(sb, p);
+	nova_memunlock_range(sb, entry, size * fit);
+	memcpy_to_pmem_nocache(entry, data, size * fit);
+	if (log_id == MAIN_LOG)
+		nova_add_page_num_entries(sb, p, fit);
+	nova_memlock_range(sb, entry, size * fit);
+
+	*curr_p = p;
+	return fit;
+}
+
+/*
+ * Append num nova_file_write_entry records in one go. Each run of entries
+ * that fits in the current log page costs one copy and one page tail
+ * update; nova_get_append_head moves to the next page and extends the log
+ * when needed. The alter log gets the same entries run by run.
+ * Like nova_append_file_write_entry, this does not update pi->log_tail.
+ * *first_entry receives the position of the first entry and *appended the
+ * number of entries in the main log, which is less than num only on
+ * -ENOSPC.
+ */
+int nova_append_file_write_entries(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode,
+	struct nova_file_write_entry *data, unsigned int num,
+	struct nova_inode_update *update, u64 *first_entry,
+	unsigned int *appended)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	size_t size = sizeof(struct nova_file_write_entry);
+	unsigned int i, j, run, alter_run;
+	u64 curr_p, alter_curr_p;
+	int ret = 0;
+	INIT_TIMING(append_time);
+
+	NOVA_START_TIMING(append_file_entry_t, append_time);
+
+	for (i = 0; i < num; i++)
+		nova_update_entry_csum(data + i);
+
+	for (i = 0; i < num; i += run) {
+		run = nova_append_write_entry_run(sb, pi, sih, data + i,
+					num - i, update->tail, MAIN_LOG, &curr_p);
+		if (run == 0) {
+			ret = -ENOSPC;
+			break;
+		}
+
+		if (i == 0)
+			*first_entry = curr_p;
+		update->curr_entry = curr_p + (run - 1) * size;
+		update->tail = curr_p + run * size;
+
+		for (j = 0; metadata_csum && j < run; j += alter_run) {
+			alter_run = nova_append_write_entry_run(sb, pi, sih,
+					data + i + j, run - j,
+					update->alter_tail, ALTER_LOG,
+					&alter_curr_p);
+			if (alter_run == 0) {
+				i += run;
+				ret = -ENOSPC;
+				goto out;
+			}
+
+			update->alter_entry = alter_curr_p +
+						(alter_run - 1) * size;
+			update->alter_tail = alter_curr_p + alter_run * size;
+		}
+	}
+
+out:
+	*appended = i;
+	if (ret)
+		nova_err(sb, "%s failed after %u of %u entries\n",
+			 __func__, i, num);
+
+	NOVA_END_TIMING(append_file_entry_t, append_time);
+	return ret;
+}
+
 int nova_append_mmap_entry(struct super_block *sb, struct nova_inode *pi,
 	struct inode *inode, struct nova_mmap_entry *data,
 	struct nova_inode_update *update, struct vma_item *item)
@@ -276,7 +276,7 @@ unsigned int nova_free_old_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih,
 	struct nova_file_write_entry *entry,
 	unsigned long pgoff, unsigned int num_free,
-	bool delete_dead, u64 epoch_id);
+	bool delete_dead, u64 epoch_id, struct nova_free_batch *batch);
 int nova_free_inode_log(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih);
 int nova_update_alter_pages(struct super_block *sb, struct nova_inode *pi,
@@ -310,6 +310,11 @@ int nova_append_mmap_entry(struct super_block *sb, struct nova_inode *pi,
 int nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 	struct inode *inode, struct nova_file_write_entry *data,
 	struct nova_inode_update *update);
+int nova_append_file_write_entries(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode,
+	struct nova_file_write_entry *data, unsigned int num,
+	struct nova_inode_update *update, u64 *first_entry,
+	unsigned int *appended);
 int nova_append_snapshot_info_entry(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info *si,
 	struct snapshot_info *info, struct nova_snapshot_info_entry *data,
@@ -317,7 +322,8 @@ int nova_append_snapshot_info_entry(struct super_block *sb,
 int nova_assign_write_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih,
 	struct nova_file_write_entry *entry,
-	struct nova_file_write_entry *entryc, bool free);
+	struct nova_file_write_entry *entryc, bool free,
+	struct nova_free_batch *batch);
 
 
 void nova_print_curr_log_page(struct super_block *sb, u64 curr);
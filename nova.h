@@ -54,13 +54,24 @@
 #define PAGE_SHIFT_2M 21
 #define PAGE_SHIFT_1G 30
 
+/* Defaults of the dedup mode controller, tunable in /proc/fs/NOVA/<dev>/dedup_tunables */
 #define SAMPLE_BLOCK 64
-#define NON_FIN_THRESH (unsigned int)((SAMPLE_BLOCK) * 0.25)
-#define STR_FIN_THRESH (unsigned int)((SAMPLE_BLOCK) * 0.65)
+#define NON_FIN_THRESH 25	/* percent of duplicate blocks in a sample */
+#define STR_FIN_THRESH 65
+#define DEDUP_HYSTERESIS 10	/* percent a mode must be cheaper to switch to it */
+#define DEDUP_PROBE_INTERVAL 16	/* NON_FIN samples between two probing samples */
+#define DEDUP_PARALLEL_FP_KB 0	/* write size to fingerprint in parallel, 0 off */
+
+/* Per-block costs in ns assumed until the timers have samples */
+#define DEDUP_WEAK_FP_COST 400
+#define DEDUP_STRONG_FP_COST 4000
+#define DEDUP_HASH_TABLE_COST 200
+#define DEDUP_WRITE_COST 1500
 
 #define NON_FIN 0x00000001
 #define WEAK_STR_FIN 0x00000002
 #define STR_FIN 0x00000004
+#define DEDUP_OFF 0x00000008
 
 /*
  * Debug code
@@ -749,19 +760,25 @@ static inline void nova_set_page_invalid_entries(struct super_block *sb,
 				sizeof(struct nova_inode_page_tail), 0);
 }
 
-static inline void nova_inc_page_num_entries(struct super_block *sb,
-	u64 curr)
+static inline void nova_add_page_num_entries(struct super_block *sb,
+	u64 curr, unsigned int num)
 {
 	struct nova_inode_log_page *curr_page;
 
 	curr = BLOCK_OFF(curr);
 	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr);
 
-	curr_page->page_tail.num_entries++;
+	curr_page->page_tail.num_entries += num;
 	nova_flush_buffer(&curr_page->page_tail,
 				sizeof(struct nova_inode_page_tail), 0);
 }
 
+static inline void nova_inc_page_num_entries(struct super_block *sb,
+	u64 curr)
+{
+	nova_add_page_num_entries(sb, curr, 1);
+}
+
 u64 nova_print_log_entry(struct super_block *sb, u64 curr);
 
 static inline void nova_inc_page_invalid_entries(struct super_block *sb,
@@ -1088,6 +1105,9 @@ int nova_update_pgoff_parity(struct super_block *sb,
 int nova_update_block_csum_parity(struct super_block *sb,
 	struct nova_inode_info_header *sih, u8 *block, unsigned long blocknr,
 	size_t offset, size_t bytes);
+u32 nova_calc_block_stripe_csums(const u8 *block, u32 *crc);
+int nova_update_block_csum_parity_precomputed(struct super_block *sb,
+	const u8 *block, unsigned long blocknr, const u32 *crc);
 int nova_restore_data(struct super_block *sb, unsigned long blocknr,
 	unsigned int badstrip_id, void *badstrip, int nvmmerr, u32 csum0,
 	u32 csum1, u32 *csum_good);
@@ -1146,8 +1166,15 @@ void nova_sysfs_exit(struct super_block *sb);
 /* nova_stats.c */
 void nova_get_timing_stats(void);
 void nova_get_IO_stats(void);
+u64 nova_sum_timing_stat(int name, u64 *count);
+u64 nova_sum_IO_stat(int name);
 void nova_print_timing_stats(struct super_block *sb);
 void nova_clear_stats(struct super_block *sb);
+int nova_lat_hist_init(void);
+void nova_lat_hist_exit(void);
+void nova_lat_hist_clear(void);
+u64 nova_lat_hist_quantiles(int name, u64 *hist, const u32 *quantile,
+	u64 *lat, int num, u64 *max);
 void nova_print_inode(struct nova_inode *pi);
 void nova_print_inode_log(struct super_block *sb, struct inode *inode);
 void nova_print_inode_log_pages(struct super_block *sb, struct inode *inode);
@@ -1155,7 +1182,16 @@ int nova_check_inode_logs(struct super_block *sb, struct nova_inode *pi);
 void nova_print_free_lists(struct super_block *sb);
 
 /* perf.c */
-int nova_test_perf(struct super_block *sb, unsigned int func_id,
-	unsigned int poolmb, size_t size, unsigned int disks);
+struct nova_perf_params {
+	unsigned int func_id;
+	unsigned int poolmb;
+	size_t size;
+	unsigned int disks;
+	unsigned int threads;	/* CPUs running the call at once */
+	unsigned int fill;	/* index fill factor, percent of buckets */
+	unsigned int dup;	/* percent of duplicate keys or blocks */
+};
+
+int nova_test_perf(struct super_block *sb, struct nova_perf_params *params);
 
 #endif /* __NOVA_H */
@@ -43,6 +43,10 @@
 #define NOVA_MOUNT_HUGEIOREMAP  0x000100    /* Huge mappings with ioremap */
 #define NOVA_MOUNT_FORMAT       0x000200    /* was FS formatted on mount? */
 #define NOVA_MOUNT_DATA_COW     0x000400    /* Copy-on-write for data integrity */
+#define NOVA_MOUNT_DEDUP_VERIFY 0x000800    /* Confirm weak fp hits by compare */
+#define NOVA_MOUNT_DEDUP_HUGE   0x001000    /* Dedup 2MB extents as a whole */
+#define NOVA_MOUNT_DEDUP_PINDEX 0x002000    /* Fingerprint index in PMEM */
+#define NOVA_MOUNT_DEDUP_COMPACT 0x004000   /* 32B dedup entries */
 
 /*
  * Maximal count of links to a file
@@ -0,0 +1,190 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Tracepoints of the NV-Dedup engine
+ *
+ * Mode switches, index lookups, entry allocation and refcount changes and
+ * the progress of the calc_non_fin thread, for perf and bpftrace on live
+ * systems. A disabled tracepoint costs a patched-out branch.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nova
+
+#if !defined(_TRACE_NOVA_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_NOVA_H
+
+#include <linux/tracepoint.h>
+#include "dedup.h"
+
+#define show_dedup_mode(mode)					\
+	__print_symbolic(mode,					\
+		{ NON_FIN,		"non_fin" },		\
+		{ WEAK_STR_FIN,		"ws_fin" },		\
+		{ STR_FIN,		"str_fin" },		\
+		{ DEDUP_OFF,		"off" })
+
+#define show_dedup_lookup(res)					\
+	__print_symbolic(res,					\
+		{ NOVA_LOOKUP_MISS,	"miss" },		\
+		{ NOVA_LOOKUP_WEAK_HIT,	"weak_hit" },		\
+		{ NOVA_LOOKUP_STRONG_HIT, "strong_hit" },	\
+		{ NOVA_LOOKUP_CACHE_HIT, "cache_hit" },		\
+		{ NOVA_LOOKUP_COLLISION, "collision" })
+
+TRACE_EVENT(nova_dedup_mode,
+	TP_PROTO(struct super_block *sb, u32 old_mode, u32 new_mode,
+		 unsigned int dup_percent),
+	TP_ARGS(sb, old_mode, new_mode, dup_percent),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u32, old_mode)
+		__field(u32, new_mode)
+		__field(unsigned int, dup_percent)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->old_mode = old_mode;
+		__entry->new_mode = new_mode;
+		__entry->dup_percent = dup_percent;
+	),
+
+	TP_printk("dev %d:%d mode %s -> %s dup %u%%",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  show_dedup_mode(__entry->old_mode),
+		  show_dedup_mode(__entry->new_mode),
+		  __entry->dup_percent)
+);
+
+/*
+ * One per index lookup. A collision is a weak fingerprint match on
+ * different contents and is followed by the strong lookup's own event.
+ */
+TRACE_EVENT(nova_dedup_lookup,
+	TP_PROTO(struct super_block *sb, int result, u64 entrynr,
+		 unsigned long blocknr),
+	TP_ARGS(sb, result, entrynr, blocknr),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, result)
+		__field(u64, entrynr)
+		__field(unsigned long, blocknr)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->result = result;
+		__entry->entrynr = entrynr;
+		__entry->blocknr = blocknr;
+	),
+
+	TP_printk("dev %d:%d %s entry %llu block %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  show_dedup_lookup(__entry->result),
+		  __entry->entrynr, __entry->blocknr)
+);
+
+DECLARE_EVENT_CLASS(nova_dedup_entry,
+	TP_PROTO(struct super_block *sb, u64 entrynr, unsigned long free),
+	TP_ARGS(sb, entrynr, free),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, entrynr)
+		__field(unsigned long, free)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->entrynr = entrynr;
+		__entry->free = free;
+	),
+
+	TP_printk("dev %d:%d entry %llu free %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->entrynr, __entry->free)
+);
+
+DEFINE_EVENT(nova_dedup_entry, nova_dedup_entry_alloc,
+	TP_PROTO(struct super_block *sb, u64 entrynr, unsigned long free),
+	TP_ARGS(sb, entrynr, free));
+
+/* free does not count entries queued for reclaim */
+DEFINE_EVENT(nova_dedup_entry, nova_dedup_entry_free,
+	TP_PROTO(struct super_block *sb, u64 entrynr, unsigned long free),
+	TP_ARGS(sb, entrynr, free));
+
+/* refcount is the value after the change */
+DECLARE_EVENT_CLASS(nova_dedup_ref,
+	TP_PROTO(struct super_block *sb, u64 entrynr, unsigned long blocknr,
+		 u64 refcount),
+	TP_ARGS(sb, entrynr, blocknr, refcount),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, entrynr)
+		__field(unsigned long, blocknr)
+		__field(u64, refcount)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->entrynr = entrynr;
+		__entry->blocknr = blocknr;
+		__entry->refcount = refcount;
+	),
+
+	TP_printk("dev %d:%d entry %llu block %lu refcount %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->entrynr, __entry->blocknr, __entry->refcount)
+);
+
+DEFINE_EVENT(nova_dedup_ref, nova_dedup_ref_get,
+	TP_PROTO(struct super_block *sb, u64 entrynr, unsigned long blocknr,
+		 u64 refcount),
+	TP_ARGS(sb, entrynr, blocknr, refcount));
+
+DEFINE_EVENT(nova_dedup_ref, nova_dedup_ref_put,
+	TP_PROTO(struct super_block *sb, u64 entrynr, unsigned long blocknr,
+		 u64 refcount),
+	TP_ARGS(sb, entrynr, blocknr, refcount));
+
+/* Every NOVA_NON_FIN_TRACE_STRIDE entries of a pass, and at its end */
+TRACE_EVENT(nova_dedup_non_fin,
+	TP_PROTO(struct super_block *sb, unsigned long scanned,
+		 unsigned long linked, unsigned long total),
+	TP_ARGS(sb, scanned, linked, total),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, scanned)
+		__field(unsigned long, linked)
+		__field(unsigned long, total)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->scanned = scanned;
+		__entry->linked = linked;
+		__entry->total = total;
+	),
+
+	TP_printk("dev %d:%d scanned %lu of %lu entries, linked %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->scanned, __entry->total, __entry->linked)
+);
+
+#endif /* _TRACE_NOVA_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nova_trace
+#include <trace/define_trace.h>
@@ -15,6 +15,7 @@
  * warranty of any kind, whether express or implied.
  */
 
+#include <linux/crc32.h>
 #include "nova.h"
 
 static int nova_calculate_block_parity(struct super_block *sb, u8 *parity,
@@ -253,6 +254,89 @@ out:
 	return 0;
 }
 
+/* Checksum the 8 stripes of a whole block in one interleaved pass.
+ *
+ * crc receives the stripe checksums as nova_update_block_csum would store
+ * them. The return value is the crc32c of the whole block with the same
+ * seed, folded from the stripe checksums, which dedup uses as the weak
+ * fingerprint (see nova_fp_weak_calc).
+ */
+u32 nova_calc_block_stripe_csums(const u8 *block, u32 *crc)
+{
+	size_t strp_size = NOVA_STRIPE_SIZE;
+	u64 acc[8] = {CSUM0, CSUM0, CSUM0, CSUM0, CSUM0, CSUM0, CSUM0, CSUM0};
+	u32 whole;
+	unsigned int i;
+
+	BUILD_BUG_ON(PAGE_SIZE != 8 * NOVA_STRIPE_SIZE);
+
+	if (static_cpu_has(X86_FEATURE_XMM4_2)) {
+		for (i = 0; i < strp_size / 8; i++) {
+			nova_crc32c_qword(*((u64 *) (block)), acc[0]);
+			nova_crc32c_qword(*((u64 *) (block + 1 * strp_size)), acc[1]);
+			nova_crc32c_qword(*((u64 *) (block + 2 * strp_size)), acc[2]);
+			nova_crc32c_qword(*((u64 *) (block + 3 * strp_size)), acc[3]);
+			nova_crc32c_qword(*((u64 *) (block + 4 * strp_size)), acc[4]);
+			nova_crc32c_qword(*((u64 *) (block + 5 * strp_size)), acc[5]);
+			nova_crc32c_qword(*((u64 *) (block + 6 * strp_size)), acc[6]);
+			nova_crc32c_qword(*((u64 *) (block + 7 * strp_size)), acc[7]);
+			block += 8;
+		}
+		for (i = 0; i < 8; i++)
+			crc[i] = (u32) acc[i];
+	} else {
+		for (i = 0; i < 8; i++)
+			crc[i] = nova_crc32c(CSUM0, block + i * strp_size,
+						strp_size);
+	}
+
+	/* crc32c(seed, A|B) = shift(crc32c(seed, A) ^ seed, |B|) ^ crc32c(seed, B) */
+	whole = crc[0];
+	for (i = 1; i < 8; i++)
+		whole = __crc32c_le_combine(whole ^ CSUM0, crc[i], strp_size);
+
+	for (i = 0; i < 8; i++)
+		crc[i] = cpu_to_le32(crc[i]);
+
+	return whole;
+}
+
+/* Protect a whole 4K block whose stripe checksums were computed by
+ * nova_calc_block_stripe_csums: store them and update the parity.
+ * A NULL crc makes the checksums computed here.
+ */
+int nova_update_block_csum_parity_precomputed(struct super_block *sb,
+	const u8 *block, unsigned long blocknr, const u32 *crc)
+{
+	size_t csum_size = NOVA_DATA_CSUM_LEN;
+	unsigned long strp_nr, blockoff;
+	void *nvmmptr, *nvmmptr1;
+	u32 stripe_csums[8];
+
+	NOVA_STATS_ADD(block_csum_parity, 1);
+
+	if (data_csum > 0) {
+		if (!crc) {
+			nova_calc_block_stripe_csums(block, stripe_csums);
+			crc = stripe_csums;
+		}
+		blockoff = nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K);
+		strp_nr = blockoff >> NOVA_STRIPE_SHIFT;
+
+		nvmmptr = nova_get_data_csum_addr(sb, strp_nr, 0);
+		nvmmptr1 = nova_get_data_csum_addr(sb, strp_nr, 1);
+		nova_memunlock_range(sb, nvmmptr, csum_size * 8);
+		memcpy_to_pmem_nocache(nvmmptr, crc, csum_size * 8);
+		memcpy_to_pmem_nocache(nvmmptr1, crc, csum_size * 8);
+		nova_memlock_range(sb, nvmmptr, csum_size * 8);
+	}
+
+	if (data_parity > 0)
+		nova_update_block_parity(sb, (u8 *)block, blocknr, 0);
+
+	return 0;
+}
+
 /* Restore a stripe of data.
  *
  * When this function is called, the two corresponding checksum copies are also
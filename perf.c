@@ -277,6 +277,273 @@ static const raid5_call_t raid5_calls[] = {
 //	{ "xor_blocks", xor_blocks_call },
 };
 
+/* fingerprint functions */
+static u64 nova_fp_weak_call(struct nova_fp_hash_ctx *hash, char *data,
+	size_t size)
+{
+	/* the crc32c nova_fp_weak_calc runs, over size bytes */
+	return nova_crc32c(NOVA_INIT_CSUM, data, size);
+}
+
+static u64 nova_stripe_csums_fp_call(struct nova_fp_hash_ctx *hash, char *data,
+	size_t size)
+{
+	u32 volatile crc[8]; // avoid results being optimized out
+
+	return nova_calc_block_stripe_csums(data, (u32 *)crc);
+}
+
+static u64 strong_fp_call(struct nova_fp_hash_ctx *hash, char *data,
+	size_t size)
+{
+	struct nova_fp_strong fp = {0};
+
+	nova_fp_strong_calc_len(hash, data, size, &fp);
+	return fp.u64s[0];
+}
+
+static const fingerprint_call_t fingerprint_calls[] = {
+	/* order should match enum fingerprint_call_id */
+	{ "nova_fp_weak (crc32c)",  NULL,     nova_fp_weak_call },
+	{ "stripe csums + weak fp", NULL,     nova_stripe_csums_fp_call },
+	{ "md5 strong fp",          "md5",    strong_fp_call },
+	{ "sha1 strong fp",         "sha1",   strong_fp_call },
+	{ "sha256 strong fp",       "sha256", strong_fp_call }
+};
+
+/* copy to pmem and fingerprint functions */
+static u64 copy_then_weak_call(struct nova_fp_hash_ctx *hash, char *dst,
+	char *src, size_t size)
+{
+	memcpy_to_pmem_nocache(dst, src, size);
+	return nova_crc32c(NOVA_INIT_CSUM, src, size);
+}
+
+/* Bytes hashed right after they are copied, while still in L1 */
+#define	NOVA_PERF_FUSE_SIZE	256
+
+static u64 fused_copy_weak_call(struct nova_fp_hash_ctx *hash, char *dst,
+	char *src, size_t size)
+{
+	u32 crc = NOVA_INIT_CSUM;
+	size_t off, len;
+
+	for (off = 0; off < size; off += len) {
+		len = min_t(size_t, size - off, NOVA_PERF_FUSE_SIZE);
+		memcpy_to_pmem_nocache(dst + off, src + off, len);
+		crc = nova_crc32c(crc, src + off, len);
+	}
+	return crc;
+}
+
+static u64 copy_then_md5_call(struct nova_fp_hash_ctx *hash, char *dst,
+	char *src, size_t size)
+{
+	memcpy_to_pmem_nocache(dst, src, size);
+	return strong_fp_call(hash, src, size);
+}
+
+static const copy_hash_call_t copy_hash_calls[] = {
+	/* order should match enum copy_hash_call_id */
+	{ "copy, then weak fp",   copy_then_weak_call },
+	{ "fused copy + weak fp", fused_copy_weak_call },
+	{ "copy, then md5",       copy_then_md5_call }
+};
+
+/* index functions, on a private index */
+static inline u64 nova_perf_key(struct nova_perf_index *index,
+	unsigned long key)
+{
+	return hash_64(index->nonce + key, 64);
+}
+
+static void nova_perf_key_fp(struct nova_perf_index *index,
+	unsigned long key, struct nova_fp_strong *fp)
+{
+	fp->u64s[0] = nova_perf_key(index, key);
+	fp->u64s[1] = ~fp->u64s[0];
+	fp->u64s[2] = 0;
+	fp->u64s[3] = 0;
+}
+
+static u64 weak_index_insert_call(struct nova_perf_index *index,
+	unsigned long key)
+{
+	struct nova_hentry *node = &index->nodes[key];
+	u32 fp = (u32)nova_perf_key(index, key);
+	unsigned long idx = fp & index->mask;
+
+	spin_lock(&index->locks[idx % HASH_TABLE_LOCK_NUM]);
+	node->fp_weak = fp;
+	hlist_add_head(&node->weak_node, &index->weak[idx]);
+	spin_unlock(&index->locks[idx % HASH_TABLE_LOCK_NUM]);
+	return idx;
+}
+
+static u64 weak_index_lookup_call(struct nova_perf_index *index,
+	unsigned long key)
+{
+	struct nova_hentry *node, *found = NULL;
+	u32 fp = (u32)nova_perf_key(index, key);
+	unsigned long idx = fp & index->mask;
+
+	spin_lock(&index->locks[idx % HASH_TABLE_LOCK_NUM]);
+	hlist_for_each_entry(node, &index->weak[idx], weak_node) {
+		if (node->fp_weak == fp) {
+			found = node;
+			break;
+		}
+	}
+	spin_unlock(&index->locks[idx % HASH_TABLE_LOCK_NUM]);
+	return found ? found - index->nodes : -1;
+}
+
+static u64 strong_index_lookup_call(struct nova_perf_index *index,
+	unsigned long key)
+{
+	struct nova_hentry *node, *found = NULL;
+	struct nova_fp_strong fp;
+	unsigned long idx;
+
+	nova_perf_key_fp(index, key, &fp);
+	idx = fp.u64s[0] & index->mask;
+	spin_lock(&index->locks[idx % HASH_TABLE_LOCK_NUM]);
+	hlist_for_each_entry(node, &index->strong[idx], strong_node) {
+		if (node->fp_strong_tag == NOVA_FP_STRONG_TAG(&fp) &&
+		    !memcmp(&index->fps[node - index->nodes], &fp, sizeof(fp))) {
+			found = node;
+			break;
+		}
+	}
+	spin_unlock(&index->locks[idx % HASH_TABLE_LOCK_NUM]);
+	return found ? found - index->nodes : -1;
+}
+
+static const index_call_t index_calls[] = {
+	/* order should match enum index_call_id */
+	{ "weak index insert",   weak_index_insert_call },
+	{ "weak index lookup",   weak_index_lookup_call },
+	{ "strong index lookup", strong_index_lookup_call }
+};
+
+/*
+ * Index with room for ops more keys, filled to fill percent of its
+ * buckets. Keys below index->present are linked in both tables.
+ */
+static struct nova_perf_index *nova_alloc_perf_index(unsigned long ops,
+	unsigned int fill)
+{
+	struct nova_perf_index *index;
+	unsigned long buckets, nodes, key, idx;
+
+	index = kzalloc(sizeof(*index), GFP_KERNEL);
+	if (index == NULL)
+		return NULL;
+
+	buckets = roundup_pow_of_two(max(ops, 64UL));
+	index->mask = buckets - 1;
+	index->present = buckets * fill / 100;
+	nodes = index->present + ops;
+	index->weak = vzalloc(sizeof(struct hlist_head) * buckets);
+	index->strong = vzalloc(sizeof(struct hlist_head) * buckets);
+	index->nodes = vzalloc(sizeof(struct nova_hentry) * nodes);
+	index->fps = vmalloc(sizeof(struct nova_fp_strong) * nodes);
+	if (!index->weak || !index->strong || !index->nodes || !index->fps)
+		goto out_free;
+
+	get_random_bytes(&index->nonce, sizeof(index->nonce));
+	for (idx = 0; idx < HASH_TABLE_LOCK_NUM; idx++)
+		spin_lock_init(&index->locks[idx]);
+	for (key = 0; key < nodes; key++)
+		nova_perf_key_fp(index, key, &index->fps[key]);
+	for (key = 0; key < index->present; key++) {
+		weak_index_insert_call(index, key);
+		idx = index->fps[key].u64s[0] & index->mask;
+		index->nodes[key].fp_strong_tag =
+			NOVA_FP_STRONG_TAG(&index->fps[key]);
+		hlist_add_head(&index->nodes[key].strong_node,
+			       &index->strong[idx]);
+	}
+	return index;
+
+out_free:
+	vfree(index->weak);
+	vfree(index->strong);
+	vfree(index->nodes);
+	vfree(index->fps);
+	kfree(index);
+	return NULL;
+}
+
+static void nova_free_perf_index(struct nova_perf_index *index)
+{
+	if (index == NULL)
+		return;
+	vfree(index->weak);
+	vfree(index->strong);
+	vfree(index->nodes);
+	vfree(index->fps);
+	kfree(index);
+}
+
+/* dup percent of the picks return one of the present keys, the rest new ones */
+static unsigned long nova_perf_pick(unsigned long i, unsigned long present,
+	unsigned int dup)
+{
+	if (present && hash_32(i, 32) % 100 < dup)
+		return hash_32(i ^ 0x5bd1e995, 32) % present;
+	return present + i;
+}
+
+/* dedup entry functions, on the mounted file system */
+static int entry_alloc_free_call(struct super_block *sb)
+{
+	entrynr_t entrynr;
+	int ret;
+
+	ret = nova_alloc_entry(sb, &entrynr);
+	if (ret == 0)
+		nova_free_entry(sb, entrynr);
+	return ret;
+}
+
+static int entry_alloc_reclaim_call(struct super_block *sb)
+{
+	entrynr_t entrynr;
+	int ret;
+
+	ret = nova_alloc_entry(sb, &entrynr);
+	if (ret == 0)
+		nova_reclaim_entry(sb, entrynr);
+	return ret;
+}
+
+static const entry_call_t entry_calls[] = {
+	/* order should match enum entry_call_id */
+	{ "entry alloc + free",        entry_alloc_free_call },
+	{ "entry alloc + reclaim",     entry_alloc_reclaim_call }
+};
+
+/* end-to-end dedup writes, freed again after the test */
+static const dedup_write_call_t dedup_write_calls[] = {
+	/* order should match enum dedup_write_call_id */
+	{ "dedup write non_fin",      NON_FIN },
+	{ "dedup write weak_str_fin", WEAK_STR_FIN },
+	{ "dedup write str_fin",      STR_FIN },
+	{ "dedup write off",          DEDUP_OFF }
+};
+
+/* Give every block of the pool its own content, in case it reads as zero */
+static void nova_stamp_vmem_pool(char *pool, size_t size, unsigned long num)
+{
+	unsigned long i;
+	u64 nonce;
+
+	get_random_bytes(&nonce, sizeof(nonce));
+	for (i = 0; i < num; i++)
+		*(u64 *)(pool + i * size) = nonce + i;
+}
+
 /* memory pools for perf testing */
 static void *nova_alloc_vmem_pool(size_t poolsize)
 {
@@ -347,26 +614,61 @@ static void nova_free_pmem_pool(struct super_block *sb,
 	*pmem = NULL;
 }
 
-static int nova_test_func_perf(struct super_block *sb, unsigned int func_id,
-	size_t poolsize, size_t size, unsigned int disks)
+/* crypto shash for the strong fingerprint calls, NULL alg uses none */
+static int nova_perf_hash_init(struct nova_fp_hash_ctx *hash, const char *alg)
+{
+	struct crypto_shash *tfm;
+
+	if (alg == NULL)
+		return 0;
+
+	tfm = crypto_alloc_shash(alg, 0, 0);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+
+	hash->alg = tfm;
+	return 0;
+}
+
+/*
+ * Run one call and fill res with what it did. Preemption is disabled
+ * around the timed loop only, the entry and dedup write calls may sleep
+ * and are timed by the wall clock instead.
+ */
+static int nova_test_func_perf(struct super_block *sb,
+	struct nova_perf_params *params, unsigned int func_id,
+	struct nova_perf_result *res)
 {
-	u64 csum = 12345, xor = 0;
+	u64 csum = 12345, xor = 0, start = 0;
 
 	u64 volatile result; // avoid results being optimized out
 	const char *fname = NULL;
 	char *src = NULL, *dst = NULL, *pmem = NULL;
 	char **data = NULL, *parity;
-	size_t off = 0;
-	int cpu, i, j, reps, err = 0, allocated = 0;
+	size_t poolsize = (size_t)params->poolmb * 1024 * 1024;
+	size_t size = params->size, off = 0;
+	unsigned int disks = params->disks;
+	int cpu, i, j, reps, ret, err = 0, allocated = 0;
 	unsigned int call_id = 0, call_gid = 0;
-	unsigned long blocknr = 0, nsec, lat, thru;
+	unsigned long blocknr = 0, nsec, lat, thru, bytes = 0, key;
+	unsigned long *blocknrs = NULL;
+	bool pinned = true;
 	struct nova_inode_info_header perf_sih;
+	struct nova_fp_hash_ctx hash = { NULL };
+	struct nova_perf_index *index = NULL;
+	struct nova_dedup_chunk chunk = { NULL };
 	const memcpy_call_t *fmemcpy = NULL;
 	const checksum_call_t *fchecksum = NULL;
 	const raid5_call_t *fraid5 = NULL;
+	const fingerprint_call_t *ffingerprint = NULL;
+	const copy_hash_call_t *fcopy_hash = NULL;
+	const index_call_t *findex = NULL;
+	const entry_call_t *fentry = NULL;
+	const dedup_write_call_t *fdedup_write = NULL;
 	INIT_TIMING(perf_time);
 
-	cpu = get_cpu(); /* get cpu id and disable preemption */
+	memset(res, 0, sizeof(*res));
+	cpu = raw_smp_processor_id(); /* only a hint for the pmem pools */
 	reps = poolsize / size; /* raid calls will adjust this number */
 	call_id = func_id - 1; /* individual function id starting from 1 */
 
@@ -459,16 +761,127 @@ static int nova_test_func_perf(struct super_block *sb, unsigned int func_id,
 	}
 	call_id -= NUM_RAID5_CALLS;
 
+	/* weak and strong fingerprints */
+	if (call_id < NUM_FINGERPRINT_CALLS) {
+		ffingerprint = &fingerprint_calls[call_id];
+		fname = ffingerprint->name;
+		call_gid = fingerprint_gid;
+
+		if (call_id == nova_stripe_csums_fp_id && size != PAGE_SIZE) {
+			nova_dbg("%s only for 4K blocks, skip testing\n", fname);
+			goto out;
+		}
+		if (nova_perf_hash_init(&hash, ffingerprint->alg)) {
+			nova_dbg("%s: no %s, skip testing\n", fname,
+						ffingerprint->alg);
+			goto out;
+		}
+
+		src = nova_alloc_vmem_pool(poolsize);
+		if (src == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+		bytes = reps * size;
+
+		goto test;
+	}
+	call_id -= NUM_FINGERPRINT_CALLS;
+
+	/* copy to pmem and fingerprint */
+	if (call_id < NUM_COPY_HASH_CALLS) {
+		fcopy_hash = &copy_hash_calls[call_id];
+		fname = fcopy_hash->name;
+		call_gid = copy_hash_gid;
+
+		if (call_id == copy_then_md5_id &&
+		    nova_perf_hash_init(&hash, "md5")) {
+			nova_dbg("%s: no md5, skip testing\n", fname);
+			goto out;
+		}
+
+		src = nova_alloc_vmem_pool(poolsize);
+		pmem = nova_alloc_pmem_pool(sb, &perf_sih, cpu, poolsize,
+							&blocknr, &allocated);
+		if (src == NULL || pmem == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+		bytes = reps * size;
+
+		goto test;
+	}
+	call_id -= NUM_COPY_HASH_CALLS;
+
+	/* fingerprint index, one operation per work size of the pool */
+	if (call_id < NUM_INDEX_CALLS) {
+		index = nova_alloc_perf_index(reps, params->fill);
+		if (index == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		findex = &index_calls[call_id];
+		fname = findex->name;
+		call_gid = index_gid;
+
+		goto test;
+	}
+	call_id -= NUM_INDEX_CALLS;
+
+	/* dedup entry table */
+	if (call_id < NUM_ENTRY_CALLS) {
+		fentry = &entry_calls[call_id];
+		fname = fentry->name;
+		call_gid = entry_gid;
+		pinned = false;
+
+		goto test;
+	}
+	call_id -= NUM_ENTRY_CALLS;
+
+	/* end-to-end dedup writes, one block per work size of the pool */
+	if (call_id < NUM_DEDUP_WRITE_CALLS) {
+		fdedup_write = &dedup_write_calls[call_id];
+		fname = fdedup_write->name;
+		call_gid = dedup_write_gid;
+		pinned = false;
+
+		if (size != PAGE_SIZE) {
+			nova_dbg("%s only for 4K blocks, skip testing\n", fname);
+			goto out;
+		}
+
+		src = nova_alloc_vmem_pool(poolsize);
+		blocknrs = vmalloc(sizeof(unsigned long) * reps);
+		if (src == NULL || blocknrs == NULL) {
+			reps = 0; /* nothing written to free */
+			err = -ENOMEM;
+			goto out;
+		}
+		nova_stamp_vmem_pool(src, size, reps);
+
+		goto test;
+	}
+	call_id -= NUM_DEDUP_WRITE_CALLS;
+
 	/* continue with the next call group */
 
 test:
-	if (fmemcpy == NULL && fchecksum == NULL && fraid5 == NULL) {
+	if (fmemcpy == NULL && fchecksum == NULL && fraid5 == NULL &&
+	    ffingerprint == NULL && fcopy_hash == NULL && findex == NULL &&
+	    fentry == NULL && fdedup_write == NULL) {
 		nova_dbg("%s: function struct error\n", __func__);
 		err = -EFAULT;
 		goto out;
 	}
 
-	reset_perf_timer();
+	if (pinned) {
+		cpu = get_cpu(); /* get cpu id and disable preemption */
+		reset_perf_timer();
+	} else {
+		start = ktime_get_ns();
+	}
 	NOVA_START_TIMING(perf_t, perf_time);
 
 	switch (call_gid) {
@@ -501,28 +914,101 @@ test:
 		}
 		result = xor;
 		break;
+	case fingerprint_gid:
+		for (i = 0; i < reps; i++, off += size)
+			csum = ffingerprint->call(&hash, src + off, size);
+		result = csum;
+		break;
+	case copy_hash_gid:
+		nova_memunlock_range(sb, pmem, poolsize);
+		for (i = 0; i < reps; i++, off += size)
+			csum = fcopy_hash->call(&hash, pmem + off, src + off,
+						size);
+		nova_memlock_range(sb, pmem, poolsize);
+		result = csum;
+		break;
+	case index_gid:
+		for (i = 0; i < reps; i++) {
+			if (call_id == weak_index_insert_id)
+				key = index->present + i;
+			else
+				key = nova_perf_pick(i, index->present,
+						     params->dup);
+			csum = findex->call(index, key);
+		}
+		result = csum;
+		break;
+	case entry_gid:
+		for (i = 0; i < reps; i++) {
+			err = fentry->call(sb);
+			if (err)
+				break;
+		}
+		reps = i;
+		break;
+	case dedup_write_gid:
+		for (i = 0; i < reps; i++) {
+			/* dup percent of the writes repeat an earlier block */
+			j = (i && hash_32(i, 32) % 100 < params->dup) ?
+				hash_32(i ^ 0x5bd1e995, 32) % i : i;
+			chunk.data = src + j * size;
+			ret = nova_dedup_write_mode(sb, &chunk, &blocknrs[i],
+						    fdedup_write->mode);
+			if (ret < 0) {
+				err = ret;
+				break;
+			}
+		}
+		reps = i;
+		bytes = reps * size;
+		break;
 	default:
 		nova_dbg("%s: invalid function group %d\n", __func__, call_gid);
 		break;
 	}
 
 	NOVA_END_TIMING(perf_t, perf_time);
-	nsec = read_perf_timer();
+	if (pinned) {
+		nsec = read_perf_timer();
+		if (cpu != smp_processor_id()) /* scheduling shouldn't happen */
+			nova_dbg("cpu was %d, now %d\n", cpu, smp_processor_id());
+		put_cpu(); /* enable preemption */
+	} else {
+		nsec = ktime_get_ns() - start;
+	}
 
 	// nova_info("checksum value: 0x%016llx\n", csum);
 
-	lat  = (err) ? 0 : nsec / reps;
 	if (call_gid == raid5_gid)
-		thru = (err) ? 0 : mb_per_sec(reps * disks * size, nsec);
-	else
-		thru = (err) ? 0 : mb_per_sec(reps * size, nsec);
+		bytes = reps * disks * size;
+	else if (call_gid <= checksum_gid)
+		bytes = reps * size;
 
-	if (cpu != smp_processor_id()) /* scheduling shouldn't happen */
-		nova_dbg("cpu was %d, now %d\n", cpu, smp_processor_id());
+	lat  = (err || reps == 0) ? 0 : nsec / reps;
+	thru = (err) ? 0 : mb_per_sec(bytes, nsec);
 
 	nova_info("%4u %25s %4u %8lu %8lu\n", func_id, fname, cpu, lat, thru);
 
+	if (!err) {
+		res->name = fname;
+		res->nsec = nsec;
+		res->ops = reps;
+		res->bytes = bytes;
+	}
+
 out:
+	if (call_gid == entry_gid)
+		nova_drain_entry_reclaim(sb);
+	if (blocknrs != NULL) {
+		for (i = 0; i < reps; i++)
+			if (nova_dedup_free_block(sb, blocknrs[i]))
+				nova_free_data_block(sb, blocknrs[i]);
+		vfree(blocknrs);
+	}
+	nova_free_perf_index(index);
+	if (hash.alg != NULL)
+		crypto_free_shash(hash.alg);
+
 	nova_free_vmem_pool(src);
 	nova_free_vmem_pool(dst);
 	nova_free_pmem_pool(sb, &perf_sih, &pmem, blocknr, allocated);
@@ -530,61 +1016,154 @@ out:
 	if (data != NULL)
 		kfree(data);
 
-	put_cpu(); /* enable preemption */
-
 	if (err)
 		nova_dbg("%s: performance test aborted\n", __func__);
 	return err;
 }
 
-int nova_test_perf(struct super_block *sb, unsigned int func_id,
-	unsigned int poolmb, size_t size, unsigned int disks)
+static int nova_test_func_perf_thread(void *arg)
+{
+	struct nova_perf_thread *pt = arg;
+
+	pt->err = nova_test_func_perf(pt->sb, pt->params, pt->func_id,
+				      &pt->result);
+	complete(&pt->done);
+	return 0;
+}
+
+/*
+ * Run a call on params->threads kthreads, one per online cpu, and add an
+ * aggregate line. The aggregate is taken over the slowest thread so the
+ * pool setup of each thread is left out.
+ */
+static int nova_test_func_perf_threads(struct super_block *sb,
+	struct nova_perf_params *params, unsigned int func_id)
+{
+	struct nova_perf_thread *threads;
+	struct nova_perf_result res;
+	unsigned long nsec = 0, ops = 0, bytes = 0;
+	const char *fname = NULL;
+	int cpu = -1, i, ret = 0;
+
+	if (params->threads <= 1)
+		return nova_test_func_perf(sb, params, func_id, &res);
+
+	threads = kcalloc(params->threads, sizeof(*threads), GFP_KERNEL);
+	if (threads == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < params->threads; i++) {
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+
+		threads[i].sb = sb;
+		threads[i].params = params;
+		threads[i].func_id = func_id;
+		init_completion(&threads[i].done);
+		threads[i].task = kthread_create(nova_test_func_perf_thread,
+					&threads[i], "nova_perf/%u", i);
+		if (IS_ERR(threads[i].task)) {
+			ret = PTR_ERR(threads[i].task);
+			/* none has run yet, stopping them skips the call */
+			while (--i >= 0)
+				kthread_stop(threads[i].task);
+			goto out;
+		}
+		kthread_bind(threads[i].task, cpu);
+	}
+
+	for (i = 0; i < params->threads; i++)
+		wake_up_process(threads[i].task);
+
+	for (i = 0; i < params->threads; i++) {
+		wait_for_completion(&threads[i].done);
+		if (threads[i].err && ret == 0)
+			ret = threads[i].err;
+		if (threads[i].result.name == NULL)
+			continue;
+		fname = threads[i].result.name;
+		nsec = max(nsec, threads[i].result.nsec);
+		ops += threads[i].result.ops;
+		bytes += threads[i].result.bytes;
+	}
+
+	if (ret == 0 && fname != NULL)
+		nova_info("%4u %25s %4s %8lu %8lu\n", func_id, fname, "all",
+			  ops ? nsec / ops : 0, mb_per_sec(bytes, nsec));
+
+out:
+	kfree(threads);
+	return ret;
+}
+
+int nova_test_perf(struct super_block *sb, struct nova_perf_params *params)
 {
 	int id, ret = 0;
-	size_t poolsize = poolmb * 1024 * 1024;
+	size_t poolsize = (size_t)params->poolmb * 1024 * 1024;
 
 	if (!measure_timing) {
 		nova_dbg("%s: measure_timing not set!\n", __func__);
 		ret = -EFAULT;
 		goto out;
 	}
-	if (func_id > NUM_PERF_CALLS) {
-		nova_dbg("%s: invalid function id %d!\n", __func__, func_id);
+	if (params->func_id > NUM_PERF_CALLS) {
+		nova_dbg("%s: invalid function id %d!\n", __func__,
+						params->func_id);
+		ret = -EFAULT;
+		goto out;
+	}
+	if (params->poolmb < 1 || 1024 < params->poolmb) {
+		/* limit pool size to 1GB */
+		nova_dbg("%s: invalid pool size %u MB!\n", __func__,
+						params->poolmb);
+		ret = -EFAULT;
+		goto out;
+	}
+	if (params->size < 64 || poolsize < params->size ||
+	    (params->size % 64)) {
+		nova_dbg("%s: invalid data size %zu!\n", __func__,
+						params->size);
 		ret = -EFAULT;
 		goto out;
 	}
-	if (poolmb < 1 || 1024 < poolmb) { /* limit pool size to 1GB */
-		nova_dbg("%s: invalid pool size %u MB!\n", __func__, poolmb);
+	if (params->disks < 1 || 32 < params->disks) {
+		/* limit number of disks */
+		nova_dbg("%s: invalid disk count %u!\n", __func__,
+						params->disks);
 		ret = -EFAULT;
 		goto out;
 	}
-	if (size < 64 || poolsize < size || (size % 64)) {
-		nova_dbg("%s: invalid data size %zu!\n", __func__, size);
+	if (params->threads < 1 || num_online_cpus() < params->threads) {
+		nova_dbg("%s: invalid thread count %u!\n", __func__,
+						params->threads);
 		ret = -EFAULT;
 		goto out;
 	}
-	if (disks < 1 || 32 < disks) { /* limit number of disks */
-		nova_dbg("%s: invalid disk count %u!\n", __func__, disks);
+	if (params->fill > 1000 || params->dup > 100) {
+		nova_dbg("%s: invalid fill %u%% or dup %u%%!\n", __func__,
+						params->fill, params->dup);
 		ret = -EFAULT;
 		goto out;
 	}
 
 	nova_info("test function performance\n");
 	nova_info("pool size %u MB, work size %zu, disks %u\n",
-					poolmb, size, disks);
+			params->poolmb, params->size, params->disks);
+	nova_info("threads %u, index fill %u%%, dup ratio %u%%\n",
+			params->threads, params->fill, params->dup);
 
 	nova_info("%4s %25s %4s %8s %8s\n", "id", "name", "cpu", "ns", "MB/s");
 	nova_info("-------------------------------------------------------\n");
-	if (func_id == 0) {
+	if (params->func_id == 0) {
 		/* individual function id starting from 1 */
 		for (id = 1; id <= NUM_PERF_CALLS; id++) {
-			ret = nova_test_func_perf(sb, id, poolsize,
-							size, disks);
+			ret = nova_test_func_perf_threads(sb, params, id);
 			if (ret < 0)
 				goto out;
 		}
 	} else {
-		ret = nova_test_func_perf(sb, func_id, poolsize, size, disks);
+		ret = nova_test_func_perf_threads(sb, params, params->func_id);
 	}
 	nova_info("-------------------------------------------------------\n");
 
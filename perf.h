@@ -21,7 +21,11 @@
 #include <linux/zutil.h>
 #include <linux/libnvdimm.h>
 #include <linux/raid/xor.h>
+#include <linux/kthread.h>
+#include <linux/hash.h>
+#include <linux/random.h>
 #include "nova.h"
+#include "dedup.h"
 
 #define	reset_perf_timer()	__this_cpu_write(Timingstats_percpu[perf_t], 0)
 #define	read_perf_timer()	__this_cpu_read(Timingstats_percpu[perf_t])
@@ -64,16 +68,60 @@ enum raid5_call_id {
 	NUM_RAID5_CALLS
 };
 
+enum fingerprint_call_id {
+	nova_fp_weak_id = 0,
+	nova_stripe_csums_fp_id,
+	md5_fp_id,
+	sha1_fp_id,
+	sha256_fp_id,
+	NUM_FINGERPRINT_CALLS
+};
+
+enum copy_hash_call_id {
+	copy_then_weak_id = 0,
+	fused_copy_weak_id,
+	copy_then_md5_id,
+	NUM_COPY_HASH_CALLS
+};
+
+enum index_call_id {
+	weak_index_insert_id = 0,
+	weak_index_lookup_id,
+	strong_index_lookup_id,
+	NUM_INDEX_CALLS
+};
+
+enum entry_call_id {
+	entry_alloc_free_id = 0,
+	entry_alloc_reclaim_id,
+	NUM_ENTRY_CALLS
+};
+
+enum dedup_write_call_id {
+	dedup_write_non_fin_id = 0,
+	dedup_write_ws_fin_id,
+	dedup_write_str_fin_id,
+	dedup_write_off_id,
+	NUM_DEDUP_WRITE_CALLS
+};
+
 #define	NUM_PERF_CALLS	\
 	 (NUM_MEMCPY_CALLS + NUM_FROM_PMEM_CALLS + NUM_TO_PMEM_CALLS + \
-	  NUM_CHECKSUM_CALLS + NUM_RAID5_CALLS)
+	  NUM_CHECKSUM_CALLS + NUM_RAID5_CALLS + NUM_FINGERPRINT_CALLS + \
+	  NUM_COPY_HASH_CALLS + NUM_INDEX_CALLS + NUM_ENTRY_CALLS + \
+	  NUM_DEDUP_WRITE_CALLS)
 
 enum call_group_id {
 	memcpy_gid = 0,
 	from_pmem_gid,
 	to_pmem_gid,
 	checksum_gid,
-	raid5_gid
+	raid5_gid,
+	fingerprint_gid,
+	copy_hash_gid,
+	index_gid,
+	entry_gid,
+	dedup_write_gid
 };
 
 typedef struct {
@@ -94,3 +142,64 @@ typedef struct {
 	u64 (*call)(char **, char *,                        /* data, parity */
 			size_t, int);          /* per-disk-size, data disks */
 } raid5_call_t;
+
+typedef struct {
+	const char *name;                              /* name of this call */
+	const char *alg;                  /* crypto shash to test, or NULL */
+	u64 (*call)(struct nova_fp_hash_ctx *, char *, size_t); /* hash, data, size */
+} fingerprint_call_t;
+
+typedef struct {
+	const char *name;                              /* name of this call */
+	u64 (*call)(struct nova_fp_hash_ctx *, char *, char *, /* hash, dst, src */
+			size_t);                                  /* size */
+} copy_hash_call_t;
+
+/*
+ * Private DRAM index for the index calls, laid out like the real one but
+ * with the pmm entry fingerprints in DRAM, so the calls measure the chain
+ * walks and never touch the mounted file system.
+ */
+struct nova_perf_index {
+	struct hlist_head *weak;
+	struct hlist_head *strong;
+	struct nova_hentry *nodes;
+	struct nova_fp_strong *fps;
+	unsigned long mask;
+	unsigned long present;          /* nodes linked in before the test */
+	u64 nonce;
+	spinlock_t locks[HASH_TABLE_LOCK_NUM];
+};
+
+typedef struct {
+	const char *name;                              /* name of this call */
+	u64 (*call)(struct nova_perf_index *, unsigned long); /* index, key */
+} index_call_t;
+
+typedef struct {
+	const char *name;                              /* name of this call */
+	int (*call)(struct super_block *);
+} entry_call_t;
+
+typedef struct {
+	const char *name;                              /* name of this call */
+	u32 mode;                                       /* NV-Dedup mode */
+} dedup_write_call_t;
+
+/* What one run of a call did, for the multi-threaded aggregate */
+struct nova_perf_result {
+	const char *name;
+	unsigned long nsec;
+	unsigned long ops;
+	unsigned long bytes;
+};
+
+struct nova_perf_thread {
+	struct super_block *sb;
+	struct nova_perf_params *params;
+	unsigned int func_id;
+	struct task_struct *task;
+	struct completion done;
+	struct nova_perf_result result;
+	int err;
+};
@@ -0,0 +1,151 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * PMEM-resident fingerprint index for NV-Dedup
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/prefetch.h>
+#include "nova.h"
+#include "pindex.h"
+
+#define NOVA_PINDEX_SLOT(entrynr, tag)	(((u64)(entrynr) + 1) << 32 | (tag))
+#define NOVA_PINDEX_SLOT_TAG(slot)	((u32)(slot))
+#define NOVA_PINDEX_SLOT_ENTRY(slot)	(((slot) >> 32) - 1)
+
+static inline unsigned int nova_pindex_bits(unsigned int entries_bits,
+	unsigned int lock_bits)
+{
+	int bits = entries_bits + NOVA_PINDEX_LOAD_SHIFT -
+			ilog2(NOVA_PINDEX_SLOTS);
+
+	return max_t(int, bits, lock_bits);
+}
+
+/* PMEM bytes of a table for 2^entries_bits entries */
+unsigned long nova_pindex_size(unsigned int entries_bits,
+	unsigned int lock_bits)
+{
+	return sizeof(struct nova_pindex_bucket) <<
+		nova_pindex_bits(entries_bits, lock_bits);
+}
+
+/* The table must be zeroed when the file system is created */
+void nova_pindex_init(struct nova_pindex *pindex, void *pmem,
+	unsigned int entries_bits, unsigned int lock_bits)
+{
+	pindex->buckets = pmem;
+	pindex->bucket_bits = nova_pindex_bits(entries_bits, lock_bits);
+	pindex->lock_bits = lock_bits;
+}
+
+static inline struct nova_pindex_bucket *
+nova_pindex_bucket(struct nova_pindex *pindex, u64 key, int i)
+{
+	unsigned long idx = key & ((1UL << pindex->bucket_bits) - 1);
+	unsigned int alt_bits = pindex->bucket_bits - pindex->lock_bits;
+
+	/* the alternate bucket keeps the stripe lock bits of the home one */
+	if (i && alt_bits)
+		idx ^= ((unsigned long)hash_64(key >> pindex->bucket_bits,
+				alt_bits) | 1) << pindex->lock_bits;
+	return pindex->buckets + idx;
+}
+
+/**
+ * Walk the slots of key that carry tag, across both buckets. *pos starts
+ * at 0 and is advanced past every match returned, so callers that have to
+ * confirm a match against the entry can carry on after a tag collision.
+ */
+bool nova_pindex_next(struct nova_pindex *pindex, u64 key, u32 tag,
+	unsigned int *pos, u64 *entrynr)
+{
+	struct nova_pindex_bucket *bucket;
+	u64 slot;
+
+	for (; *pos < 2 * NOVA_PINDEX_SLOTS; (*pos)++) {
+		bucket = nova_pindex_bucket(pindex, key,
+					    *pos / NOVA_PINDEX_SLOTS);
+		slot = le64_to_cpu(READ_ONCE(
+				bucket->slots[*pos % NOVA_PINDEX_SLOTS]));
+		if (slot && NOVA_PINDEX_SLOT_TAG(slot) == tag) {
+			*entrynr = NOVA_PINDEX_SLOT_ENTRY(slot);
+			(*pos)++;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Inserting a slot that is already there is a no-op, so a delete always
+ * clears the last slot of an entry. Returns -ENOSPC when both buckets are
+ * full, the entry then stays unindexed.
+ */
+int nova_pindex_insert(struct nova_pindex *pindex, u64 key, u32 tag,
+	u64 entrynr)
+{
+	struct nova_pindex_bucket *bucket;
+	__le64 slot = cpu_to_le64(NOVA_PINDEX_SLOT(entrynr, tag));
+	__le64 *free_slot = NULL;
+	int i, j;
+
+	for (i = 0; i < 2; i++) {
+		bucket = nova_pindex_bucket(pindex, key, i);
+		for (j = 0; j < NOVA_PINDEX_SLOTS; j++) {
+			if (bucket->slots[j] == slot)
+				return 0;
+			if (!bucket->slots[j] && !free_slot)
+				free_slot = &bucket->slots[j];
+		}
+	}
+	if (!free_slot)
+		return -ENOSPC;
+	WRITE_ONCE(*free_slot, slot);
+	nova_flush_buffer(free_slot, sizeof(*free_slot), true);
+	return 0;
+}
+
+bool nova_pindex_delete(struct nova_pindex *pindex, u64 key, u32 tag,
+	u64 entrynr)
+{
+	struct nova_pindex_bucket *bucket;
+	__le64 slot = cpu_to_le64(NOVA_PINDEX_SLOT(entrynr, tag));
+	int i, j;
+
+	for (i = 0; i < 2; i++) {
+		bucket = nova_pindex_bucket(pindex, key, i);
+		for (j = 0; j < NOVA_PINDEX_SLOTS; j++) {
+			if (bucket->slots[j] != slot)
+				continue;
+			WRITE_ONCE(bucket->slots[j], 0);
+			nova_flush_buffer(&bucket->slots[j],
+					  sizeof(bucket->slots[j]), true);
+			return true;
+		}
+	}
+	return false;
+}
+
+void nova_pindex_prefetch(struct nova_pindex *pindex, u64 key)
+{
+	prefetch(nova_pindex_bucket(pindex, key, 0));
+}
+
+/* Used slots of bucket idx, for the dedup proc file */
+unsigned int nova_pindex_bucket_fill(struct nova_pindex *pindex,
+	unsigned long idx)
+{
+	struct nova_pindex_bucket *bucket = pindex->buckets + idx;
+	unsigned int i, fill = 0;
+
+	for (i = 0; i < NOVA_PINDEX_SLOTS; i++)
+		if (READ_ONCE(bucket->slots[i]))
+			fill++;
+	return fill;
+}
@@ -0,0 +1,48 @@
+#ifndef __NOVA_PINDEX_H
+#define __NOVA_PINDEX_H
+
+#include <linux/types.h>
+
+/*
+ * Fingerprint index kept in PMEM, mounted with dedup_pindex.
+ *
+ * A table of 64B buckets of NOVA_PINDEX_SLOTS slots each, placed in the
+ * reserved area after the entry table directory. A key may live in one of
+ * two buckets: its home bucket, selected by the low bits of the key like a
+ * DRAM chain, and an alternate one that differs from it only above the
+ * stripe lock bits, so both are covered by the stripe lock of the key.
+ *
+ * A slot is a single 8 byte word holding the tag and entrynr + 1, 0 when
+ * empty. It is written with one store and flushed, so a crash leaves every
+ * slot either empty or pointing at a persisted entry, and the index needs
+ * no log and no rebuild. DRAM holds nothing but the table geometry.
+ */
+#define NOVA_PINDEX_SLOTS	8
+/* Slots per entry as a shift, so a full entry table fills half the slots */
+#define NOVA_PINDEX_LOAD_SHIFT	1
+
+struct nova_pindex_bucket {
+	__le64 slots[NOVA_PINDEX_SLOTS];
+};
+
+struct nova_pindex {
+	struct nova_pindex_bucket *buckets;	/* in PMEM */
+	unsigned int bucket_bits;
+	unsigned int lock_bits;
+};
+
+unsigned long nova_pindex_size(unsigned int entries_bits,
+	unsigned int lock_bits);
+void nova_pindex_init(struct nova_pindex *pindex, void *pmem,
+	unsigned int entries_bits, unsigned int lock_bits);
+bool nova_pindex_next(struct nova_pindex *pindex, u64 key, u32 tag,
+	unsigned int *pos, u64 *entrynr);
+int nova_pindex_insert(struct nova_pindex *pindex, u64 key, u32 tag,
+	u64 entrynr);
+bool nova_pindex_delete(struct nova_pindex *pindex, u64 key, u32 tag,
+	u64 entrynr);
+void nova_pindex_prefetch(struct nova_pindex *pindex, u64 key);
+unsigned int nova_pindex_bucket_fill(struct nova_pindex *pindex,
+	unsigned long idx);
+
+#endif
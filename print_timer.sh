@@ -1,6 +1,7 @@
 set -e
 make
 sudo bash setup.sh
+# Single run; dedup_bench.sh sweeps modes, dup ratios and phases into a CSV
 sudo fio -filename=/mnt/pmem/test1 -fallocate=none -direct=1 -iodepth 1 -rw=write -ioengine=sync -bs=4K -thread -numjobs=1 -size=15G -name=randrw --dedupe_percentage=80 -group_reporting
 
 # sudo gcc ioctl_test.c -o ioctl_test && sudo ./ioctl_test
@@ -364,7 +364,7 @@ static void nova_rebuild_handle_write_entry(struct super_block *sb,
 		 * The overlaped blocks are already freed.
 		 * Don't double free them, just re-assign the pointers.
 		 */
-		nova_assign_write_entry(sb, sih, entry, entryc, false);
+		nova_assign_write_entry(sb, sih, entry, entryc, false, NULL);
 	}
 
 	if (entryc->trans_id >= sih->trans_id) {
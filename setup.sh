@@ -6,6 +6,11 @@ else
     timing=$1
 fi
 
+# Extra mount options, e.g. "dedup=str_fin" or "dedup=auto,dedup_verify"
+if [ $2 ]; then
+    opts="-o $2"
+fi
+
 sleep 5
 
 echo umounting...
@@ -18,6 +23,6 @@ insmod nova.ko measure_timing=$timing
 sleep 1
 
 echo mounting...
-mount -t NOVA -o init -o data_cow /dev/pmem0 /mnt/pmem0
+mount -t NOVA -o init -o data_cow $opts /dev/pmem0 /mnt/pmem0
 #mount -t NOVA -o init -o wprotect /dev/pmem0 /mnt/pmem
 #mount -t NOVA -o init /dev/pmem0 /mnt/pmem
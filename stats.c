@@ -168,7 +168,9 @@ const char *Timingstring[TIMING_NUM] = {
 	"real_block_write",
 	"non_fin_calc",
 	"ws_fin_calc",
-	"str_fin_calc"
+	"str_fin_calc",
+	"verify_compare",
+	"huge_dedup",
 };
 
 u64 Timingstats[TIMING_NUM];
@@ -178,6 +180,122 @@ DEFINE_PER_CPU(u64[TIMING_NUM], Countstats_percpu);
 u64 IOstats[STATS_NUM];
 DEFINE_PER_CPU(u64[STATS_NUM], IOstats_percpu);
 
+/* The write/read paths and the NV-Dedup stages */
+const enum timing_category nova_lat_hist_names[NOVA_LAT_HIST_NUM] = {
+	cow_write_t,
+	do_cow_write_t,
+	inplace_write_t,
+	dax_read_t,
+	non_fin_calc_t,
+	ws_fin_calc_t,
+	str_fin_calc_t,
+	weak_fp_calc_t,
+	strong_fp_calc_t,
+	hash_table_t,
+	nv_dedup_alloc_write_t,
+	huge_dedup_t,
+};
+
+s8 nova_lat_hist_slot[TIMING_NUM] = { [0 ... TIMING_NUM - 1] = -1 };
+u64 __percpu *nova_lat_hist;
+
+#define NOVA_LAT_HIST_SIZE \
+	(sizeof(u64) * NOVA_LAT_HIST_NUM * NOVA_LAT_BUCKETS)
+
+/* The histograms are only allocated when measure_timing asks for them */
+int nova_lat_hist_init(void)
+{
+	int i;
+
+	if (measure_timing < NOVA_TIMING_HIST)
+		return 0;
+
+	nova_lat_hist = __alloc_percpu(NOVA_LAT_HIST_SIZE, sizeof(u64));
+	if (!nova_lat_hist)
+		return -ENOMEM;
+	for (i = 0; i < NOVA_LAT_HIST_NUM; i++)
+		nova_lat_hist_slot[nova_lat_hist_names[i]] = i;
+	return 0;
+}
+
+void nova_lat_hist_exit(void)
+{
+	memset(nova_lat_hist_slot, -1, sizeof(nova_lat_hist_slot));
+	free_percpu(nova_lat_hist);
+	nova_lat_hist = NULL;
+}
+
+void nova_lat_hist_clear(void)
+{
+	int cpu;
+
+	if (!nova_lat_hist)
+		return;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(nova_lat_hist, cpu), 0, NOVA_LAT_HIST_SIZE);
+}
+
+/* Largest latency in ns that falls into bucket b */
+static u64 nova_lat_bucket_max(unsigned int b)
+{
+	unsigned int next = b + 1;
+
+	if (next < (1 << NOVA_LAT_SUB_BITS))
+		return b;
+	if (next >= NOVA_LAT_BUCKETS)
+		return U64_MAX;
+	return ((u64)((1 << NOVA_LAT_SUB_BITS) +
+		      (next & ((1 << NOVA_LAT_SUB_BITS) - 1))) <<
+		((next >> NOVA_LAT_SUB_BITS) - 1)) - 1;
+}
+
+/*
+ * Sum the histogram of timing category name over all CPUs into hist, which
+ * holds NOVA_LAT_BUCKETS counters, and look up the latencies below which
+ * quantile[i] out of 100000 samples fall. Returns the number of samples,
+ * *max is the bound of the slowest one.
+ */
+u64 nova_lat_hist_quantiles(int name, u64 *hist, const u32 *quantile,
+	u64 *lat, int num, u64 *max)
+{
+	int slot = nova_lat_hist_slot[name];
+	u64 count = 0, seen = 0, rank;
+	unsigned int b;
+	int cpu, i = 0;
+
+	*max = 0;
+	memset(lat, 0, sizeof(u64) * num);
+	if (slot < 0)
+		return 0;
+
+	memset(hist, 0, sizeof(u64) * NOVA_LAT_BUCKETS);
+	for_each_possible_cpu(cpu) {
+		u64 *h = per_cpu_ptr(nova_lat_hist, cpu) +
+				slot * NOVA_LAT_BUCKETS;
+
+		for (b = 0; b < NOVA_LAT_BUCKETS; b++)
+			hist[b] += h[b];
+	}
+	for (b = 0; b < NOVA_LAT_BUCKETS; b++)
+		count += hist[b];
+	if (count == 0)
+		return 0;
+
+	for (b = 0; b < NOVA_LAT_BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		seen += hist[b];
+		*max = nova_lat_bucket_max(b);
+		while (i < num) {
+			rank = DIV_ROUND_UP(count * quantile[i], 100000);
+			if (seen < rank)
+				break;
+			lat[i++] = *max;
+		}
+	}
+	return count;
+}
+
 static void nova_print_alloc_stats(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -215,8 +333,10 @@ static void nova_print_alloc_stats(struct super_block *sb)
 
 		alloc_log_count += free_list->alloc_log_count;
 		alloc_log_pages += free_list->alloc_log_pages;
-		alloc_data_count += free_list->alloc_data_count;
-		alloc_data_pages += free_list->alloc_data_pages;
+		alloc_data_count += free_list->alloc_data_count +
+				    free_list->mag_alloc_blocks;
+		alloc_data_pages += free_list->alloc_data_pages +
+				    free_list->mag_alloc_blocks;
 		free_log_count += free_list->free_log_count;
 		freed_log_pages += free_list->freed_log_pages;
 		free_data_count += free_list->free_data_count;
@@ -281,6 +401,32 @@ void nova_get_IO_stats(void)
 	}
 }
 
+/* Sum a single timing category without touching the global arrays */
+u64 nova_sum_timing_stat(int name, u64 *count)
+{
+	u64 timing = 0;
+	int cpu;
+
+	*count = 0;
+	for_each_possible_cpu(cpu) {
+		timing += per_cpu(Timingstats_percpu[name], cpu);
+		*count += per_cpu(Countstats_percpu[name], cpu);
+	}
+
+	return timing;
+}
+
+u64 nova_sum_IO_stat(int name)
+{
+	u64 value = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		value += per_cpu(IOstats_percpu[name], cpu);
+
+	return value;
+}
+
 void nova_print_timing_stats(struct super_block *sb)
 {
 	int i;
@@ -328,6 +474,7 @@ static void nova_clear_timing_stats(void)
 			per_cpu(Countstats_percpu[i], cpu) = 0;
 		}
 	}
+	nova_lat_hist_clear();
 }
 
 static void nova_clear_IO_stats(struct super_block *sb)
@@ -350,6 +497,7 @@ static void nova_clear_IO_stats(struct super_block *sb)
 		free_list->alloc_log_pages = 0;
 		free_list->alloc_data_count = 0;
 		free_list->alloc_data_pages = 0;
+		free_list->mag_alloc_blocks = 0;
 		free_list->free_log_count = 0;
 		free_list->freed_log_pages = 0;
 		free_list->free_data_count = 0;
@@ -695,8 +843,10 @@ void nova_print_free_lists(struct super_block *sb)
 			 i,
 			 free_list->alloc_log_count,
 			 free_list->alloc_log_pages,
-			 free_list->alloc_data_count,
-			 free_list->alloc_data_pages,
+			 free_list->alloc_data_count +
+				free_list->mag_alloc_blocks,
+			 free_list->alloc_data_pages +
+				free_list->mag_alloc_blocks,
 			 free_list->free_log_count,
 			 free_list->freed_log_pages,
 			 free_list->free_data_count,
@@ -172,6 +172,8 @@ enum timing_category {
 	non_fin_calc_t,
 	ws_fin_calc_t,
 	str_fin_calc_t,
+	verify_cmp_t,
+	huge_dedup_t,
 
 	/* Sentinel */
 	TIMING_NUM,
@@ -198,6 +200,28 @@ enum stats_category {
 	dax_new_blocks,
 	inplace_new_blocks,
 	fdatasync,
+	weak_filter_skip,
+	fp_cache_hit,
+	fp_cache_miss,
+	verify_cmp_mismatch,
+	dedup_race_discard,
+	huge_dedup_hit,
+	dedup_protect_skip,
+	entry_reclaim_sync,
+	entry_alloc_throttle,
+	entry_alloc_fail,
+	entry_table_grow,
+	entry_ref_pinned,
+	index_evictions,
+	index_evicted_miss,
+	pindex_full,
+	weak_table_hit,
+	weak_table_miss,
+	strong_table_hit,
+	strong_table_miss,
+	dedup_off_blocks,
+	dedup_logical_blocks,
+	dedup_stored_blocks,
 
 	/* Sentinel */
 	STATS_NUM,
@@ -211,6 +235,46 @@ DECLARE_PER_CPU(u64[TIMING_NUM], Countstats_percpu);
 extern u64 IOstats[STATS_NUM];
 DECLARE_PER_CPU(u64[STATS_NUM], IOstats_percpu);
 
+/*
+ * Latency histograms, kept for a few categories with measure_timing at
+ * NOVA_TIMING_HIST or above. Buckets are log-linear: every power of two of
+ * nanoseconds is split into 2^NOVA_LAT_SUB_BITS buckets, so a reported
+ * percentile is at most 1/8 above the real one.
+ */
+#define NOVA_TIMING_HIST	2
+#define NOVA_LAT_SUB_BITS	3
+#define NOVA_LAT_MAX_SHIFT	36	/* ~68s, longer samples are clamped */
+#define NOVA_LAT_BUCKETS	\
+	((NOVA_LAT_MAX_SHIFT - NOVA_LAT_SUB_BITS + 2) << NOVA_LAT_SUB_BITS)
+#define NOVA_LAT_HIST_NUM	12
+
+extern const enum timing_category nova_lat_hist_names[NOVA_LAT_HIST_NUM];
+extern s8 nova_lat_hist_slot[TIMING_NUM];	/* -1 without a histogram */
+extern u64 __percpu *nova_lat_hist;
+
+static inline unsigned int nova_lat_bucket(u64 ns)
+{
+	unsigned int shift;
+
+	if (ns < (1 << NOVA_LAT_SUB_BITS))
+		return ns;
+	shift = fls64(ns) - 1;
+	if (shift > NOVA_LAT_MAX_SHIFT)
+		return NOVA_LAT_BUCKETS - 1;
+	return ((shift - NOVA_LAT_SUB_BITS + 1) << NOVA_LAT_SUB_BITS) +
+		((ns >> (shift - NOVA_LAT_SUB_BITS)) &
+		 ((1 << NOVA_LAT_SUB_BITS) - 1));
+}
+
+static inline void nova_lat_hist_add(int name, u64 ns)
+{
+	int slot = nova_lat_hist_slot[name];
+
+	if (slot >= 0)
+		__this_cpu_inc(nova_lat_hist[slot * NOVA_LAT_BUCKETS +
+					     nova_lat_bucket(ns)]);
+}
+
 typedef struct timespec timing_t;
 
 #define	INIT_TIMING(X)	timing_t X = {0}
@@ -221,10 +285,13 @@ typedef struct timespec timing_t;
 #define NOVA_END_TIMING(name, start) \
 	{if (measure_timing) { \
 		INIT_TIMING(end); \
+		u64 __ns; \
 		getrawmonotonic(&end); \
-		__this_cpu_add(Timingstats_percpu[name], \
-			(end.tv_sec - start.tv_sec) * 1000000000 + \
-			(end.tv_nsec - start.tv_nsec)); \
+		__ns = (end.tv_sec - start.tv_sec) * 1000000000 + \
+			(end.tv_nsec - start.tv_nsec); \
+		__this_cpu_add(Timingstats_percpu[name], __ns); \
+		if (measure_timing >= NOVA_TIMING_HIST) \
+			nova_lat_hist_add(name, __ns); \
 	} \
 	__this_cpu_add(Countstats_percpu[name], 1); \
 	}
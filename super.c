@@ -45,6 +45,9 @@
 #include "entry.h"
 #include "dedup.h"
 
+#define CREATE_TRACE_POINTS
+#include "nova_trace.h"
+
 int measure_timing;
 int metadata_csum;
 int wprotect;
@@ -54,7 +57,7 @@ int dram_struct_csum;
 int support_clwb;
 
 module_param(measure_timing, int, 0444);
-MODULE_PARM_DESC(measure_timing, "Timing measurement");
+MODULE_PARM_DESC(measure_timing, "Timing measurement, 2 adds latency histograms");
 
 module_param(metadata_csum, int, 0444);
 MODULE_PARM_DESC(metadata_csum, "Protect metadata structures with replication and checksums");
@@ -183,7 +186,9 @@ static loff_t nova_max_size(int bits)
 
 enum {
 	Opt_bpi, Opt_init, Opt_snapshot, Opt_mode, Opt_uid,
-	Opt_gid, Opt_dax, Opt_data_cow, Opt_wprotect,
+	Opt_gid, Opt_dax, Opt_data_cow, Opt_wprotect, Opt_dedup_verify,
+	Opt_dedup, Opt_dedup_huge, Opt_dedup_index_mb, Opt_dedup_pindex,
+	Opt_dedup_compact,
 	Opt_err_cont, Opt_err_panic, Opt_err_ro,
 	Opt_dbgmask, Opt_err
 };
@@ -198,6 +203,12 @@ static const match_table_t tokens = {
 	{ Opt_dax,	     "dax"		  },
 	{ Opt_data_cow,	     "data_cow"		  },
 	{ Opt_wprotect,	     "wprotect"		  },
+	{ Opt_dedup_verify,  "dedup_verify"	  },
+	{ Opt_dedup,	     "dedup=%s"		  },
+	{ Opt_dedup_huge,    "dedup_huge"	  },
+	{ Opt_dedup_index_mb, "dedup_index_mb=%u" },
+	{ Opt_dedup_pindex,  "dedup_pindex"	  },
+	{ Opt_dedup_compact, "dedup_compact"	  },
 	{ Opt_err_cont,	     "errors=continue"	  },
 	{ Opt_err_panic,     "errors=panic"	  },
 	{ Opt_err_ro,	     "errors=remount-ro"  },
@@ -212,6 +223,7 @@ static int nova_parse_options(char *options, struct nova_sb_info *sbi,
 	substring_t args[MAX_OPT_ARGS];
 	int option;
 	kuid_t uid;
+	char *name;
 
 	if (!options)
 		return 0;
@@ -288,6 +300,48 @@ static int nova_parse_options(char *options, struct nova_sb_info *sbi,
 			set_opt(sbi->s_mount_opt, PROTECT);
 			nova_info("NOVA: Enabling new Write Protection (CR0.WP)\n");
 			break;
+		case Opt_dedup_verify:
+			set_opt(sbi->s_mount_opt, DEDUP_VERIFY);
+			nova_info("Confirm weak fingerprint hits by compare\n");
+			break;
+		case Opt_dedup:
+			name = match_strdup(&args[0]);
+			if (!name)
+				return -ENOMEM;
+			option = nova_dedup_parse_mode(name,
+					&sbi->dedup_ctl.pinned_mode);
+			kfree(name);
+			if (option)
+				goto bad_val;
+			break;
+		case Opt_dedup_huge:
+			set_opt(sbi->s_mount_opt, DEDUP_HUGE);
+			nova_info("Dedup aligned 2MB extents as a whole\n");
+			break;
+		case Opt_dedup_index_mb:
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			/* the index is sized at mount */
+			if (remount && option != sbi->index_budget_mb)
+				goto bad_opt;
+			sbi->index_budget_mb = option;
+			break;
+		case Opt_dedup_pindex:
+			/* the index is laid out at format */
+			if (remount &&
+			    !(sbi->s_mount_opt & NOVA_MOUNT_DEDUP_PINDEX))
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, DEDUP_PINDEX);
+			nova_info("Keep the fingerprint index in PMEM\n");
+			break;
+		case Opt_dedup_compact:
+			/* the entry size is fixed at format */
+			if (remount &&
+			    !(sbi->s_mount_opt & NOVA_MOUNT_DEDUP_COMPACT))
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, DEDUP_COMPACT);
+			nova_info("Format 32B dedup entries\n");
+			break;
 		case Opt_dbgmask:
 			if (match_int(&args[0], &option))
 				goto bad_val;
@@ -390,6 +444,50 @@ static inline void nova_update_mount_time(struct super_block *sb)
 	nova_sync_super(sb);
 }
 
+/*
+ * Lay out the dedup area of the reserved blocks from sbi->num_blocks and
+ * the dedup_compact and dedup_pindex options, at format and again on every
+ * mount so the free lists leave it alone.
+ */
+static void nova_dedup_layout(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	/*
+	* Author:Hsiao
+	* Reserve space for deduplication metadata entry
+	*
+	* Only the directory of the entry table is reserved, the table grows a
+	* block at a time from the data blocks as entries are needed.
+	*/
+	sbi->entry_shift = test_opt(sb, DEDUP_COMPACT) ?
+			   NOVA_CENTRY_SHIFT : NOVA_ENTRY_SHIFT;
+	sbi->metadata_start = sbi->head_reserved_blocks;
+	sbi->num_entries = round_up(sbi->num_blocks, NOVA_ENTRY_CHUNK_ENTRIES(sbi));
+	sbi->num_entries_blocks = DIV_ROUND_UP((sbi->num_entries >> NOVA_ENTRY_CHUNK_SHIFT(sbi)) *
+					       sizeof(__le64), PAGE_SIZE);
+	sbi->head_reserved_blocks += sbi->num_entries_blocks;
+	/* then a block of refcounts that outgrew a compact entry */
+	if (test_opt(sb, DEDUP_COMPACT))
+		sbi->entry_ext_start = sbi->head_reserved_blocks++;
+
+	// nova_dbg("sbi->num_blocks:%lu metadata_start:%lu num_entries_block:%lu head_reserved_blocks:%lu",sbi->num_blocks, sbi->metadata_start, sbi->num_entries_blocks, sbi->head_reserved_blocks);
+
+	sbi->num_entries_bits = 32 - __builtin_clz(sbi->num_entries);
+
+	/* The PMEM index, weak then strong table, follows the entry directory */
+	if (test_opt(sb, DEDUP_PINDEX)) {
+		if (test_opt(sb, DEDUP_HUGE)) {
+			nova_warn("dedup_huge is not supported with dedup_pindex\n");
+			clear_opt(sbi->s_mount_opt, DEDUP_HUGE);
+		}
+		sbi->pindex_start = sbi->head_reserved_blocks;
+		sbi->pindex_blocks = 2 * (nova_pindex_size(sbi->num_entries_bits,
+					HASH_TABLE_LOCK_BITS) >> PAGE_SHIFT);
+		sbi->head_reserved_blocks += sbi->pindex_blocks;
+	}
+}
+
 static struct nova_inode *nova_init(struct super_block *sb,
 				      unsigned long size)
 {
@@ -400,51 +498,26 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	struct nova_inode_update update;
 	u64 epoch_id;
 	int retval;
-	size_t sz;
-	unsigned long i = 0;
 	INIT_TIMING(init_time);
 
 	NOVA_START_TIMING(new_init_t, init_time);
 	nova_info("creating an empty nova of size %lu\n", size);
 	sbi->num_blocks = ((unsigned long)(size) >> PAGE_SHIFT);
 
-	/*
-	* Author:Hsiao
-	* Reserve space for deduplication metadata entry
-	*/
-	sbi->metadata_start = sbi->head_reserved_blocks;
-	sbi->num_entries_blocks = ( ( sbi->num_blocks * sizeof(struct nova_pmm_entry) ) >> PAGE_SHIFT ) + 1 ;
-	sbi->head_reserved_blocks += sbi->num_entries_blocks;
-
-	// nova_dbg("sbi->num_blocks:%lu metadata_start:%lu num_entries_block:%lu head_reserved_blocks:%lu",sbi->num_blocks, sbi->metadata_start, sbi->num_entries_blocks, sbi->head_reserved_blocks);
+	nova_dedup_layout(sb);
 
 	/**
 	 * INIT_HASH_TABLE
 	 **/
-	sbi->num_entries = ( sbi->num_entries_blocks << PAGE_SHIFT ) / sizeof(struct nova_pmm_entry) ;
-	sbi->num_entries_bits = 32 - __builtin_clz(sbi->num_entries);
-	sz = 1 << sbi->num_entries_bits;
-	for (i = 0; i < HASH_TABLE_LOCK_NUM; ++i)
-		spin_lock_init(sbi->weak_hash_table_locks + i);
-	sbi->weak_hash_table = vzalloc(sizeof(struct hlist_head) * sz);
-	for (i = 0; i < HASH_TABLE_LOCK_NUM; ++i)
-		spin_lock_init(sbi->strong_hash_table_locks + i);
-	sbi->strong_hash_table = vzalloc(sizeof(struct hlist_head) * sz);
-	sbi->blocknr_to_entry = vzalloc(sizeof(u64) * sz);
-	for (i = 0; i < sz; i++)
-		sbi->blocknr_to_entry[i] = -1;
-	for (i = 0; i < NON_DEDUP_FP_LOCK_NUM; i++)
-		spin_lock_init(sbi->non_dedup_fp_locks + i);
-	sbi->dup_block = 0;
-	sbi->dedup_mode = NON_FIN;
-	nova_info("sbi->dup_block : %u sbi->dedup_mode: %u SAMPLE_BLOCK: %u NON_FIN: %u STR_FIN:%u", sbi->dup_block, NON_FIN, SAMPLE_BLOCK, NON_FIN_THRESH, STR_FIN_THRESH);
+	retval = nova_dedup_init_index(sb);
+	if (retval < 0)
+		return ERR_PTR(retval);
+	nova_info("dedup mode %s, sample %u blocks, NON_FIN thresh %u%%, STR_FIN thresh %u%%\n",
+		  nova_dedup_mode_name(sbi->dedup_ctl.pinned_mode),
+		  sbi->dedup_ctl.sample_blocks, sbi->dedup_ctl.non_fin_thresh,
+		  sbi->dedup_ctl.str_fin_thresh);
 	// nova_dbg("sbi->num_entries:%lu sbi->num_entries_bits:%lu",sbi->num_entries,sbi->num_entries_bits);
 
-	for(i = 0; i < sz; ++i) {
-		INIT_HLIST_HEAD(&sbi->weak_hash_table[i]);
-		INIT_HLIST_HEAD(&sbi->strong_hash_table[i]);
-	}
-	
 	/**
 	 * INIT_METADATA_FREELIST
 	 **/
@@ -455,13 +528,6 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	retval = nova_calc_non_fin_thread_init(sb);
 	if(retval < 0)
 		return ERR_PTR(retval);
-	
-
-    sbi->nova_hentry_cachep = kmem_cache_create("nova_hentry_cache",
-                                                sizeof(struct nova_hentry),
-                                                0, 0, NULL);
-    if(sbi->nova_hentry_cachep == NULL)
-        return ERR_PTR(-ENOMEM);
 
 	nova_dbgv("nova: Default block size set to 4K\n");
 	sbi->blocksize = blocksize = NOVA_DEF_BLOCK_SIZE_4K;
@@ -514,24 +580,18 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	sbi->nova_sb->s_metadata_csum = metadata_csum;
 	sbi->nova_sb->s_data_csum = data_csum;
 	sbi->nova_sb->s_data_parity = data_parity;
+	sbi->nova_sb->s_dedup_flags = (sbi->pindex_blocks ? NOVA_SB_DEDUP_PINDEX : 0) |
+		(sbi->entry_ext_start ? NOVA_SB_DEDUP_COMPACT : 0);
 	nova_update_super_crc(sb);
 
 	if( nova_fp_strong_ctx_init(&sbi->nova_fp_strong_ctx) < 0 ) {
 		nova_warn("strong fp init failed");
 	}
 
-	if( nova_fp_weak_ctx_init(&sbi->nova_fp_weak_ctx) < 0 ) {
-		nova_warn("weak fp init failed");
-	}
-
 	if( nova_fp_strong_ctx_init(&sbi->nova_non_fin_calc_str_ctx) < 0 ) {
 		nova_warn("non_fin_calc_str fp init failed");
 	}
 
-	if( nova_fp_weak_ctx_init(&sbi->nova_non_fin_calc_weak_ctx) < 0 ) {
-		nova_warn("non_fin_calc_weak fp init failed");
-	}
-
 	nova_sync_super(sb);
 
 	root_i = nova_get_inode_by_ino(sb, NOVA_ROOT_INO);
@@ -573,6 +633,7 @@ static inline void set_default_opts(struct nova_sb_info *sbi)
 	nova_info("%d cpus online\n", sbi->cpus);
 	sbi->map_id = 0;
 	sbi->snapshot_si = NULL;
+	nova_dedup_init_ctl(sbi);
 }
 
 static void nova_root_check(struct super_block *sb, struct nova_inode *root_pi)
@@ -630,6 +691,39 @@ static int nova_check_module_params(struct super_block *sb)
 	return 0;
 }
 
+/*
+ * The dedup options that shape the reserved area come from the format
+ * mount. Take them from s_dedup_flags and redo its layout; asking for a
+ * layout the image was not formatted with fails the mount.
+ */
+static int nova_check_dedup_flags(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	u8 flags = sbi->nova_sb->s_dedup_flags;
+
+	if (test_opt(sb, DEDUP_PINDEX) && !(flags & NOVA_SB_DEDUP_PINDEX)) {
+		nova_err(sb, "dedup_pindex needs an image formatted with it\n");
+		return -EINVAL;
+	}
+	if (test_opt(sb, DEDUP_COMPACT) && !(flags & NOVA_SB_DEDUP_COMPACT)) {
+		nova_err(sb, "dedup_compact needs an image formatted with it\n");
+		return -EINVAL;
+	}
+
+	if (flags & NOVA_SB_DEDUP_PINDEX) {
+		nova_dbg("Fingerprint index in PMEM\n");
+		set_opt(sbi->s_mount_opt, DEDUP_PINDEX);
+	}
+	if (flags & NOVA_SB_DEDUP_COMPACT) {
+		nova_dbg("32B dedup entries\n");
+		set_opt(sbi->s_mount_opt, DEDUP_COMPACT);
+	}
+
+	sbi->num_blocks = le64_to_cpu(sbi->nova_sb->s_size) >> PAGE_SHIFT;
+	nova_dedup_layout(sb);
+	return 0;
+}
+
 static int nova_check_integrity(struct super_block *sb)
 {
 	struct nova_super_block *super = nova_get_super(sb);
@@ -812,6 +906,10 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 	}
 
+	retval = nova_check_dedup_flags(sb);
+	if (retval)
+		goto out;
+
 	if (nova_lite_journal_soft_init(sb)) {
 		retval = -EINVAL;
 		nova_err(sb, "Lite journal initialization failed\n");
@@ -957,6 +1055,19 @@ static int nova_show_options(struct seq_file *seq, struct dentry *root)
 		seq_puts(seq, ",wprotect");
 	if (test_opt(root->d_sb, DAX))
 		seq_puts(seq, ",dax");
+	if (test_opt(root->d_sb, DEDUP_VERIFY))
+		seq_puts(seq, ",dedup_verify");
+	if (test_opt(root->d_sb, DEDUP_HUGE))
+		seq_puts(seq, ",dedup_huge");
+	if (test_opt(root->d_sb, DEDUP_PINDEX))
+		seq_puts(seq, ",dedup_pindex");
+	if (test_opt(root->d_sb, DEDUP_COMPACT))
+		seq_puts(seq, ",dedup_compact");
+	if (sbi->index_budget_mb)
+		seq_printf(seq, ",dedup_index_mb=%u", sbi->index_budget_mb);
+	if (sbi->dedup_ctl.pinned_mode)
+		seq_printf(seq, ",dedup=%s",
+			   nova_dedup_mode_name(sbi->dedup_ctl.pinned_mode));
 
 	return 0;
 }
@@ -998,10 +1109,7 @@ static void nova_put_super(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct inode_map *inode_map;
-	int i, i_hlist;
-	size_t sz;
-	struct hlist_head *hlist;
-	struct nova_hentry *hentry;
+	int i;
 
 	nova_print_curr_epoch_id(sb);
 
@@ -1013,38 +1121,16 @@ static void nova_put_super(struct super_block *sb)
 		
 		kmem_cache_free(nova_inode_cachep, sbi->snapshot_si);
 		nova_save_inode_list_to_log(sb);
+		/* Unused magazine blocks must be free in the saved map */
+		nova_drain_block_magazines(sb);
 		/* Save everything before blocknode mapping! */
 		nova_save_blocknode_mappings_to_log(sb);
 		sbi->virt_addr = NULL;
 	}
 
 	nova_fp_hash_ctx_free(&sbi->nova_fp_strong_ctx);
-	nova_fp_hash_ctx_free(&sbi->nova_fp_weak_ctx);
-	nova_fp_hash_ctx_free(&sbi->nova_non_fin_calc_weak_ctx);
 	nova_free_entry_list(sb);
-	sz = 1 << sbi->num_entries_bits;
-	
-	for(i_hlist = 0; i_hlist < sz; ++i_hlist) {
-		hlist = &sbi->weak_hash_table[i_hlist];
-		while( !hlist_empty(hlist) ) {
-			hentry = hlist_entry_safe(hlist->first, typeof(*hentry), node);
-			hlist_del(&hentry->node);
-			kmem_cache_free(sbi->nova_hentry_cachep, hentry);
-		}
-	}
-
-	for(i_hlist = 0; i_hlist < sz; ++i_hlist) {
-		hlist = &sbi->strong_hash_table[i_hlist];
-		while( !hlist_empty(hlist) ) {
-			hentry = hlist_entry_safe(hlist->first, typeof(*hentry), node);
-			hlist_del(&hentry->node);
-			kmem_cache_free(sbi->nova_hentry_cachep, hentry);
-		}
-	}
-	vfree(sbi->weak_hash_table);
-	vfree(sbi->strong_hash_table);
-	vfree(sbi->blocknr_to_entry);
-	kmem_cache_destroy(sbi->nova_hentry_cachep);
+	nova_dedup_free_index(sb);
 
 	nova_delete_free_lists(sb);
 
@@ -1356,10 +1442,14 @@ static int __init init_nova_fs(void)
 		sizeof(struct nova_setattr_logentry),
 		sizeof(struct nova_link_change_entry));
 
-	rc = init_rangenode_cache();
+	rc = nova_lat_hist_init();
 	if (rc)
 		return rc;
 
+	rc = init_rangenode_cache();
+	if (rc)
+		goto out0;
+
 	rc = init_inodecache();
 	if (rc)
 		goto out1;
@@ -1386,6 +1476,8 @@ out2:
 	destroy_inodecache();
 out1:
 	destroy_rangenode_cache();
+out0:
+	nova_lat_hist_exit();
 	return rc;
 }
 
@@ -1397,6 +1489,7 @@ static void __exit exit_nova_fs(void)
 	destroy_snapshot_info_cache();
 	destroy_inodecache();
 	destroy_rangenode_cache();
+	nova_lat_hist_exit();
 }
 
 MODULE_AUTHOR("Andiry Xu <jix024@cs.ucsd.edu>");
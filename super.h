@@ -1,6 +1,9 @@
 #ifndef __SUPER_H
 #define __SUPER_H
 #include "fingerprint.h"
+#include "filter.h"
+#include "fpcache.h"
+#include "pindex.h"
 #include <linux/kfifo.h>
 /*
  * Structure of the NOVA super block in PMEM
@@ -35,7 +38,7 @@ struct nova_super_block {
 	__le32		s_wtime;		/* write time */
 
 	/* Metadata and data protections */
-	u8		s_padding8;
+	u8		s_dedup_flags;		/* NOVA_SB_DEDUP_*, set at format */
 	u8		s_metadata_csum;
 	u8		s_data_csum;
 	u8		s_data_parity;
@@ -43,6 +46,10 @@ struct nova_super_block {
 
 #define NOVA_SB_SIZE 512       /* must be power of two */
 
+/* s_dedup_flags */
+#define NOVA_SB_DEDUP_PINDEX	0x01	/* fingerprint index in PMEM */
+#define NOVA_SB_DEDUP_COMPACT	0x02	/* 32B entries, see nova_pmm_centry */
+
 /* ======================= Reserved blocks ========================= */
 
 /*
@@ -94,6 +101,38 @@ struct nova_super_block {
 
 #define NON_DEDUP_FP_LOCK_BITS 6
 #define NON_DEDUP_FP_LOCK_NUM (1 << NON_DEDUP_FP_LOCK_BITS)
+
+enum nova_dedup_cost {
+	DEDUP_COST_WEAK,
+	DEDUP_COST_STRONG,
+	DEDUP_COST_HASH,
+	DEDUP_COST_WRITE,
+	DEDUP_COST_NUM,
+};
+
+/*
+ * Dedup mode controller. Costs are smoothed per-block nanoseconds taken
+ * from the NV-Dedup timers, last_* hold the timer sums seen at the end of
+ * the previous sample.
+ */
+struct nova_dedup_ctl {
+	spinlock_t lock;
+	u32 pinned_mode;		/* set by dedup=, 0 for auto */
+	unsigned int sample_blocks;
+	unsigned int non_fin_thresh;
+	unsigned int str_fin_thresh;
+	unsigned int hysteresis;
+	unsigned int probe_interval;
+	unsigned int parallel_fp_kb;	/* writes fingerprinted in parallel, 0 off */
+	unsigned int non_fin_samples;
+	unsigned int dup_percent;
+	unsigned int cache_hit_percent;
+	u64 cost[DEDUP_COST_NUM];
+	u64 last_time[DEDUP_COST_NUM];
+	u64 last_count[DEDUP_COST_NUM];
+	u64 last_cache_hit;
+	u64 last_cache_miss;
+};
 /*
  * NOVA super-block data in DRAM
  */
@@ -181,30 +220,53 @@ struct nova_sb_info {
 	struct free_list *free_lists;
 	unsigned long per_list_blocks;
 	struct nova_fp_hash_ctx nova_fp_strong_ctx;
-	struct nova_fp_hash_ctx nova_fp_weak_ctx;
-	struct nova_fp_hash_ctx nova_non_fin_calc_weak_ctx;
 	struct nova_fp_hash_ctx nova_non_fin_calc_str_ctx;
 
-	unsigned long	metadata_start;
-	struct nova_entry_node *free_list_buf;
+	unsigned long	metadata_start;		/* entry table directory */
+	struct nova_entry_chunk **entry_chunks;	/* the directory in DRAM */
+	unsigned long entry_nr_chunks;		/* under entry_grow_lock */
+	struct mutex entry_grow_lock;
+	unsigned int entry_shift;		/* log2 of the entry size */
+	unsigned long entry_ext_start;		/* refcount extension, compact only */
+	struct nova_centry_ext *entry_ext;
+	spinlock_t entry_ext_lock;
 	struct list_head meta_free_list;
 	struct spinlock free_list_lock;
-	unsigned long num_entries_blocks;
-	unsigned long num_entries;
+	unsigned long num_free_entries;		/* under free_list_lock */
+	struct nova_entry_reclaim *entry_reclaim;	/* per-CPU */
+	unsigned long num_entries_blocks;	/* of the directory */
+	unsigned long num_entries;		/* once the table is fully grown */
 	unsigned int num_entries_bits;
+	unsigned int index_bits;		/* hash table buckets */
+	unsigned int index_budget_mb;		/* dedup_index_mb=, 0 for none */
+	struct nova_index_slot *index_slots;	/* budgeted index only */
+	unsigned long index_nr_slots;
+	unsigned long index_hand;		/* CLOCK hand, under index_lock */
+	spinlock_t index_lock;
+	struct nova_filter evicted_filter;	/* weak fps evicted from DRAM */
+	unsigned long pindex_start;		/* PMEM index, dedup_pindex */
+	unsigned long pindex_blocks;
+	struct nova_pindex weak_pindex;
+	struct nova_pindex strong_pindex;
 	struct spinlock weak_hash_table_locks[HASH_TABLE_LOCK_NUM];
 	struct hlist_head *weak_hash_table;
+	struct nova_filter weak_filter;
 	struct spinlock strong_hash_table_locks[HASH_TABLE_LOCK_NUM];
 	struct hlist_head *strong_hash_table;
+	struct nova_fp_cache fp_cache;
+	struct workqueue_struct *fp_wq;		/* parallel fingerprinting */
+	struct hlist_head *huge_hash_table;	/* 2MB extents, strong locks */
+	unsigned int huge_table_bits;
 	int64_t *blocknr_to_entry;
 	struct spinlock non_dedup_fp_locks[HASH_TABLE_LOCK_NUM];
 	u32 dup_block;
 	u32 cur_block;
 	u32 dedup_mode;
+	struct nova_dedup_ctl dedup_ctl;
 	struct task_struct *calc_non_fin_thread;
 	wait_queue_head_t calc_non_fin_wait;
 	int should_non_fin_thread_done;
-	struct kmem_cache *nova_hentry_cachep;
+	struct nova_hentry *hentries;
 };
 
 static inline struct nova_sb_info *NOVA_SB(struct super_block *sb)
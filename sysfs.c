@@ -20,6 +20,7 @@
 
 #include "nova.h"
 #include "inode.h"
+#include "dedup.h"
 
 const char *proc_dirname = "fs/NOVA";
 struct proc_dir_entry *nova_proc_root;
@@ -82,6 +83,61 @@ static const struct file_operations nova_seq_timing_fops = {
 	.release	= single_release,
 };
 
+static const u32 nova_lat_quantiles[] = { 50000, 99000, 99900 };
+
+static int nova_seq_latency_hist_show(struct seq_file *seq, void *v)
+{
+	u64 lat[ARRAY_SIZE(nova_lat_quantiles)];
+	u64 *hist;
+	u64 count, max;
+	int i;
+
+	seq_puts(seq, "=========== NOVA latency histograms ===========\n\n");
+	if (measure_timing < NOVA_TIMING_HIST) {
+		seq_printf(seq, "Load the module with measure_timing=%d to keep latency histograms\n",
+			   NOVA_TIMING_HIST);
+		return 0;
+	}
+
+	hist = kmalloc_array(NOVA_LAT_BUCKETS, sizeof(u64), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	for (i = 0; i < NOVA_LAT_HIST_NUM; i++) {
+		count = nova_lat_hist_quantiles(nova_lat_hist_names[i], hist,
+				nova_lat_quantiles, lat,
+				ARRAY_SIZE(nova_lat_quantiles), &max);
+		seq_printf(seq, "%s: count %llu, p50 %llu, p99 %llu, p999 %llu, max %llu (ns)\n",
+			   Timingstring[nova_lat_hist_names[i]], count,
+			   lat[0], lat[1], lat[2], max);
+	}
+
+	kfree(hist);
+	seq_puts(seq, "\n");
+	return 0;
+}
+
+static int nova_seq_latency_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_latency_hist_show, PDE_DATA(inode));
+}
+
+static ssize_t nova_seq_clear_latency_hist(struct file *filp,
+	const char __user *buf, size_t len, loff_t *ppos)
+{
+	nova_lat_hist_clear();
+	return len;
+}
+
+static const struct file_operations nova_seq_latency_hist_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_latency_hist_open,
+	.read		= seq_read,
+	.write		= nova_seq_clear_latency_hist,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int nova_seq_IO_show(struct seq_file *seq, void *v)
 {
 	struct super_block *sb = seq->private;
@@ -107,8 +163,10 @@ static int nova_seq_IO_show(struct seq_file *seq, void *v)
 
 		alloc_log_count += free_list->alloc_log_count;
 		alloc_log_pages += free_list->alloc_log_pages;
-		alloc_data_count += free_list->alloc_data_count;
-		alloc_data_pages += free_list->alloc_data_pages;
+		alloc_data_count += free_list->alloc_data_count +
+				    free_list->mag_alloc_blocks;
+		alloc_data_pages += free_list->alloc_data_pages +
+				    free_list->mag_alloc_blocks;
 		free_log_count += free_list->free_log_count;
 		freed_log_pages += free_list->freed_log_pages;
 		free_data_count += free_list->free_data_count;
@@ -174,6 +232,27 @@ static int nova_seq_IO_show(struct seq_file *seq, void *v)
 			IOstats[mapping_updated_pages]);
 	seq_printf(seq, "fsync %llu, fdatasync %llu\n",
 			Countstats[fsync_t], IOstats[fdatasync]);
+	seq_printf(seq, "Dedup weak filter negatives %llu\n",
+			IOstats[weak_filter_skip]);
+	seq_printf(seq, "Dedup fp cache hit %llu, miss %llu, hit rate %llu%%\n",
+			IOstats[fp_cache_hit], IOstats[fp_cache_miss],
+			IOstats[fp_cache_hit] + IOstats[fp_cache_miss] ?
+			IOstats[fp_cache_hit] * 100 /
+			(IOstats[fp_cache_hit] + IOstats[fp_cache_miss]) : 0);
+	seq_printf(seq, "Dedup verify compare %llu, mismatch %llu\n",
+			Countstats[verify_cmp_t], IOstats[verify_cmp_mismatch]);
+	seq_printf(seq, "Dedup racing new blocks discarded %llu\n",
+			IOstats[dedup_race_discard]);
+	seq_printf(seq, "Dedup 2MB extents %llu, shared %llu\n",
+			Countstats[huge_dedup_t], IOstats[huge_dedup_hit]);
+	seq_printf(seq, "Dedup hits with csum/parity skipped %llu\n",
+			IOstats[dedup_protect_skip]);
+	seq_printf(seq, "Dedup entries free %lu, pending reclaim %lu, sync reclaims %llu, throttled allocs %llu, failed allocs %llu, table grown %llu, pinned %llu\n",
+			READ_ONCE(sbi->num_free_entries),
+			sbi->entry_reclaim ? nova_entry_reclaim_pending(sb) : 0,
+			IOstats[entry_reclaim_sync], IOstats[entry_alloc_throttle],
+			IOstats[entry_alloc_fail], IOstats[entry_table_grow],
+			IOstats[entry_ref_pinned]);
 
 	seq_puts(seq, "\n");
 
@@ -235,8 +314,10 @@ static int nova_seq_show_allocator(struct seq_file *seq, void *v)
 			   i,
 			   free_list->alloc_log_count,
 			   free_list->alloc_log_pages,
-			   free_list->alloc_data_count,
-			   free_list->alloc_data_pages,
+			   free_list->alloc_data_count +
+				free_list->mag_alloc_blocks,
+			   free_list->alloc_data_pages +
+				free_list->mag_alloc_blocks,
 			   free_list->free_log_count,
 			   free_list->freed_log_pages,
 			   free_list->free_data_count,
@@ -246,6 +327,7 @@ static int nova_seq_show_allocator(struct seq_file *seq, void *v)
 		log_pages -= free_list->freed_log_pages;
 
 		data_pages += free_list->alloc_data_pages;
+		data_pages += free_list->mag_alloc_blocks;
 		data_pages -= free_list->freed_data_pages;
 	}
 
@@ -362,9 +444,12 @@ static const struct file_operations nova_seq_show_snapshots_fops = {
 /* ====================== Performance ======================== */
 static int nova_seq_test_perf_show(struct seq_file *seq, void *v)
 {
-	seq_printf(seq, "Echo function:poolmb:size:disks to test function performance working on size of data.\n"
+	seq_printf(seq, "Echo function:poolmb:size:disks[:threads[:fill[:dup]]] to test function performance working on size of data.\n"
 			"    example: echo 1:128:4096:8 > /proc/fs/NOVA/pmem0/test_perf\n"
 			"The disks value only matters for raid functions.\n"
+			"threads runs the function on that many cpus at once (default 1).\n"
+			"fill is the percent of index buckets filled before the index functions (default 50),\n"
+			"dup the percent of index lookups and dedup writes that hit existing data (default 0).\n"
 			"Set function to 0 to test all functions.\n");
 	return 0;
 }
@@ -380,11 +465,16 @@ ssize_t nova_seq_test_perf(struct file *filp, const char __user *buf,
 	struct address_space *mapping = filp->f_mapping;
 	struct inode *inode = mapping->host;
 	struct super_block *sb = PDE_DATA(inode);
-	size_t size;
-	unsigned int func_id, poolmb, disks;
-
-	if (sscanf(buf, "%u:%u:%zu:%u", &func_id, &poolmb, &size, &disks) == 4)
-		nova_test_perf(sb, func_id, poolmb, size, disks);
+	struct nova_perf_params params = {
+		.threads = 1,
+		.fill = 50,
+		.dup = 0,
+	};
+
+	if (sscanf(buf, "%u:%u:%zu:%u:%u:%u:%u", &params.func_id,
+		   &params.poolmb, &params.size, &params.disks,
+		   &params.threads, &params.fill, &params.dup) >= 4)
+		nova_test_perf(sb, &params);
 	else
 		nova_warn("Couldn't parse test_perf request: %s", buf);
 
@@ -495,6 +585,204 @@ static const struct file_operations nova_seq_gc_fops = {
 	.release	= single_release,
 };
 
+/* ====================== Dedup tunables ======================== */
+
+
+static int nova_seq_dedup_tunables_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_dedup_ctl *ctl = &sbi->dedup_ctl;
+
+	seq_printf(seq, "sample_blocks %u\n", ctl->sample_blocks);
+	seq_printf(seq, "non_fin_thresh %u\n", ctl->non_fin_thresh);
+	seq_printf(seq, "str_fin_thresh %u\n", ctl->str_fin_thresh);
+	seq_printf(seq, "hysteresis %u\n", ctl->hysteresis);
+	seq_printf(seq, "probe_interval %u\n", ctl->probe_interval);
+	seq_printf(seq, "parallel_fp_kb %u\n", ctl->parallel_fp_kb);
+	seq_printf(seq, "\npinned %s, current mode %s, last duplicate ratio %u%%, fp cache hit %u%%\n",
+		   nova_dedup_mode_name(ctl->pinned_mode),
+		   nova_dedup_mode_name(sbi->dedup_mode),
+		   ctl->dup_percent, ctl->cache_hit_percent);
+	seq_printf(seq, "block cost (ns): weak fp %llu, strong fp %llu, hash table %llu, alloc+write %llu\n",
+		   ctl->cost[DEDUP_COST_WEAK], ctl->cost[DEDUP_COST_STRONG],
+		   ctl->cost[DEDUP_COST_HASH], ctl->cost[DEDUP_COST_WRITE]);
+	seq_printf(seq, "\nEcho \"name value\" to change a tunable\n"
+		   "    example: echo hysteresis 20 > /proc/fs/NOVA/pmem0/dedup_tunables\n");
+	return 0;
+}
+
+static int nova_seq_dedup_tunables_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_dedup_tunables_show, PDE_DATA(inode));
+}
+
+ssize_t nova_seq_dedup_tunables(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	struct address_space *mapping = filp->f_mapping;
+	struct inode *inode = mapping->host;
+	struct super_block *sb = PDE_DATA(inode);
+	struct nova_dedup_ctl *ctl = &NOVA_SB(sb)->dedup_ctl;
+	char _buf[64], name[32];
+	unsigned int value;
+
+	if (len >= sizeof(_buf))
+		return -EINVAL;
+	if (copy_from_user(_buf, buf, len))
+		return -EFAULT;
+	_buf[len] = 0;
+
+	if (sscanf(_buf, "%31s %u", name, &value) != 2)
+		goto bad;
+
+	spin_lock(&ctl->lock);
+	if (!strcmp(name, "sample_blocks") && value > 0)
+		ctl->sample_blocks = value;
+	else if (!strcmp(name, "non_fin_thresh") && value <= 100)
+		ctl->non_fin_thresh = value;
+	else if (!strcmp(name, "str_fin_thresh") && value <= 100)
+		ctl->str_fin_thresh = value;
+	else if (!strcmp(name, "hysteresis") && value < 100)
+		ctl->hysteresis = value;
+	else if (!strcmp(name, "probe_interval") && value > 0)
+		ctl->probe_interval = value;
+	else if (!strcmp(name, "parallel_fp_kb"))
+		ctl->parallel_fp_kb = value;
+	else {
+		spin_unlock(&ctl->lock);
+		goto bad;
+	}
+	spin_unlock(&ctl->lock);
+
+	return len;
+bad:
+	nova_warn("Couldn't parse dedup_tunables request: %s", _buf);
+	return -EINVAL;
+}
+
+static const char *nova_dedup_hist_labels[NOVA_DEDUP_HIST_SLOTS] = {
+	"0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+",
+};
+
+static void nova_seq_dedup_hist(struct seq_file *seq, const char *name,
+	u64 *hist)
+{
+	int i;
+
+	seq_printf(seq, "%s:", name);
+	for (i = 0; i < NOVA_DEDUP_HIST_SLOTS; i++)
+		seq_printf(seq, " %s %llu%s", nova_dedup_hist_labels[i],
+			   hist[i], i < NOVA_DEDUP_HIST_SLOTS - 1 ? "," : "");
+	seq_puts(seq, "\n");
+}
+
+static int nova_seq_dedup_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	u64 hist[NOVA_DEDUP_HIST_SLOTS];
+	u64 logical, stored;
+	unsigned long allocated, free_entries, pending, nodes;
+	u64 lookups, lost;
+
+	nova_get_timing_stats();
+	nova_get_IO_stats();
+
+	seq_puts(seq, "============ NV-Dedup stats ============\n\n");
+	/* The index is only built by nova_init, on a format mount */
+	if (!sbi->blocknr_to_entry || !sbi->entry_reclaim) {
+		seq_puts(seq, "dedup index not initialized\n\n");
+		return 0;
+	}
+	seq_printf(seq, "Current mode %s, pinned %s\n",
+		   nova_dedup_mode_name(sbi->dedup_mode),
+		   nova_dedup_mode_name(sbi->dedup_ctl.pinned_mode));
+	seq_printf(seq, "Blocks: non_fin %llu, weak_str_fin %llu, str_fin %llu, off %llu, 2MB extents %llu\n",
+		   Countstats[non_fin_calc_t], Countstats[ws_fin_calc_t],
+		   Countstats[str_fin_calc_t], IOstats[dedup_off_blocks],
+		   Countstats[huge_dedup_t]);
+	seq_printf(seq, "Weak table hit %llu, miss %llu (filter negatives %llu)\n",
+		   IOstats[weak_table_hit], IOstats[weak_table_miss],
+		   IOstats[weak_filter_skip]);
+	seq_printf(seq, "Strong table hit %llu, miss %llu\n",
+		   IOstats[strong_table_hit], IOstats[strong_table_miss]);
+	seq_printf(seq, "Fp cache hit %llu, miss %llu\n",
+		   IOstats[fp_cache_hit], IOstats[fp_cache_miss]);
+
+	logical = IOstats[dedup_logical_blocks] << PAGE_SHIFT;
+	stored = IOstats[dedup_stored_blocks] << PAGE_SHIFT;
+	seq_printf(seq, "Logical bytes %llu, physical bytes %llu, dedup ratio %llu.%02llu\n",
+		   logical, stored, stored ? logical / stored : 0,
+		   stored ? logical * 100 / stored % 100 : 0);
+
+	allocated = nova_entries_allocated(sbi);
+	free_entries = READ_ONCE(sbi->num_free_entries);
+	pending = sbi->entry_reclaim ? nova_entry_reclaim_pending(sb) : 0;
+	seq_printf(seq, "Entries %lu of %lu allocated, %luB each, %lu KB, free %lu, pending reclaim %lu\n",
+		   allocated, sbi->num_entries, 1UL << sbi->entry_shift,
+		   allocated << sbi->entry_shift >> 10,
+		   free_entries, pending);
+	nodes = sbi->index_nr_slots ? sbi->index_nr_slots : sbi->num_entries;
+	if (nova_dedup_pindex(sbi))
+		seq_printf(seq, "PMEM index %lu KB, %lu buckets per table, entries left out on full buckets %llu\n",
+			   sbi->pindex_blocks << (PAGE_SHIFT - 10),
+			   1UL << sbi->weak_pindex.bucket_bits,
+			   IOstats[pindex_full]);
+	else
+		seq_printf(seq, "Hentry pool %lu nodes, %lu KB, in use %lu\n",
+			   nodes, nodes * sizeof(struct nova_hentry) >> 10,
+			   allocated > free_entries + pending ?
+				allocated - free_entries - pending : 0);
+	if (sbi->index_slots) {
+		/* misses on evicted fingerprints, per 10000 weak lookups */
+		lookups = IOstats[weak_table_hit] + IOstats[weak_table_miss];
+		lost = lookups ? IOstats[index_evicted_miss] * 10000 / lookups : 0;
+		seq_printf(seq, "Index budget %u MB, %lu KB, evictions %llu, misses on evicted %llu (%llu.%02llu%% of lookups)\n",
+			   sbi->index_budget_mb,
+			   nodes * NOVA_INDEX_SLOT_BYTES >> 10,
+			   IOstats[index_evictions], IOstats[index_evicted_miss],
+			   lost / 100, lost % 100);
+	}
+
+	seq_printf(seq, "\nSampled over at most %d buckets or entries\n",
+		   NOVA_DEDUP_HIST_SAMPLE);
+	nova_dedup_chain_hist(sb, false, hist);
+	nova_seq_dedup_hist(seq, nova_dedup_pindex(sbi) ?
+			    "Weak bucket fill" : "Weak chain length", hist);
+	nova_dedup_chain_hist(sb, true, hist);
+	nova_seq_dedup_hist(seq, nova_dedup_pindex(sbi) ?
+			    "Strong bucket fill" : "Strong chain length", hist);
+	nova_dedup_refcount_hist(sb, hist);
+	nova_seq_dedup_hist(seq, "Entry refcount", hist);
+
+	seq_puts(seq, "\n");
+	return 0;
+}
+
+static int nova_seq_dedup_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_dedup_show, PDE_DATA(inode));
+}
+
+static const struct file_operations nova_seq_dedup_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_dedup_open,
+	.read		= seq_read,
+	.write		= nova_seq_clear_stats,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations nova_seq_dedup_tunables_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_dedup_tunables_open,
+	.read		= seq_read,
+	.write		= nova_seq_dedup_tunables,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /* ====================== Setup/teardown======================== */
 void nova_sysfs_init(struct super_block *sb)
 {
@@ -509,6 +797,8 @@ void nova_sysfs_init(struct super_block *sb)
 				 &nova_seq_timing_fops, sb);
 		proc_create_data("IO_stats", 0444, sbi->s_proc,
 				 &nova_seq_IO_fops, sb);
+		proc_create_data("latency_hist", 0444, sbi->s_proc,
+				 &nova_seq_latency_hist_fops, sb);
 		proc_create_data("allocator", 0444, sbi->s_proc,
 				 &nova_seq_allocator_fops, sb);
 		proc_create_data("create_snapshot", 0444, sbi->s_proc,
@@ -521,6 +811,10 @@ void nova_sysfs_init(struct super_block *sb)
 				 &nova_seq_test_perf_fops, sb);
 		proc_create_data("gc", 0444, sbi->s_proc,
 				 &nova_seq_gc_fops, sb);
+		proc_create_data("dedup_tunables", 0644, sbi->s_proc,
+				 &nova_seq_dedup_tunables_fops, sb);
+		proc_create_data("dedup", 0444, sbi->s_proc,
+				 &nova_seq_dedup_fops, sb);
 	}
 }
 
@@ -531,12 +825,15 @@ void nova_sysfs_exit(struct super_block *sb)
 	if (sbi->s_proc) {
 		remove_proc_entry("timing_stats", sbi->s_proc);
 		remove_proc_entry("IO_stats", sbi->s_proc);
+		remove_proc_entry("latency_hist", sbi->s_proc);
 		remove_proc_entry("allocator", sbi->s_proc);
 		remove_proc_entry("create_snapshot", sbi->s_proc);
 		remove_proc_entry("delete_snapshot", sbi->s_proc);
 		remove_proc_entry("snapshots", sbi->s_proc);
 		remove_proc_entry("test_perf", sbi->s_proc);
 		remove_proc_entry("gc", sbi->s_proc);
+		remove_proc_entry("dedup_tunables", sbi->s_proc);
+		remove_proc_entry("dedup", sbi->s_proc);
 		remove_proc_entry(sbi->s_bdev->bd_disk->disk_name,
 					nova_proc_root);
 	}
@@ -0,0 +1,192 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * libFuzzer harness for the user-space build of the NV-Dedup engine
+ *
+ * Every input mounts a small fresh pool and is decoded into writes and
+ * frees over a few block slots, so the index and refcount logic sees
+ * overwrites, duplicates and weak fingerprint collisions in any order.
+ * Each block is checked to hold what was written to it, and all blocks
+ * must be back in the pool once every slot is freed.
+ *
+ * The first byte picks the index layout: bit 0 the PMEM index, bit 1
+ * compact entries. Every following 3 bytes are one operation:
+ *
+ *   byte 0: bit 7 set frees the slot in bits 0-5, else writes to it
+ *   byte 1: bits 0-1 the dedup mode, bits 2-7 the content
+ *   byte 2: 0 for the content itself, else a variant of it with the same
+ *           weak fingerprint
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include "../dedup.h"
+
+#define FUZZ_POOL_SIZE		(16UL << 20)
+#define FUZZ_SLOTS		64
+#define FUZZ_MAX_OPS		4096
+
+struct fuzz_slot {
+	unsigned long blocknr;	/* 0 for an empty slot */
+	u8 content;
+	u8 variant;
+};
+
+static const u32 fuzz_modes[] = { NON_FIN, WEAK_STR_FIN, STR_FIN, DEDUP_OFF };
+
+#define fuzz_check(cond, fmt, args ...)					\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "fuzz_dedup: " fmt "\n", ## args); \
+			abort();					\
+		}							\
+	} while (0)
+
+static u32 fuzz_crc(const void *block)
+{
+	return nova_crc32c(NOVA_INIT_CSUM, block, PAGE_SIZE);
+}
+
+/*
+ * Set the last 4 bytes of block so that its weak fingerprint, a crc32c
+ * over the whole block, is target. The crc is affine in those bits, so
+ * this solves a 32x32 system over GF(2).
+ */
+static void fuzz_forge_weak(u8 *block, u32 target)
+{
+	u8 *tail = block + PAGE_SIZE - sizeof(u32);
+	u32 col[32], sol[32], base, want, x = 0, t;
+	int i, j, k;
+
+	memset(tail, 0, sizeof(u32));
+	base = fuzz_crc(block);
+	for (i = 0; i < 32; i++) {
+		sol[i] = 1U << i;
+		memcpy(tail, &sol[i], sizeof(u32));
+		col[i] = fuzz_crc(block) ^ base;
+	}
+
+	/* reduce col[k] to bit k, tracking which tail bits produce it */
+	for (k = 0; k < 32; k++) {
+		for (i = k; i < 32 && !(col[i] >> k & 1); i++)
+			;
+		if (i == 32)
+			return;
+		t = col[i]; col[i] = col[k]; col[k] = t;
+		t = sol[i]; sol[i] = sol[k]; sol[k] = t;
+		for (j = 0; j < 32; j++)
+			if (j != k && (col[j] >> k & 1)) {
+				col[j] ^= col[k];
+				sol[j] ^= sol[k];
+			}
+	}
+
+	want = target ^ base;
+	for (k = 0; k < 32; k++)
+		if (want >> k & 1)
+			x ^= sol[k];
+	memcpy(tail, &x, sizeof(u32));
+}
+
+static void fuzz_fill_seed(u8 *block, u64 seed)
+{
+	u64 state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE; i += sizeof(u64)) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		memcpy(block + i, &state, sizeof(u64));
+	}
+}
+
+static void fuzz_fill(u8 *block, u8 content, u8 variant)
+{
+	u32 weak;
+
+	fuzz_fill_seed(block, content * 256);
+	if (variant == 0)
+		return;
+	weak = fuzz_crc(block);
+	fuzz_fill_seed(block, content * 256 + variant);
+	fuzz_forge_weak(block, weak);
+}
+
+static void fuzz_verify(struct super_block *sb, struct fuzz_slot *slot,
+	u8 *expect)
+{
+	fuzz_fill(expect, slot->content, slot->variant);
+	fuzz_check(!memcmp(nova_get_block(sb, nova_get_block_off(sb,
+				slot->blocknr, NOVA_BLOCK_TYPE_4K)),
+			   expect, PAGE_SIZE),
+		   "block %lu does not hold content %u variant %u",
+		   slot->blocknr, slot->content, slot->variant);
+}
+
+static void fuzz_free(struct super_block *sb, struct fuzz_slot *slot,
+	u8 *expect)
+{
+	if (slot->blocknr == 0)
+		return;
+	fuzz_verify(sb, slot, expect);
+	if (nova_dedup_free_block(sb, slot->blocknr))
+		nova_free_data_block(sb, slot->blocknr);
+	slot->blocknr = 0;
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+	static u8 block[PAGE_SIZE];
+	static u8 expect[PAGE_SIZE];
+	struct fuzz_slot slots[FUZZ_SLOTS] = { { 0 } };
+	struct nova_dedup_chunk chunk = { NULL };
+	struct fuzz_slot *slot;
+	struct super_block *sb;
+	unsigned long free_before, table_before, table_blocks, blocknr;
+	size_t i;
+	int ret;
+
+	if (size < 1 || size > 1 + 3 * FUZZ_MAX_OPS)
+		return 0;
+
+	nova_user_pindex = data[0] & 1;
+	nova_user_compact = !!(data[0] & 2);
+	sb = nova_user_mount(NULL, FUZZ_POOL_SIZE, 1, 0);
+	fuzz_check(sb, "cannot mount a %lu MB pool", FUZZ_POOL_SIZE >> 20);
+	free_before = nova_user_free_blocks(sb);
+	table_before = NOVA_SB(sb)->entry_nr_chunks;
+	chunk.data = (const char *)block;
+
+	for (i = 1; i + 3 <= size; i += 3) {
+		slot = &slots[data[i] % FUZZ_SLOTS];
+		fuzz_free(sb, slot, expect);
+		if (data[i] & 0x80)
+			continue;
+
+		fuzz_fill(block, data[i + 1] >> 2, data[i + 2]);
+		ret = nova_dedup_write_mode(sb, &chunk, &blocknr,
+					    fuzz_modes[data[i + 1] & 3]);
+		if (ret <= 0)
+			continue;
+		slot->blocknr = blocknr;
+		slot->content = data[i + 1] >> 2;
+		slot->variant = data[i + 2];
+		fuzz_verify(sb, slot, expect);
+	}
+
+	for (i = 0; i < FUZZ_SLOTS; i++)
+		fuzz_free(sb, &slots[i], expect);
+
+	/* the entry table keeps the blocks it grew into */
+	nova_drain_entry_reclaim(sb);
+	table_blocks = NOVA_SB(sb)->entry_nr_chunks - table_before;
+	fuzz_check(nova_user_free_blocks(sb) + table_blocks == free_before,
+		   "leaked %ld blocks", (long)(free_before - table_blocks -
+					  nova_user_free_blocks(sb)));
+
+	nova_user_umount(sb);
+	return 0;
+}
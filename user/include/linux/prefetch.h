@@ -0,0 +1,2 @@
+/* user-space build, see kshim.h */
+#include "../../kshim.h"
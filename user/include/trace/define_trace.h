@@ -0,0 +1 @@
+/* user-space build, tracepoints are stubbed in nova_user.h */
@@ -0,0 +1,727 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Runtime of the user-space build of the NV-Dedup engine: the file backed
+ * pool standing in for PMEM, a block allocator, threads, wait queues,
+ * workqueues, crc32c and the crypto shash API.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+#include "../dedup.h"
+
+int measure_timing;
+int data_csum;
+int data_parity;
+unsigned int nova_dbgmask;
+int nova_user_flush;
+unsigned int nova_user_index_mb;
+int nova_user_pindex;
+int nova_user_compact;
+int nova_user_cpus = 1;
+__thread int nova_user_cpu;
+
+/* ======================= Statistics ========================= */
+DEFINE_PER_CPU(u64[TIMING_NUM], Timingstats_percpu);
+DEFINE_PER_CPU(u64[TIMING_NUM], Countstats_percpu);
+DEFINE_PER_CPU(u64[STATS_NUM], IOstats_percpu);
+u64 Timingstats[TIMING_NUM];
+u64 Countstats[TIMING_NUM];
+u64 IOstats[STATS_NUM];
+
+/* No latency histograms in user space */
+s8 nova_lat_hist_slot[TIMING_NUM] = {[0 ... TIMING_NUM - 1] = -1};
+u64 __percpu *nova_lat_hist;
+
+/*
+ * Counters of the live threads, read like the kernel reads per-CPU
+ * counters of other CPUs. Exiting threads fold theirs into the totals.
+ */
+#define NOVA_USER_MAX_THREADS	1024
+
+struct nova_user_stats {
+	u64 *timing;
+	u64 *count;
+	u64 *io;
+};
+
+static struct nova_user_stats user_stats[NOVA_USER_MAX_THREADS];
+static __thread struct nova_user_stats *this_stats;
+static pthread_mutex_t user_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void nova_user_thread_init(int cpu)
+{
+	int i;
+
+	nova_user_cpu = cpu;
+	if (this_stats)
+		return;
+
+	pthread_mutex_lock(&user_stats_lock);
+	for (i = 0; i < NOVA_USER_MAX_THREADS; i++) {
+		if (user_stats[i].timing == NULL) {
+			this_stats = &user_stats[i];
+			this_stats->timing = Timingstats_percpu;
+			this_stats->count = Countstats_percpu;
+			this_stats->io = IOstats_percpu;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&user_stats_lock);
+}
+
+void nova_user_fold_stats(void)
+{
+	int i;
+
+	if (this_stats == NULL)
+		return;
+
+	pthread_mutex_lock(&user_stats_lock);
+	for (i = 0; i < TIMING_NUM; i++) {
+		Timingstats[i] += Timingstats_percpu[i];
+		Countstats[i] += Countstats_percpu[i];
+	}
+	for (i = 0; i < STATS_NUM; i++)
+		IOstats[i] += IOstats_percpu[i];
+	memset(this_stats, 0, sizeof(*this_stats));
+	this_stats = NULL;
+	pthread_mutex_unlock(&user_stats_lock);
+}
+
+u64 nova_sum_timing_stat(int name, u64 *count)
+{
+	u64 timing = Timingstats[name];
+	int i;
+
+	*count = Countstats[name];
+	for (i = 0; i < NOVA_USER_MAX_THREADS; i++) {
+		if (READ_ONCE(user_stats[i].timing) == NULL)
+			continue;
+		timing += READ_ONCE(user_stats[i].timing[name]);
+		*count += READ_ONCE(user_stats[i].count[name]);
+	}
+	return timing;
+}
+
+u64 nova_sum_IO_stat(int name)
+{
+	u64 value = IOstats[name];
+	int i;
+
+	for (i = 0; i < NOVA_USER_MAX_THREADS; i++)
+		if (READ_ONCE(user_stats[i].io) != NULL)
+			value += READ_ONCE(user_stats[i].io[name]);
+	return value;
+}
+
+/* ======================= crc32c ========================= */
+static u32 crc32c_table[256];
+
+static void crc32c_init_table(void)
+{
+	u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+		crc32c_table[i] = crc;
+	}
+}
+
+__attribute__((target("sse4.2")))
+static u32 crc32c_hw(u32 crc, const u8 *p, unsigned int len)
+{
+	u64 acc = crc;
+
+	for (; len >= 8; len -= 8, p += 8)
+		acc = __builtin_ia32_crc32di(acc, *(const u64 *)p);
+	for (; len > 0; len--, p++)
+		acc = __builtin_ia32_crc32qi(acc, *p);
+	return acc;
+}
+
+/* Like the kernel's crc32c(), no inversion before or after */
+u32 crc32c(u32 crc, const void *data, unsigned int len)
+{
+	const u8 *p = data;
+
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_hw(crc, p, len);
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+u32 nova_calc_block_stripe_csums(const u8 *block, u32 *crc)
+{
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		crc[i] = crc32c(NOVA_INIT_CSUM, block + i * (PAGE_SIZE / 8),
+				PAGE_SIZE / 8);
+	return crc32c(NOVA_INIT_CSUM, block, PAGE_SIZE);
+}
+
+int nova_update_block_csum_parity_precomputed(struct super_block *sb,
+	const u8 *block, unsigned long blocknr, const u32 *crc)
+{
+	return 0;
+}
+
+/* ======================= Crypto ========================= */
+struct crypto_shash {
+	const EVP_MD *md;
+};
+
+struct crypto_shash *crypto_alloc_shash(const char *alg_name, u32 type,
+	u32 mask)
+{
+	struct crypto_shash *tfm;
+	const EVP_MD *md = EVP_get_digestbyname(alg_name);
+
+	if (md == NULL)
+		return ERR_PTR(-ENOENT);
+	tfm = malloc(sizeof(*tfm));
+	if (tfm == NULL)
+		return ERR_PTR(-ENOMEM);
+	tfm->md = md;
+	return tfm;
+}
+
+void crypto_free_shash(struct crypto_shash *tfm)
+{
+	if (!IS_ERR(tfm))
+		free(tfm);
+}
+
+unsigned int crypto_shash_descsize(struct crypto_shash *tfm)
+{
+	return 0;
+}
+
+int crypto_shash_digest(struct shash_desc *desc, const u8 *data,
+	unsigned int len, u8 *out)
+{
+	return EVP_Digest(data, len, out, NULL, desc->tfm->md, NULL) ? 0 : -EINVAL;
+}
+
+/* ======================= Threads and waiting ========================= */
+static __thread struct task_struct *current_task;
+static __thread struct wait_queue_entry *current_wait;
+static int next_cpu;
+
+void init_waitqueue_head(wait_queue_head_t *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->seq = 0;
+	q->waiters = 0;
+}
+
+void prepare_to_wait(wait_queue_head_t *q, struct wait_queue_entry *wait,
+	int state)
+{
+	pthread_mutex_lock(&q->lock);
+	wait->head = q;
+	wait->seq = q->seq;
+	q->waiters++;
+	pthread_mutex_unlock(&q->lock);
+	current_wait = wait;
+	if (current_task)
+		current_task->waiting = q;
+}
+
+void finish_wait(wait_queue_head_t *q, struct wait_queue_entry *wait)
+{
+	pthread_mutex_lock(&q->lock);
+	q->waiters--;
+	pthread_mutex_unlock(&q->lock);
+	wait->head = NULL;
+	current_wait = NULL;
+	if (current_task)
+		current_task->waiting = NULL;
+}
+
+/*
+ * Sleeps until a wake up or kthread_stop() after prepare_to_wait(). A
+ * running thread has no one to yield the cpu to, so it returns at once.
+ */
+void schedule(void)
+{
+	struct wait_queue_entry *wait = current_wait;
+	wait_queue_head_t *q;
+
+	if (wait == NULL || wait->head == NULL)
+		return;
+
+	q = wait->head;
+	pthread_mutex_lock(&q->lock);
+	while (q->seq == wait->seq &&
+	       !(current_task && current_task->should_stop))
+		pthread_cond_wait(&q->cond, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void wake_up_interruptible(wait_queue_head_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->seq++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+int waitqueue_active(wait_queue_head_t *q)
+{
+	return READ_ONCE(q->waiters) > 0;
+}
+
+static void *kthread_main(void *arg)
+{
+	struct task_struct *task = arg;
+
+	current_task = task;
+	nova_user_thread_init(__sync_fetch_and_add(&next_cpu, 1) %
+			      nova_user_cpus);
+	task->fn(task->data);
+	nova_user_fold_stats();
+	return NULL;
+}
+
+struct task_struct *kthread_create(int (*fn)(void *), void *data,
+	const char *namefmt, ...)
+{
+	struct task_struct *task = calloc(1, sizeof(*task));
+	va_list args;
+
+	if (task == NULL)
+		return ERR_PTR(-ENOMEM);
+	task->fn = fn;
+	task->data = data;
+	va_start(args, namefmt);
+	vsnprintf(task->comm, sizeof(task->comm), namefmt, args);
+	va_end(args);
+	return task;
+}
+
+void wake_up_process(struct task_struct *task)
+{
+	if (pthread_create(&task->thread, NULL, kthread_main, task)) {
+		nova_warn("%s: cannot start %s\n", __func__, task->comm);
+		return;
+	}
+	pthread_setname_np(task->thread, task->comm);
+}
+
+int kthread_stop(struct task_struct *task)
+{
+	wait_queue_head_t *q;
+
+	task->should_stop = 1;
+	smp_mb();
+	q = READ_ONCE(task->waiting);
+	if (q)
+		wake_up_interruptible(q);
+	pthread_join(task->thread, NULL);
+	free(task);
+	return 0;
+}
+
+bool kthread_should_stop(void)
+{
+	return current_task && current_task->should_stop;
+}
+
+/* ======================= Workqueues ========================= */
+struct workqueue_struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* work queued, or stopping */
+	pthread_cond_t done;		/* work finished */
+	struct list_head works;
+	int stop;
+	int nr_workers;
+	pthread_t *workers;
+};
+
+static void *worker_main(void *arg)
+{
+	struct workqueue_struct *wq = arg;
+	struct work_struct *work;
+
+	nova_user_thread_init(__sync_fetch_and_add(&next_cpu, 1) %
+			      nova_user_cpus);
+	pthread_mutex_lock(&wq->lock);
+	for (;;) {
+		while (list_empty(&wq->works) && !wq->stop)
+			pthread_cond_wait(&wq->cond, &wq->lock);
+		if (list_empty(&wq->works))
+			break;
+		work = list_first_entry(&wq->works, struct work_struct, entry);
+		list_del(&work->entry);
+		pthread_mutex_unlock(&wq->lock);
+
+		work->func(work);
+
+		pthread_mutex_lock(&wq->lock);
+		work->done = 1;
+		pthread_cond_broadcast(&wq->done);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	nova_user_fold_stats();
+	return NULL;
+}
+
+/* One worker per cpu, as WQ_UNBOUND would give */
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+	int max_active, ...)
+{
+	struct workqueue_struct *wq = calloc(1, sizeof(*wq));
+	int i;
+
+	if (wq == NULL)
+		return NULL;
+	wq->workers = calloc(nova_user_cpus, sizeof(pthread_t));
+	if (wq->workers == NULL) {
+		free(wq);
+		return NULL;
+	}
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	pthread_cond_init(&wq->done, NULL);
+	INIT_LIST_HEAD(&wq->works);
+	for (i = 0; i < nova_user_cpus; i++) {
+		if (pthread_create(&wq->workers[i], NULL, worker_main, wq))
+			break;
+		wq->nr_workers++;
+	}
+	if (wq->nr_workers == 0) {
+		destroy_workqueue(wq);
+		return NULL;
+	}
+	return wq;
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	int i;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = 1;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+	for (i = 0; i < wq->nr_workers; i++)
+		pthread_join(wq->workers[i], NULL);
+	free(wq->workers);
+	free(wq);
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	pthread_mutex_lock(&wq->lock);
+	work->wq = wq;
+	work->done = 0;
+	list_add_tail(&work->entry, &wq->works);
+	pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+	return true;
+}
+
+bool flush_work(struct work_struct *work)
+{
+	struct workqueue_struct *wq = work->wq;
+
+	pthread_mutex_lock(&wq->lock);
+	while (!work->done)
+		pthread_cond_wait(&wq->done, &wq->lock);
+	pthread_mutex_unlock(&wq->lock);
+	return true;
+}
+
+/* ======================= Blocks ========================= */
+/*
+ * Data blocks are kept on per-cpu free stacks like the NOVA free lists.
+ * 2MB superpages come from their own aligned region at the end of the
+ * pool so they never fragment the 4K stacks.
+ */
+struct nova_user_blocks {
+	spinlock_t lock;
+	unsigned long *stack;
+	unsigned long num;
+};
+
+/* unistd.h stays out, its fdatasync() clashes with the stats.h enum */
+struct nova_user_pool {
+	FILE *file;
+	size_t size;
+	struct nova_user_blocks *lists;
+	struct nova_user_blocks huge;
+};
+
+static int nova_user_pop(struct nova_user_blocks *list, unsigned long *blocknr)
+{
+	int ret = -ENOSPC;
+
+	spin_lock(&list->lock);
+	if (list->num) {
+		*blocknr = list->stack[--list->num];
+		ret = 0;
+	}
+	spin_unlock(&list->lock);
+	return ret;
+}
+
+static void nova_user_push(struct nova_user_blocks *list, unsigned long blocknr)
+{
+	spin_lock(&list->lock);
+	list->stack[list->num++] = blocknr;
+	spin_unlock(&list->lock);
+}
+
+/* The pool stands in for the NOVA free lists in sbi->free_lists */
+static struct nova_user_pool *nova_user_get_pool(struct super_block *sb)
+{
+	return (struct nova_user_pool *)NOVA_SB(sb)->free_lists;
+}
+
+static int nova_user_list_of(struct super_block *sb, unsigned long blocknr)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	return (blocknr - sbi->head_reserved_blocks) / sbi->per_list_blocks;
+}
+
+int nova_new_data_block(struct super_block *sb, unsigned long *blocknr,
+	enum nova_alloc_init zero)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_user_pool *pool = nova_user_get_pool(sb);
+	int cpu = nova_get_cpuid(sb), i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		if (nova_user_pop(&pool->lists[(cpu + i) % sbi->cpus],
+				  blocknr) == 0) {
+			if (zero == ALLOC_INIT_ZERO)
+				memset(nova_get_block(sb, nova_get_block_off(sb,
+					*blocknr, NOVA_BLOCK_TYPE_4K)), 0,
+					PAGE_SIZE);
+			return 1;
+		}
+	}
+	return -ENOSPC;
+}
+
+int nova_free_data_block(struct super_block *sb, unsigned long blocknr)
+{
+	struct nova_user_pool *pool = nova_user_get_pool(sb);
+
+	nova_user_push(&pool->lists[nova_user_list_of(sb, blocknr)], blocknr);
+	return 0;
+}
+
+int nova_new_data_superpage(struct super_block *sb, unsigned long *blocknr)
+{
+	return nova_user_pop(&nova_user_get_pool(sb)->huge, blocknr);
+}
+
+int nova_free_data_superpage(struct super_block *sb, unsigned long blocknr)
+{
+	nova_user_push(&nova_user_get_pool(sb)->huge, blocknr);
+	return 0;
+}
+
+unsigned long nova_user_free_blocks(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_user_pool *pool = nova_user_get_pool(sb);
+	unsigned long free = 0;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++)
+		free += READ_ONCE(pool->lists[i].num);
+	return free;
+}
+
+static int nova_user_init_blocks(struct super_block *sb,
+	struct nova_user_pool *pool)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long start, end, huge_start, blocknr;
+	int i;
+
+	/* an eighth of the pool, 2MB aligned, holds the superpages */
+	end = sbi->num_blocks;
+	huge_start = (end - end / 8) & ~(NOVA_HUGE_BLOCKS - 1);
+	if (huge_start < sbi->head_reserved_blocks)
+		huge_start = end;
+	start = sbi->head_reserved_blocks;
+
+	pool->lists = calloc(sbi->cpus, sizeof(*pool->lists));
+	if (pool->lists == NULL)
+		return -ENOMEM;
+	sbi->per_list_blocks = DIV_ROUND_UP(huge_start - start, sbi->cpus);
+	for (i = 0; i < sbi->cpus; i++) {
+		spin_lock_init(&pool->lists[i].lock);
+		pool->lists[i].stack = malloc(sizeof(unsigned long) *
+					      sbi->per_list_blocks);
+		if (pool->lists[i].stack == NULL)
+			return -ENOMEM;
+	}
+	/* pushed high to low, so each list hands out its low blocks first */
+	for (blocknr = huge_start; blocknr-- > start; )
+		nova_free_data_block(sb, blocknr);
+
+	spin_lock_init(&pool->huge.lock);
+	pool->huge.stack = malloc(sizeof(unsigned long) *
+				  ((end - huge_start) / NOVA_HUGE_BLOCKS + 1));
+	if (pool->huge.stack == NULL)
+		return -ENOMEM;
+	for (blocknr = huge_start; blocknr + NOVA_HUGE_BLOCKS <= end;
+	     blocknr += NOVA_HUGE_BLOCKS)
+		nova_free_data_superpage(sb, blocknr);
+	return 0;
+}
+
+static void nova_user_free_pool(struct nova_sb_info *sbi,
+	struct nova_user_pool *pool)
+{
+	int i;
+
+	if (pool->lists)
+		for (i = 0; i < sbi->cpus; i++)
+			free(pool->lists[i].stack);
+	free(pool->lists);
+	free(pool->huge.stack);
+	if (sbi->virt_addr)
+		munmap(sbi->virt_addr, pool->size);
+	if (pool->file)
+		fclose(pool->file);
+	free(pool);
+}
+
+/* ======================= Mount ========================= */
+/*
+ * Lay out a fresh pool the way nova_init() does and bring the dedup
+ * index, the entry free list and the NON_FIN thread up on it. path NULL
+ * uses anonymous memory. dedup_mode pins the mode, 0 leaves it adaptive.
+ * nova_user_index_mb, nova_user_pindex and nova_user_compact stand in for
+ * the dedup_index_mb, dedup_pindex and dedup_compact mount options.
+ */
+struct super_block *nova_user_mount(const char *path, unsigned long size,
+	int cpus, u32 dedup_mode)
+{
+	struct super_block *sb;
+	struct nova_sb_info *sbi;
+	struct nova_user_pool *pool;
+	int flags = MAP_SHARED;
+
+	crc32c_init_table();
+	nova_user_cpus = cpus;
+	nova_user_thread_init(0);
+
+	sb = calloc(1, sizeof(*sb));
+	sbi = calloc(1, sizeof(*sbi));
+	pool = calloc(1, sizeof(*pool));
+	if (!sb || !sbi || !pool)
+		goto out_free;
+	sb->s_fs_info = sbi;
+	sbi->sb = sb;
+	sbi->free_lists = (struct free_list *)pool;
+	pool->size = size;
+
+	if (path) {
+		pool->file = fopen(path, "w+");
+		if (pool->file == NULL ||
+		    posix_fallocate(fileno(pool->file), 0, size)) {
+			nova_warn("%s: cannot size %s\n", __func__, path);
+			goto out_free;
+		}
+	} else {
+		flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	}
+	sbi->virt_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags,
+			      path ? fileno(pool->file) : -1, 0);
+	if (sbi->virt_addr == MAP_FAILED) {
+		sbi->virt_addr = NULL;
+		goto out_free;
+	}
+	sbi->initsize = size;
+	sbi->cpus = cpus;
+	sbi->head_reserved_blocks = HEAD_RESERVED_BLOCKS;
+	sbi->num_blocks = size >> PAGE_SHIFT;
+	sbi->index_budget_mb = nova_user_index_mb;
+	nova_dedup_init_ctl(sbi);
+	sbi->dedup_ctl.pinned_mode = dedup_mode;
+	if (dedup_mode)
+		sbi->dedup_mode = dedup_mode;
+
+	/* as nova_init() */
+	sbi->entry_shift = nova_user_compact ? NOVA_CENTRY_SHIFT : NOVA_ENTRY_SHIFT;
+	sbi->metadata_start = sbi->head_reserved_blocks;
+	sbi->num_entries = round_up(sbi->num_blocks, NOVA_ENTRY_CHUNK_ENTRIES(sbi));
+	sbi->num_entries_blocks = DIV_ROUND_UP((sbi->num_entries >> NOVA_ENTRY_CHUNK_SHIFT(sbi)) *
+					       sizeof(__le64), PAGE_SIZE);
+	sbi->head_reserved_blocks += sbi->num_entries_blocks;
+	if (nova_user_compact)
+		sbi->entry_ext_start = sbi->head_reserved_blocks++;
+	sbi->num_entries_bits = 32 - __builtin_clz(sbi->num_entries);
+	memset(nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start,
+		NOVA_BLOCK_TYPE_4K)), 0,
+	       (sbi->head_reserved_blocks - sbi->metadata_start) << PAGE_SHIFT);
+	if (nova_user_pindex) {
+		sbi->pindex_start = sbi->head_reserved_blocks;
+		sbi->pindex_blocks = 2 * (nova_pindex_size(sbi->num_entries_bits,
+					HASH_TABLE_LOCK_BITS) >> PAGE_SHIFT);
+		sbi->head_reserved_blocks += sbi->pindex_blocks;
+		memset(nova_get_block(sb, nova_get_block_off(sb,
+			sbi->pindex_start, NOVA_BLOCK_TYPE_4K)), 0,
+		       sbi->pindex_blocks << PAGE_SHIFT);
+	}
+
+	if (nova_fp_strong_ctx_init(&sbi->nova_fp_strong_ctx) < 0 ||
+	    nova_fp_strong_ctx_init(&sbi->nova_non_fin_calc_str_ctx) < 0)
+		goto out_free;
+	if (nova_user_init_blocks(sb, pool) < 0)
+		goto out_free;
+	if (nova_dedup_init_index(sb) < 0)
+		goto out_free;
+	if (nova_init_entry_list(sb) < 0)
+		goto out_index;
+	if (nova_calc_non_fin_thread_init(sb) < 0)
+		goto out_entry;
+	return sb;
+
+out_entry:
+	nova_free_entry_list(sb);
+out_index:
+	nova_dedup_free_index(sb);
+out_free:
+	if (pool)
+		nova_user_free_pool(sbi, pool);
+	free(sbi);
+	free(sb);
+	return NULL;
+}
+
+void nova_user_umount(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	nova_calc_non_fin_stop(sb);
+	nova_free_entry_list(sb);
+	nova_dedup_free_index(sb);
+	nova_fp_hash_ctx_free(&sbi->nova_fp_strong_ctx);
+	nova_fp_hash_ctx_free(&sbi->nova_non_fin_calc_str_ctx);
+	nova_user_free_pool(sbi, nova_user_get_pool(sb));
+	free(sbi);
+	free(sb);
+}
@@ -0,0 +1,389 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Kernel API shims for the user-space build of the NV-Dedup engine
+ *
+ * Only what dedup.c, entry.c, filter.c and fpcache.c use is provided.
+ * Spinlocks are pthread spinlocks, per-CPU counters are per-thread, and
+ * the crypto shash API is backed by OpenSSL digests of the same name.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#ifndef __NOVA_KSHIM_H
+#define __NOVA_KSHIM_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ======================= Types ========================= */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef u16 __le16;
+typedef u32 __le32;
+typedef u64 __le64;
+typedef u64 phys_addr_t;
+typedef unsigned int gfp_t;
+typedef unsigned short umode_t;
+typedef struct { unsigned int val; } kuid_t;
+typedef struct { unsigned int val; } kgid_t;
+typedef struct { int counter; } atomic_t;
+
+#define __user
+#define __percpu
+#define __packed	__attribute__((packed))
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+#define PAGE_MASK	(~(PAGE_SIZE - 1))
+
+#define cpu_to_le16(x)	(x)
+#define cpu_to_le32(x)	(x)
+#define cpu_to_le64(x)	(x)
+#define le16_to_cpu(x)	(x)
+#define le32_to_cpu(x)	(x)
+#define le64_to_cpu(x)	(x)
+
+/* ======================= Helpers ========================= */
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define round_up(n, d)		(DIV_ROUND_UP(n, d) * (d))
+
+#define U32_MAX		((u32)~0U)
+#define U64_MAX		((u64)~0ULL)
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min3(a, b, c)	min(min(a, b), c)
+#define min_t(t, a, b)	((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)	((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+
+#define READ_ONCE(x)	(*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x) *)&(x) = (v))
+#define cmpxchg(p, o, n)	__sync_val_compare_and_swap(p, o, n)
+#define barrier()	__asm__ __volatile__("" ::: "memory")
+#define smp_mb()	__sync_synchronize()
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+#define prefetch(x)	__builtin_prefetch(x)
+#define prefetchw(x)	__builtin_prefetch(x, 1)
+
+#define BUG_ON(c)	do { if (c) abort(); } while (0)
+#define WARN_ON(c)	({ int __c = !!(c); if (__c) \
+	fprintf(stderr, "WARN_ON %s:%d\n", __FILE__, __LINE__); __c; })
+
+#define MAX_ERRNO	4095
+#define IS_ERR_VALUE(x)	((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr) { return IS_ERR_VALUE(ptr); }
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	return n <= 1 ? 1 : 1UL << fls64(n - 1);
+}
+
+#define ilog2(n)	(fls64(n) - 1)
+
+/* linux/hash.h */
+#define GOLDEN_RATIO_32	0x61C88647
+#define GOLDEN_RATIO_64	0x61C8864680B583EBull
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+static inline u32 hash_64(u64 val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_64) >> (64 - bits);
+}
+
+/* ======================= Printing ========================= */
+#define pr_info(fmt, ...)	printf(fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+
+/* ======================= Memory ========================= */
+#define GFP_KERNEL	0
+#define GFP_NOFS	0
+#define GFP_ATOMIC	0
+
+static inline void *kmalloc(size_t size, gfp_t flags) { return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t flags) { return calloc(1, size); }
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	return calloc(n, size);
+}
+static inline void kfree(const void *p) { free((void *)p); }
+static inline void *vmalloc(size_t size) { return malloc(size); }
+static inline void *vzalloc(size_t size) { return calloc(1, size); }
+static inline void vfree(const void *p) { free((void *)p); }
+
+/* ======================= Lists ========================= */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+	struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+static inline int hlist_unhashed(const struct hlist_node *h)
+{
+	return !h->pprev;
+}
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	WRITE_ONCE(h->first, n);
+	n->pprev = &h->first;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (hlist_unhashed(n))
+		return;
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	n->next = NULL;
+	n->pprev = NULL;
+}
+
+#define hlist_entry(ptr, type, member)	container_of(ptr, type, member)
+#define hlist_entry_safe(ptr, type, member) \
+	({ __typeof__(ptr) ____ptr = (ptr); \
+	   ____ptr ? hlist_entry(____ptr, type, member) : NULL; })
+#define hlist_for_each(pos, head) \
+	for (pos = (head)->first; pos; pos = pos->next)
+#define hlist_for_each_entry(pos, head, member) \
+	for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); \
+	     pos; \
+	     pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+
+/* ======================= Locks ========================= */
+struct spinlock {
+	pthread_spinlock_t lock;
+};
+typedef struct spinlock spinlock_t;
+
+#define spin_lock_init(l)	pthread_spin_init(&(l)->lock, PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(l)		pthread_spin_lock(&(l)->lock)
+#define spin_unlock(l)		pthread_spin_unlock(&(l)->lock)
+#define spin_trylock(l)		(pthread_spin_trylock(&(l)->lock) == 0)
+
+struct mutex {
+	pthread_mutex_t lock;
+};
+
+#define mutex_init(m)		pthread_mutex_init(&(m)->lock, NULL)
+#define mutex_lock(m)		pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m)		pthread_mutex_unlock(&(m)->lock)
+
+/* ======================= CPUs ========================= */
+extern int nova_user_cpus;
+extern __thread int nova_user_cpu;
+
+#define smp_processor_id()	nova_user_cpu
+#define raw_smp_processor_id()	nova_user_cpu
+#define get_cpu()		nova_user_cpu
+#define put_cpu()		do { } while (0)
+#define num_online_cpus()	((unsigned int)nova_user_cpus)
+
+/* Per-CPU data is per thread, nova_user_fold_stats() sums it up */
+#define DECLARE_PER_CPU(type, name)	extern __thread __typeof__(type) name
+#define DEFINE_PER_CPU(type, name)	__thread __typeof__(type) name
+#define __this_cpu_add(var, v)		((var) += (v))
+#define __this_cpu_inc(var)		((var)++)
+#define __this_cpu_read(var)		(var)
+#define __this_cpu_write(var, v)	((var) = (v))
+#define this_cpu_add(var, v)		__this_cpu_add(var, v)
+
+/* ======================= Time ========================= */
+#define getrawmonotonic(ts)	clock_gettime(CLOCK_MONOTONIC_RAW, ts)
+
+/* ======================= Threads and waiting ========================= */
+struct task_struct {
+	pthread_t thread;
+	int (*fn)(void *);
+	void *data;
+	volatile int should_stop;
+	struct wait_queue_head *waiting;	/* queue slept on, for kthread_stop */
+	char comm[16];
+};
+
+struct wait_queue_head {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long seq;
+	int waiters;
+};
+typedef struct wait_queue_head wait_queue_head_t;
+
+struct wait_queue_entry {
+	struct wait_queue_head *head;
+	unsigned long seq;
+};
+
+#define TASK_INTERRUPTIBLE	1
+#define DEFINE_WAIT(name)	struct wait_queue_entry name = { NULL, 0 }
+
+void init_waitqueue_head(wait_queue_head_t *q);
+void prepare_to_wait(wait_queue_head_t *q, struct wait_queue_entry *wait,
+	int state);
+void finish_wait(wait_queue_head_t *q, struct wait_queue_entry *wait);
+void schedule(void);
+void wake_up_interruptible(wait_queue_head_t *q);
+int waitqueue_active(wait_queue_head_t *q);
+
+struct task_struct *kthread_create(int (*fn)(void *), void *data,
+	const char *namefmt, ...);
+void wake_up_process(struct task_struct *task);
+int kthread_stop(struct task_struct *task);
+bool kthread_should_stop(void);
+#define kthread_run(fn, data, namefmt, ...) ({ \
+	struct task_struct *__k = kthread_create(fn, data, namefmt, \
+						 ##__VA_ARGS__); \
+	if (!IS_ERR(__k)) \
+		wake_up_process(__k); \
+	__k; })
+
+/* ======================= Workqueues ========================= */
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+	struct list_head entry;
+	work_func_t func;
+	struct workqueue_struct *wq;	/* queued on, for flush_work */
+	volatile int done;
+};
+
+struct workqueue_struct;
+
+#define WQ_UNBOUND	(1 << 1)
+#define WQ_HIGHPRI	(1 << 4)
+
+#define INIT_WORK(w, f)	do { \
+	INIT_LIST_HEAD(&(w)->entry); (w)->func = (f); \
+	(w)->wq = NULL; (w)->done = 0; \
+	} while (0)
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+	int max_active, ...);
+void destroy_workqueue(struct workqueue_struct *wq);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool flush_work(struct work_struct *work);
+
+/* ======================= Crypto ========================= */
+struct crypto_shash;
+
+struct shash_desc {
+	struct crypto_shash *tfm;
+	void *__ctx[];
+};
+
+struct crypto_shash *crypto_alloc_shash(const char *alg_name, u32 type,
+	u32 mask);
+void crypto_free_shash(struct crypto_shash *tfm);
+unsigned int crypto_shash_descsize(struct crypto_shash *tfm);
+int crypto_shash_digest(struct shash_desc *desc, const u8 *data,
+	unsigned int len, u8 *out);
+
+u32 crc32c(u32 crc, const void *data, unsigned int len);
+
+/* ======================= Opaque kernel objects ========================= */
+struct super_block {
+	void *s_fs_info;
+};
+
+struct radix_tree_root {
+	void *rnode;
+};
+
+struct kstatfs;
+struct dentry;
+struct proc_dir_entry;
+struct block_device;
+struct dax_device;
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Stand-in for nova.h in the user-space build of the NV-Dedup engine
+ *
+ * Force-included ahead of every source, it claims the nova.h, balloc.h,
+ * mprotect.h and nova_trace.h include guards and provides the part of
+ * them the dedup engine uses. Definitions here mirror nova.h and must be
+ * kept in step.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#ifndef __NOVA_USER_H
+#define __NOVA_USER_H
+
+#define __NOVA_H
+#define __BALLOC_H
+#define _TRACE_NOVA_H
+
+#include "kshim.h"
+#include "../stats.h"
+#include "../super.h"
+
+#define NOVA_BLOCK_TYPE_4K	0
+#define NOVA_MOUNT_DEDUP_VERIFY	0x000800
+#define NOVA_MOUNT_DEDUP_HUGE	0x001000
+#define NOVA_MOUNT_DEDUP_PINDEX	0x002000
+#define NOVA_MOUNT_DEDUP_COMPACT	0x004000
+#define CACHELINE_SIZE		(64)
+#define NOVA_INIT_CSUM		(1)
+
+/* Defaults of the dedup mode controller, as in nova.h */
+#define SAMPLE_BLOCK 64
+#define NON_FIN_THRESH 25
+#define STR_FIN_THRESH 65
+#define DEDUP_HYSTERESIS 10
+#define DEDUP_PROBE_INTERVAL 16
+#define DEDUP_PARALLEL_FP_KB 0
+
+#define DEDUP_WEAK_FP_COST 400
+#define DEDUP_STRONG_FP_COST 4000
+#define DEDUP_HASH_TABLE_COST 200
+#define DEDUP_WRITE_COST 1500
+
+#define NON_FIN 0x00000001
+#define WEAK_STR_FIN 0x00000002
+#define STR_FIN 0x00000004
+#define DEDUP_OFF 0x00000008
+
+extern unsigned int nova_dbgmask;
+#define NOVA_DBGMASK_VERBOSE	(0x00000010)
+
+#define nova_dbg(s, args ...)		pr_info(s, ## args)
+#define nova_warn(s, args ...)		pr_warn(s, ## args)
+#define nova_info(s, args ...)		pr_info(s, ## args)
+#define nova_dbg_verbose(s, args ...)		 \
+	((nova_dbgmask & NOVA_DBGMASK_VERBOSE) ? nova_dbg(s, ##args) : 0)
+#define nova_dbgv(s, args ...)	nova_dbg_verbose(s, ##args)
+
+#define test_opt(sb, opt)	(NOVA_SB(sb)->s_mount_opt & NOVA_MOUNT_ ## opt)
+
+extern int measure_timing;
+extern int data_csum;
+extern int data_parity;
+
+/* The pool is a file mapping, flushes cost what they cost on DRAM */
+extern int nova_user_flush;
+
+static inline void PERSISTENT_BARRIER(void)
+{
+	__asm__ __volatile__("sfence" ::: "memory");
+}
+
+static inline void nova_flush_buffer(void *buf, uint32_t len, bool fence)
+{
+	uint32_t i;
+
+	if (!nova_user_flush)
+		return;
+	len = len + ((unsigned long)(buf) & (CACHELINE_SIZE - 1));
+	for (i = 0; i < len; i += CACHELINE_SIZE)
+		__asm__ __volatile__("clflush %0" : "+m" (*((volatile char *)buf + i)));
+	if (fence)
+		PERSISTENT_BARRIER();
+}
+
+static inline u32 nova_crc32c(u32 crc, const u8 *data, size_t len)
+{
+	return crc32c(crc, data, len);
+}
+
+/* Callers pass kernel buffers, so there is nothing to fault on */
+static inline int memcpy_to_pmem_nocache(void *dst, const void *src,
+	unsigned int size)
+{
+	memcpy(dst, src, size);
+	return 0;
+}
+
+static inline void nova_memunlock_range(struct super_block *sb, void *p,
+	unsigned long len)
+{
+}
+
+static inline void nova_memlock_range(struct super_block *sb, void *p,
+	unsigned long len)
+{
+}
+
+static inline void *nova_get_block(struct super_block *sb, u64 block)
+{
+	struct nova_super_block *ps = nova_get_super(sb);
+
+	return block ? ((void *)ps + block) : NULL;
+}
+
+static inline u64
+nova_get_block_off(struct super_block *sb, unsigned long blocknr,
+		    unsigned short btype)
+{
+	return (u64)blocknr << PAGE_SHIFT;
+}
+
+static inline int nova_get_cpuid(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	return smp_processor_id() % sbi->cpus;
+}
+
+/* balloc.h, backed by the block allocator in kshim.c */
+enum nova_alloc_init {ALLOC_NO_INIT = 0,
+		      ALLOC_INIT_ZERO = 1};
+
+int nova_new_data_block(struct super_block *sb, unsigned long *blocknr,
+	enum nova_alloc_init zero);
+int nova_free_data_block(struct super_block *sb, unsigned long blocknr);
+int nova_new_data_superpage(struct super_block *sb, unsigned long *blocknr);
+int nova_free_data_superpage(struct super_block *sb, unsigned long blocknr);
+
+/* parity.c, data_csum and data_parity stay 0 in user space */
+u32 nova_calc_block_stripe_csums(const u8 *block, u32 *crc);
+int nova_update_block_csum_parity_precomputed(struct super_block *sb,
+	const u8 *block, unsigned long blocknr, const u32 *crc);
+
+/* nova_trace.h, arguments are evaluated but nothing is recorded */
+static inline void nova_trace_nop(int unused, ...)
+{
+}
+
+#define trace_nova_dedup_mode(...)		nova_trace_nop(0, __VA_ARGS__)
+#define trace_nova_dedup_lookup(...)		nova_trace_nop(0, __VA_ARGS__)
+#define trace_nova_dedup_entry_alloc(...)	nova_trace_nop(0, __VA_ARGS__)
+#define trace_nova_dedup_entry_free(...)	nova_trace_nop(0, __VA_ARGS__)
+#define trace_nova_dedup_ref_get(...)		nova_trace_nop(0, __VA_ARGS__)
+#define trace_nova_dedup_ref_put(...)		nova_trace_nop(0, __VA_ARGS__)
+#define trace_nova_dedup_non_fin(...)		nova_trace_nop(0, __VA_ARGS__)
+
+/* stats.c */
+u64 nova_sum_timing_stat(int name, u64 *count);
+u64 nova_sum_IO_stat(int name);
+
+/* kshim.c */
+struct super_block *nova_user_mount(const char *path, unsigned long size,
+	int cpus, u32 dedup_mode);
+void nova_user_umount(struct super_block *sb);
+void nova_user_thread_init(int cpu);
+extern unsigned int nova_user_index_mb;
+extern int nova_user_pindex;
+extern int nova_user_compact;
+void nova_user_fold_stats(void);
+unsigned long nova_user_free_blocks(struct super_block *sb);
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Multi-threaded driver for the user-space build of the NV-Dedup engine
+ *
+ * Every thread writes its blocks through nova_dedup_new_write(), a dup
+ * percent of them copies of a hot set shared by all threads, then frees
+ * them again. Both phases are timed, and the pool is checked for blocks
+ * the refcounts failed to return.
+ *
+ *   nvdedup-bench [-f pool] [-s poolmb] [-t threads] [-n blocks]
+ *                 [-d dup%] [-m auto|off|non_fin|ws_fin|str_fin]
+ *                 [-p parallel_fp_kb] [-b index_mb] [-P] [-C]
+ *                 [-T measure_timing] [-F]
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <getopt.h>
+#include <sched.h>
+#include "../dedup.h"
+
+/* Distinct contents in the hot set the duplicates are drawn from */
+#define BENCH_HOT_BLOCKS	1024
+
+struct bench_thread {
+	pthread_t thread;
+	int id;
+	unsigned long *blocknrs;
+	unsigned long written;
+	int err;
+};
+
+static struct super_block *sb;
+static pthread_barrier_t barrier;
+static unsigned long nr_blocks = 4096;
+static unsigned int dup_percent = 50;
+static int nr_threads = 1;
+static u64 phase_start[2], phase_end[2];
+
+/* sys/sysinfo.h would pull in the system linux/ headers the shims hide */
+static int online_cpus(void)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return 1;
+	return CPU_COUNT(&set);
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u64 bench_rand(u64 *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* Contents are a function of the seed only, so equal seeds dedup */
+static void bench_fill(u64 *block, u64 seed)
+{
+	u64 state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(u64); i++)
+		block[i] = bench_rand(&state);
+}
+
+static void bench_phase_mark(u64 *mark, bool end)
+{
+	u64 t = now_ns(), old;
+
+	/* the first thread in starts the phase, the last one out ends it */
+	do {
+		old = READ_ONCE(*mark);
+		if (old && (end ? old >= t : old <= t))
+			return;
+	} while (cmpxchg(mark, old, t) != old);
+}
+
+static void *bench_main(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct nova_dedup_chunk chunk = { NULL };
+	u64 state = bt->id * 2654435761ULL + 7, seed;
+	u64 *block;
+	unsigned long i;
+	int ret;
+
+	nova_user_thread_init(bt->id % nova_user_cpus);
+	block = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	if (block == NULL) {
+		bt->err = -ENOMEM;
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+		goto out;
+	}
+	chunk.data = (const char *)block;
+
+	pthread_barrier_wait(&barrier);
+	bench_phase_mark(&phase_start[0], false);
+	for (i = 0; i < nr_blocks; i++) {
+		if (bench_rand(&state) % 100 < dup_percent)
+			seed = bench_rand(&state) % BENCH_HOT_BLOCKS;
+		else
+			seed = BENCH_HOT_BLOCKS + (u64)bt->id * nr_blocks + i;
+		bench_fill(block, seed);
+		ret = nova_dedup_new_write(sb, &chunk, &bt->blocknrs[i]);
+		if (ret < 0) {
+			bt->err = ret;
+			break;
+		}
+	}
+	bt->written = i;
+	bench_phase_mark(&phase_end[0], true);
+
+	pthread_barrier_wait(&barrier);
+	bench_phase_mark(&phase_start[1], false);
+	for (i = 0; i < bt->written; i++)
+		if (nova_dedup_free_block(sb, bt->blocknrs[i]))
+			nova_free_data_block(sb, bt->blocknrs[i]);
+	bench_phase_mark(&phase_end[1], true);
+
+out:
+	free(block);
+	nova_user_fold_stats();
+	return NULL;
+}
+
+static void bench_report(const char *phase, int i, unsigned long blocks)
+{
+	u64 nsec = phase_end[i] - phase_start[i];
+
+	printf("%-6s %10lu blocks %10.1f MB/s %8.0f ns/block\n", phase, blocks,
+	       nsec ? (double)blocks * PAGE_SIZE * 1000 / nsec : 0,
+	       blocks ? (double)nsec * nr_threads / blocks : 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f pool] [-s poolmb] [-t threads] "
+		"[-n blocks per thread] [-d dup%%]\n"
+		"       [-m auto|off|non_fin|ws_fin|str_fin] "
+		"[-p parallel_fp_kb] [-b index_mb] [-P] [-C] [-T measure_timing] [-F]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_thread *threads;
+	const char *path = NULL;
+	unsigned long poolmb = 1024, written = 0, free_before;
+	unsigned long table_before, table_blocks;
+	u32 mode = 0;
+	int parallel_kb = -1, opt, i, err = 0;
+
+	while ((opt = getopt(argc, argv, "f:s:t:n:d:m:p:b:PCT:F")) != -1) {
+		switch (opt) {
+		case 'f':
+			path = optarg;
+			break;
+		case 's':
+			poolmb = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			dup_percent = atoi(optarg);
+			break;
+		case 'm':
+			if (nova_dedup_parse_mode(optarg, &mode))
+				usage(argv[0]);
+			break;
+		case 'p':
+			parallel_kb = atoi(optarg);
+			break;
+		case 'b':
+			nova_user_index_mb = atoi(optarg);
+			break;
+		case 'P':
+			nova_user_pindex = 1;
+			break;
+		case 'C':
+			nova_user_compact = 1;
+			break;
+		case 'T':
+			measure_timing = atoi(optarg);
+			break;
+		case 'F':
+			nova_user_flush = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_threads < 1 || nr_blocks == 0 || dup_percent > 100)
+		usage(argv[0]);
+
+	sb = nova_user_mount(path, poolmb << 20, online_cpus(), mode);
+	if (sb == NULL) {
+		fprintf(stderr, "cannot set up a %lu MB pool\n", poolmb);
+		return 1;
+	}
+	if (parallel_kb >= 0)
+		NOVA_SB(sb)->dedup_ctl.parallel_fp_kb = parallel_kb;
+	free_before = nova_user_free_blocks(sb);
+	table_before = NOVA_SB(sb)->entry_nr_chunks;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	pthread_barrier_init(&barrier, NULL, nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].id = i;
+		threads[i].blocknrs = calloc(nr_blocks, sizeof(unsigned long));
+		if (threads[i].blocknrs == NULL)
+			return 1;
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i].thread, NULL, bench_main, &threads[i]);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		written += threads[i].written;
+		if (threads[i].err && !err)
+			err = threads[i].err;
+	}
+
+	printf("mode %s, %d threads, dup %u%%, pool %lu MB\n",
+	       nova_dedup_mode_name(mode), nr_threads, dup_percent, poolmb);
+	bench_report("write", 0, written);
+	bench_report("free", 1, written);
+	printf("stored %llu of %llu blocks, %llu dedup off\n",
+	       (unsigned long long)nova_sum_IO_stat(dedup_stored_blocks),
+	       (unsigned long long)nova_sum_IO_stat(dedup_logical_blocks),
+	       (unsigned long long)nova_sum_IO_stat(dedup_off_blocks));
+	if (NOVA_SB(sb)->index_slots)
+		printf("index %lu slots, %llu evictions, %llu misses on evicted\n",
+		       NOVA_SB(sb)->index_nr_slots,
+		       (unsigned long long)nova_sum_IO_stat(index_evictions),
+		       (unsigned long long)nova_sum_IO_stat(index_evicted_miss));
+	if (nova_dedup_pindex(NOVA_SB(sb)))
+		printf("PMEM index %lu KB, %llu entries left out on full buckets\n",
+		       NOVA_SB(sb)->pindex_blocks << (PAGE_SHIFT - 10),
+		       (unsigned long long)nova_sum_IO_stat(pindex_full));
+	if (err)
+		printf("writes stopped early: error %d\n", err);
+
+	/* the entry table keeps the blocks it grew into */
+	nova_drain_entry_reclaim(sb);
+	table_blocks = NOVA_SB(sb)->entry_nr_chunks - table_before;
+	printf("entry table grew by %lu blocks of %luB entries\n", table_blocks,
+	       1UL << NOVA_SB(sb)->entry_shift);
+	if (nova_user_free_blocks(sb) + table_blocks != free_before) {
+		printf("leaked %ld blocks\n", (long)(free_before - table_blocks -
+					       nova_user_free_blocks(sb)));
+		err = -EIO;
+	}
+
+	nova_user_umount(sb);
+	for (i = 0; i < nr_threads; i++)
+		free(threads[i].blocknrs);
+	free(threads);
+	return err ? 1 : 0;
+}